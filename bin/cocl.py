@@ -57,6 +57,9 @@ Usage: cocl [options] <targetfile>
   -c compile to .o only, dont link
   -o final output filepath
   --clang-home Path to llvm4.0
+  --devicell-format [text|bitcode] How to store device code in the output, default text.
+                   bitcode is compressed, and is smaller and faster to load
+  --devicecl-aot   Generate the OpenCL for each kernel now, rather than the first time it runs
 
   Options passed through to clang compiler:
     -fPIC
@@ -88,6 +91,8 @@ COCL_LIB = os.environ.get('COCL_LIB', '')
 COCL_INCLUDE = os.environ.get('COCL_INCLUDE', '')
 CLANG_HOME = os.environ.get('CLANG_HOME', '')
 COCL_BIN = os.environ.get('COCL_BIN', '')
+DEVICELL_FORMAT = 'text'
+DEVICECL_AOT = False
 INCLUDES = []
 INFILES = []
 
@@ -142,6 +147,14 @@ while len(args) > 0:
         elif THISARG == '--cocl-include':
             COCL_INCLUDE = args[1]
             args = args[1:]
+        elif THISARG == '--devicell-format':
+            DEVICELL_FORMAT = args[1]
+            args = args[1:]
+        elif THISARG.startswith('--devicell-format='):
+            # this form is easier to pass through cmake COMPILE_FLAGS
+            DEVICELL_FORMAT = THISARG.split('=')[1]
+        elif THISARG == '--devicecl-aot':
+            DEVICECL_AOT = True
         elif THISARG in ['-?', '-h', '-help']:
             display_help()
             sys.exit(0)
@@ -165,6 +178,10 @@ if CLANG_HOME == '':
     print('Please specify CLANG_HOME, eg using --clang-home /usr/local/opt/llvm-4.0')
     sys.exit(-1)
 
+if DEVICELL_FORMAT not in ['text', 'bitcode']:
+    print('--devicell-format should be text or bitcode')
+    sys.exit(-1)
+
 if COCL_HOME == '':
     COCL_HOME = path.dirname(SCRIPT_DIR)
 
@@ -345,6 +362,18 @@ for infile in INFILES:
         ]
     )
 
+    deviceside_patch_args = []
+    if DEVICECL_AOT:
+        # ir-to-opencl: -device.ll => -device.clkernels
+        # the runtime uses this, instead of generating the opencl itself, where it can
+        run([
+                join(COCL_BIN, 'ir-to-opencl'),
+                '--inputfile', '%s-device.ll' % OUTPUTBASEPATH,
+                '--outputfile', '%s-device.clkernels' % OUTPUTBASEPATH,
+                '--all-kernels'
+            ])
+        deviceside_patch_args = ['--deviceclfile', '%s-device.clkernels' % OUTPUTBASEPATH]
+
     # host-side: -.cu => -hostraw.cll
     cmdline_list = (
         [join(CLANG_HOME, 'bin', 'clang++')] +
@@ -381,8 +410,9 @@ for infile in INFILES:
             join(COCL_BIN, 'patch_hostside'),
             '--hostrawfile', '%s-hostraw.ll' % OUTPUTBASEPATH,
             '--devicellfile', '%s-device.ll' % OUTPUTBASEPATH,
-            '--hostpatchedfile', '%s-hostpatched.ll' % OUTPUTBASEPATH
-        ])
+            '--hostpatchedfile', '%s-hostpatched.ll' % OUTPUTBASEPATH,
+            '--devicellformat', DEVICELL_FORMAT
+        ] + deviceside_patch_args)
 
     # -hostpatched.ll => .o
     run(
@@ -13,6 +13,7 @@
 
 #include "cocl/cocl_memory.h"
 #include "cocl/cocl_streams.h"
+#include "cocl/cocl_graphs.h"
 #include "cocl/cocl_context.h"
 #include "cocl/cocl_device.h"
 #include "cocl/cocl_error.h"
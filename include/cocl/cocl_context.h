@@ -4,8 +4,12 @@
 
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <memory>
+#include <vector>
+#include <string>
 #include <mutex>
+#include <atomic>
 
 extern "C" {
     size_t cuCtxSynchronize(void);
@@ -32,6 +36,8 @@ namespace easycl {
 
 namespace cocl {
     class Memory;
+    class MemoryPool;
+    class HostAllocation;
     class CoclStream;
 
     class KernelInfo {
@@ -39,6 +45,49 @@ namespace cocl {
         // CLKernel *kernel = 0;
         bool usesVmem = false;
         bool usesScratch = false;
+        bool usesDynamicShared = false;
+    };
+
+    // what kernelGo last set one arg of a cl_kernel to
+    class KernelArgSlot {
+    public:
+        bool isSet = false;
+        size_t size = 0;
+        bool hasValue = false;  // false for local memory, and null pointers
+        uint64_t value = 0;
+    };
+
+    // one per built kernel. kernelGo sets args on the cl_kernel directly, rather than through
+    // CLKernel, and remembers what it set, so repeat launches only call clSetKernelArg for the
+    // args which changed. cl_mem args are never remembered, since handles get reused
+    class KernelLaunchState {
+    public:
+        std::mutex mutex;  // hold whilst setting args on, and running, the kernel
+        cl_kernel clkernel = 0;  // NOT owned: the CLKernel releases it
+        std::vector<cocl::KernelArgSlot> lastArgs;  // guarded by mutex
+    };
+
+    // a kernel, built for one pattern of which pointer args share a buffer
+    class KernelVariant {
+    public:
+        std::vector<int> clmemIndexByClmemArgIndex;
+        int vmemSegmentCount = 1;
+        std::string uniqueKernelName;
+        easycl::CLKernel *kernel = 0;  // NOT owned: EasyCL deletes it
+        cocl::KernelLaunchState *launchState = 0;  // NOT owned: the Context owns it
+        cocl::KernelInfo kernelInfo;
+    };
+
+    // one per kernel launched from each embedded device code, created the first time
+    // configureKernel sees it. Repeat launches find their kernel here, by a hash of
+    // clmemIndexByClmemArgIndex, rather than by building uniqueKernelName, and looking that up in
+    // the string-keyed caches, which are only used on a miss
+    class KernelSite {
+    public:
+        // set once any variant is found to use vmem, so later launches pass in all the vmem segments
+        // from the start
+        std::atomic<bool> usesVmem{false};
+        std::unordered_map<uint64_t, std::vector<std::unique_ptr<cocl::KernelVariant> > > variantsByHash;
     };
 
     class Context {
@@ -51,14 +100,47 @@ namespace cocl {
         std::map<std::string, cocl::KernelInfo> kernelInfoByUniqueName;
         std::map<std::string, std::string > clSourceCodeCache;
         std::set<cocl::Memory *>memories;
-        long long nextAllocPos = 1;
-        std::map< long long, cocl::Memory *>memoryByAllocPos;
-        int numKernelCalls = 0;
+        // the Memory in each vmem segment, from segment 1 on, or 0 if the segment is free. The lowest
+        // free segment is reused first, and free segments at the end are dropped, so this only
+        // reaches as far as the highest segment in use, which kernels using vmem need a buffer arg for
+        std::vector<cocl::Memory *> vmemSegments;
+        std::set<size_t> freeVmemSegments;  // the free segments before the end of vmemSegments
+        std::map< long long, cocl::Memory *>memoryByAllocPos;  // keyed on fakePos, for range lookups in findMemory
+        std::unordered_map<cl_mem, cocl::Memory *> memoryByClmem;
+        // incremented whenever a Memory is created or destroyed, so threads can cache their last
+        // findMemory result, and check it is still valid without taking the context mutex
+        std::atomic<uint64_t> memoryGeneration{0};
+        std::unique_ptr<cocl::MemoryPool> memoryPool;  // guarded by mu, like the maps above
+        std::map<const char *, cocl::HostAllocation *> hostAllocationsByPos;  // pinned host memory, keyed on hostPos. guarded by mu
+        std::atomic<int> numHostAllocations{0};  // so launches can skip looking for them, without the mutex
+        std::atomic<int> numKernelCalls{0};
+
+        // launch state is per-thread, so only these caches are shared between threads using
+        // this context.  Each has its own lock, so threads dont serialize on each other's launches
+        std::mutex kernelCacheMutex;  // kernelCache, kernelLaunchStates, and building kernels (EasyCL isnt threadsafe)
+        std::mutex clSourceCodeCacheMutex;  // clSourceCodeCache and kernelInfoByUniqueName
+        // keyed on the kernelName and devicellcode pointers passed to configureKernel. These point at
+        // constants embedded in the host binary by patch_hostside, so are the same for every launch
+        std::map<std::pair<const char *, const char *>, std::unique_ptr<cocl::KernelSite> > kernelSites;
+        std::mutex kernelSitesMutex;  // kernelSites, and the variants in each
+        // a cl_kernel holds its args internally, so setting args and running need to be
+        // atomic, per kernel
+        std::map<easycl::CLKernel *, std::unique_ptr<cocl::KernelLaunchState> > kernelLaunchStates;
         const int gpuOrdinal;
+        size_t localMemSize = 0;  // CL_DEVICE_LOCAL_MEM_SIZE, for checking dynamic shared memory sizes
+        size_t maxParameterSize = 0;  // CL_DEVICE_MAX_PARAMETER_SIZE, for checking the vmem segment table fits
         easycl::EasyCL *getCl() {
             return cl.get();
         }
         std::mutex mu;
+
+        // streams created via cuStreamCreate, so that device/context-wide synchronization
+        // can wait on all of them, now that kernel launches no longer block
+        std::set<cocl::CoclStream *> streams;
+        std::mutex streamsMutex;
+        void registerStream(cocl::CoclStream *stream);
+        void unregisterStream(cocl::CoclStream *stream);
+        void synchronize();  // waits for all work on the default stream, and all registered streams
     };
 
     class ContextMutex {
@@ -76,6 +158,7 @@ namespace cocl {
         cocl::Context *currentContext = 0;
         int currentGpuOrdinal = 0;
         bool offsets_32bit = false;
+        bool launchBlocking = false;  // COCL_LAUNCH_BLOCKING=1: wait for each kernel to finish
     };
 
     ThreadVars *getThreadVars();
@@ -6,3 +6,9 @@
 #else
    #define COCL_PRINT(expr)
 #endif
+
+// device pointers, from cudaMalloc et al, are (segment << COCL_VMEM_SEGMENT_SHIFT) + offset, with a
+// segment per allocation, so no allocation can be bigger than 1 << COCL_VMEM_SEGMENT_SHIFT bytes.
+// Kernels map pointers they load from device memory, eg from a float **, back to a buffer by
+// indexing a table of the segments' buffers: see getGlobalPointer, in kernel_dumper.cpp
+#define COCL_VMEM_SEGMENT_SHIFT 32
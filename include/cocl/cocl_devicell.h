@@ -0,0 +1,35 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// device code is embedded into host binaries, by patch_hostside, in one of two formats:
+// - textual IR (the default)
+// - bitcode, optionally zlib-compressed, prefixed with a small header, so the runtime can tell
+//   the two apart, and knows how many bytes there are
+//
+// bitcode is much smaller than the text, and much faster to parse
+
+#pragma once
+
+#include <string>
+
+namespace cocl {
+
+// returns the bytes to embed, for the given bitcode
+std::string encodeDeviceBitcode(const std::string &bitcode, bool compress);
+// embedded is whatever patch_hostside embedded, ie text, or encoded bitcode
+bool isEncodedDeviceBitcode(const char *embedded);
+// returns the textual IR, or the decompressed bitcode. llvm::parseIR accepts either
+std::string decodeDeviceCode(const char *embedded);
+
+} // namespace cocl
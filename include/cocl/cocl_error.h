@@ -84,6 +84,10 @@ enum cudaerrors {
     cudaErrorInvalidMemcpyDirection,
     cudaErrorInvalidChannelDescriptor,
     cudaErrorNotSupported,
+    cudaErrorStreamCaptureUnsupported,
+    cudaErrorStreamCaptureInvalidated,
+    cudaErrorStreamCaptureUnmatched,
+    cudaErrorIllegalState,
     cudaErrorApiFailureBase  // not sure what this is, but it's used in a comparison, in thrust: if(ev < ::cudaErrorApiFailureBase)  <= might need special handling somehow
 };
 
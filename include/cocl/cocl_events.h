@@ -14,6 +14,7 @@ namespace cocl {
         ~CoclEvent();
         // bool has_event();
         cl_event event = 0;
+        bool timingDisabled = false;  // created with CU_EVENT_DISABLE_TIMING/cudaEventDisableTiming
     };
 }
 
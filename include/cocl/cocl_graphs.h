@@ -0,0 +1,131 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// cuda graphs, via stream capture
+//
+// Between cudaStreamBeginCapture and cudaStreamEndCapture, kernel launches, cudaMemcpyAsync and
+// cudaMemsetAsync on the stream are not queued. Instead, they go through the usual launch path as
+// far as having a built kernel, and resolved buffers, offsets and work sizes, and are recorded
+// into a CoclGraph. cudaGraphInstantiate gives each recorded launch its own cl_kernel, with all its
+// args set once, up front, so cudaGraphLaunch is just one enqueue per command, with no cache
+// lookups, and no clSetKernelArg
+//
+// As for cuda:
+// - by-value args are the values at capture time. Pointer args, and host pointers of copies, are
+//   used as-is at launch time, so their memory must still be allocated
+// - captured commands run in the order they were captured. Only one stream can be captured into
+//   a graph, and the legacy default stream cant be captured
+// - launches of the same CoclGraphExec run one after another, even on different streams
+
+#pragma once
+
+#include "cocl/cocl_streams.h"
+
+#include "EasyCL/EasyCL.h"
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <cstdint>
+
+namespace cocl {
+    // one captured command, with everything resolved, so replaying it is a single enqueue
+    class GraphNode {
+    public:
+        enum Type {
+            Kernel,
+            CopyHtoD,
+            CopyDtoH,
+            CopyDtoD,
+            Fill
+        };
+        // what to set one kernel arg to. Values are all at most 8 bytes. Local memory has only a size
+        class KernelArg {
+        public:
+            size_t size;
+            bool hasValue;
+            uint64_t value;
+        };
+        Type type;
+        std::string name;  // for tracing
+
+        // kernels
+        cl_kernel clkernel = 0;  // retained. The kernel kernelGo would have run
+        std::vector<KernelArg> args;
+        size_t global[3];
+        size_t block[3];
+
+        // copies and fills
+        cl_mem src = 0;
+        size_t srcOffset = 0;
+        cl_mem dst = 0;
+        size_t dstOffset = 0;
+        size_t bytes = 0;
+        const void *hostSrc = 0;  // CopyHtoD
+        void *hostDst = 0;  // CopyDtoH
+        unsigned char value = 0;  // Fill
+    };
+
+    class CoclGraph {
+    public:
+        ~CoclGraph();
+        // resolve the device pointers, and record a copy/fill. Throw if a pointer isnt in any allocation
+        void addMemcpy(void *dst, const void *src, size_t bytes, size_t kind);
+        void addMemset(void *location, int value, size_t bytes);
+        std::vector<GraphNode> nodes;
+        std::vector<cl_mem> ownedBuffers;  // by-value structs, uploaded at capture time
+        CoclStream *captureStream = 0;  // whilst still being captured
+        bool invalidated = false;  // something on the stream couldnt be captured
+    };
+
+    class CoclGraphExec {
+    public:
+        CoclGraphExec(const CoclGraph *graph);
+        ~CoclGraphExec();
+        void launch(CoclStream *stream);
+    private:
+        std::vector<GraphNode> nodes;  // kernel nodes have their own cl_kernel, with the args already set
+        std::vector<cl_mem> ownedBuffers;  // retained, so the graph can be destroyed first
+        std::mutex mutex;  // guards below
+        cl_command_queue lastQueue = 0;
+        cl_event lastLaunchDone = 0;  // marker after the last launch, for launches on other queues to wait for
+    };
+}
+
+enum cudaStreamCaptureMode {
+    cudaStreamCaptureModeGlobal = 0,
+    cudaStreamCaptureModeThreadLocal = 1,
+    cudaStreamCaptureModeRelaxed = 2
+};
+
+enum cudaStreamCaptureStatus {
+    cudaStreamCaptureStatusNone = 0,
+    cudaStreamCaptureStatusActive = 1,
+    cudaStreamCaptureStatusInvalidated = 2
+};
+
+extern "C" {
+    size_t cudaStreamBeginCapture(char *stream, int mode=0);
+    size_t cudaStreamEndCapture(char *stream, cocl::CoclGraph **pGraph);
+    size_t cudaStreamIsCapturing(char *stream, cudaStreamCaptureStatus *pCaptureStatus);
+    size_t cudaGraphInstantiate(cocl::CoclGraphExec **pGraphExec, cocl::CoclGraph *graph,
+        void **pErrorNode=0, char *pLogBuffer=0, size_t bufferSize=0);
+    size_t cudaGraphLaunch(cocl::CoclGraphExec *graphExec, char *stream);
+    size_t cudaGraphExecDestroy(cocl::CoclGraphExec *graphExec);
+    size_t cudaGraphDestroy(cocl::CoclGraph *graph);
+}
+
+typedef cocl::CoclGraph *cudaGraph_t;
+typedef cocl::CoclGraphExec *cudaGraphExec_t;
+typedef void *cudaGraphNode_t;
@@ -2,139 +2,79 @@
 
 #include "EasyCL/EasyCL.h"
 
-#include "llvm/Support/Casting.h" // for llvm rtti
-
 #include <string>
+#include <cstdint>
 
 namespace cocl {
-    // These Arg classes store kernel parameter values, which we can use
-    // at kernel creation time, and then pass into the kernel at that point
+    // An Arg stores one kernel parameter value, which we can use at kernel creation time, and
+    // then pass into the kernel at that point
     // we dont create the kernel until the actual launch command (which is after
     // the kernelSetArg commands), so we have all the information available at that
     // time about what kernel arguments we have
     // concretely, it means we can dedupe the underlying cl_mem buffers, for example
+    //
+    // Args are plain tagged values, so the per-thread LaunchConfiguration keeps them in a vector
+    // which it reuses from launch to launch, without allocating
     class Arg {
     public:
         enum ArgKind {
-            AK_Base,
             AK_Int8Arg,
             AK_Int32Arg,
             AK_UInt32Arg,
             AK_Int64Arg,
             AK_FloatArg,
             AK_NullPtrArg,
-            AK_ClmemArg,
-            AK_StructArg
+            AK_ClmemArg
         };
-        Arg(ArgKind kind=AK_Base) : Kind(kind) {}
-        virtual ~Arg() {}
-        virtual void inject(easycl::CLKernel *kernel) = 0;
-        virtual std::string str() = 0;
+        static Arg int8(char v) { Arg arg(AK_Int8Arg); arg.v.i8 = v; return arg; }
+        static Arg int32(int32_t v) { Arg arg(AK_Int32Arg); arg.v.i32 = v; return arg; }
+        static Arg uint32(uint32_t v) { Arg arg(AK_UInt32Arg); arg.v.u32 = v; return arg; }
+        static Arg int64(int64_t v) { Arg arg(AK_Int64Arg); arg.v.i64 = v; return arg; }
+        static Arg float32(float v) { Arg arg(AK_FloatArg); arg.v.f = v; return arg; }
+        static Arg nullPtr() { return Arg(AK_NullPtrArg); }
+        static Arg clmem(cl_mem v) { Arg arg(AK_ClmemArg); arg.v.clmem = v; return arg; }
 
-    private:
-        const ArgKind Kind;
+        // for an offset arg, which is uint32 with COCL_OFFSETS_32BIT, otherwise int64
+        uint64_t getOffset() const { return kind == AK_UInt32Arg ? v.u32 : (uint64_t)v.i64; }
+        void addToOffset(uint64_t delta) {
+            if(kind == AK_UInt32Arg) {
+                v.u32 += (uint32_t)delta;
+            } else {
+                v.i64 += (int64_t)delta;
+            }
+        }
 
-    public:
-        ArgKind getKind() const { return Kind; }
+        // the size and address to pass to clSetKernelArg
+        size_t size() const {
+            switch(kind) {
+                case AK_Int8Arg: return sizeof(char);
+                case AK_Int32Arg: return sizeof(int32_t);
+                case AK_UInt32Arg: return sizeof(uint32_t);
+                case AK_Int64Arg: return sizeof(int64_t);
+                case AK_FloatArg: return sizeof(float);
+                case AK_NullPtrArg: return sizeof(cl_mem);
+                case AK_ClmemArg: return sizeof(cl_mem);
+            }
+            return 0;
+        }
+        const void *data() const {
+            return kind == AK_NullPtrArg ? 0 : (const void *)&v;
+        }
+        std::string str() const;
 
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_Base;
-        }
-    };
-    class Int8Arg : public Arg {
-    public:
-        Int8Arg(char v) : Arg(AK_Int8Arg), v(v) {}
-        void inject(easycl::CLKernel *kernel) {
-            kernel->in_char(v);
-        }
-        virtual std::string str() { return "Int8Arg"; }
-        char v;
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_Int8Arg;
-        }
-    };
-    class Int32Arg : public Arg {
-    public:
-        Int32Arg(int v) : Arg(AK_Int32Arg), v(v) {}
-        void inject(easycl::CLKernel *kernel) {
-            kernel->in_int32(v);
-        }
-        virtual std::string str();
-        int v;
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_Int32Arg;
-        }
-    };
-    class UInt32Arg : public Arg {
-    public:
-        UInt32Arg(uint32_t v) : Arg(AK_UInt32Arg), v(v) {}
-        void inject(easycl::CLKernel *kernel) {
-            kernel->in_uint32(v);
-        }
-        virtual std::string str() { return "UInt32Arg"; }
-        uint32_t v;
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_UInt32Arg;
-        }
-    };
-    class Int64Arg : public Arg {
-    public:
-        Int64Arg(int64_t v) : Arg(AK_Int64Arg), v(v) {}
-        void inject(easycl::CLKernel *kernel) {
-            kernel->in_int64(v);
-        }
-        virtual std::string str();
-        int64_t v;
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_Int64Arg;
-        }
-    };
-    class FloatArg : public Arg {
-    public:
-        FloatArg(float v) : Arg(AK_FloatArg), v(v) {}
-        void inject(easycl::CLKernel *kernel) {
-            kernel->in_float(v);
-        }
-        virtual std::string str() { return "FloatArg"; }
-        float v;
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_FloatArg;
-        }
-    };
-    class NullPtrArg : public Arg {
-    public:
-        NullPtrArg() : Arg(AK_NullPtrArg) {}
-        void inject(easycl::CLKernel *kernel) {
-            kernel->in_nullptr();
-        }
-        virtual std::string str() { return "NullPtrArg"; }
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_NullPtrArg;
-        }
-    };
-    class ClmemArg : public Arg {
-    public:
-        ClmemArg(cl_mem v) : Arg(AK_ClmemArg), v(v) {}
-        void inject(easycl::CLKernel *kernel) {
-            kernel->inout(&v);
-        }
-        virtual std::string str() { return "ClmemArg"; }
-        cl_mem v;
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_ClmemArg;
-        }
-    };
-    class StructArg : public Arg {
-    public:
-        StructArg(char *pCpuStruct, int structAllocateSize) :
-            Arg(AK_StructArg),
-            pCpuStruct(pCpuStruct), structAllocateSize(structAllocateSize)
-        {}
-        virtual std::string str() { return "StructArg"; }
-        char *pCpuStruct;
-        int structAllocateSize;
-        static bool classof(const Arg *arg) {
-            return arg->getKind() == AK_StructArg;
+        ArgKind kind;
+        union {
+            char i8;
+            int32_t i32;
+            uint32_t u32;
+            int64_t i64;
+            float f;
+            cl_mem clmem;
+        } v;
+
+    private:
+        Arg(ArgKind kind) : kind(kind) {
+            v.i64 = 0;
         }
     };
 } // namespace cocl
@@ -3,28 +3,137 @@
 #include "clew.h"
 
 #include <cstdint>
+#include <vector>
+#include <map>
+#include <deque>
+#include <mutex>
 
 namespace cocl {
+    class HostAllocation;
+
     class Memory {
     protected:
         Memory(cl_mem clmem, size_t bytes);
 
      public:
         static Memory *newDeviceAlloc(size_t bytes);
+        // wraps a buffer owned by a HostAllocation, so kernels can address it, via a device pointer
+        static Memory *newHostMapped(HostAllocation *hostAllocation, cl_mem clmem, size_t bytes);
         ~Memory();
         size_t getOffset(const char *passedInAsCharStar);
         cl_mem clmem; // this is assumed to always be valid
         size_t bytes; // should always be valid (ideally > 0...)
         size_t fakePos; // the range (fakePos) to (fakePos + bytes) should not overlap with any other memory
         // otherwise, problems :-P
+        size_t vmemSegment; // fakePos >> COCL_VMEM_SEGMENT_SHIFT
+        size_t allocatedBytes = 0; // actual size of clmem, which might be rounded up by the memory pool
+        HostAllocation *hostAllocation = 0; // set if clmem belongs to a HostAllocation, not to the memory pool
     };
 
     Memory *findMemory(const char *passedInPointer);
     Memory *findMemoryByClmem(cl_mem clmem);
+
+    // pinned host memory, from cuMemHostAlloc/cudaHostAlloc. It is an OpenCL buffer created with
+    // CL_MEM_ALLOC_HOST_PTR, mapped for the host whenever the device isnt using it. Copies to and
+    // from it are device-side copies, from or to the buffer itself, which on devices sharing
+    // memory with the host, eg integrated gpus and cpus, means no copy through the host at all
+    // deviceMemory lets kernels use the buffer directly (cudaHostGetDevicePointer)
+    // OpenCL doesnt allow commands to use a buffer whilst it is mapped, so copies, fills and kernels
+    // using the buffer are bracketed by an unmap and a map, on their queue, via HostAllocationsOnDevice.
+    // As for cuda, the host shouldnt touch the memory until it has synchronized with them
+    class HostAllocation {
+    public:
+        HostAllocation(size_t bytes);
+        ~HostAllocation();
+        char *hostPos;
+        size_t bytes;
+        Memory *deviceMemory;  // owned. cudaFree refuses it; cuMemFreeHost frees it
+    protected:
+        friend class HostAllocationsOnDevice;
+        std::mutex mutex;  // held from unmapping for the device, until mapped again
+        cl_event lastMapped = 0;  // the last map, which an unmap on any queue must wait for
+    };
+
+    // returns the HostAllocation containing hostPointer, or 0 if it is pageable memory
+    HostAllocation *findHostAllocation(const void *hostPointer);
+
+    // the host allocations used by some commands on one queue. unmap() before queueing the
+    // commands, and remap() after. Both are queued, so neither waits for the device. The host
+    // pointers stay the same, but are only valid again once the queue has been synchronized
+    class HostAllocationsOnDevice {
+    public:
+        HostAllocationsOnDevice(cl_command_queue queue);
+        ~HostAllocationsOnDevice();  // remaps, if an exception skipped remap()
+        void add(Memory *memory);  // does nothing unless memory belongs to a HostAllocation
+        void addClmems(const std::vector<cl_mem> &clmems);  // cheap when there are no host allocations
+        bool empty() const { return hostAllocations.empty(); }
+        void unmap();
+        void remap();
+    protected:
+        cl_command_queue queue;
+        std::vector<HostAllocation *> hostAllocations;
+        bool unmapped = false;
+    };
+
+    class Context;
+
+    struct MemoryPoolStats {
+        uint64_t numAllocs = 0;
+        uint64_t numHits = 0;  // allocations served from the cache
+        uint64_t numFrees = 0;
+        uint64_t numDriverAllocs = 0;  // clCreateBuffer calls
+        uint64_t numDriverReleases = 0;  // clReleaseMemObject calls
+        size_t bytesRequested = 0;  // live allocations, as requested by the client
+        size_t bytesAllocated = 0;  // live allocations, after rounding up to size class
+        size_t bytesCached = 0;  // freed, and waiting to be reused
+        size_t numCachedBlocks = 0;
+        double hitRate() const;
+        double fragmentation() const;  // fraction of live allocated bytes lost to size-class rounding
+    };
+
+    // caches freed device buffers, by size class, so that cudaMalloc can usually avoid clCreateBuffer
+    // Each Context has one.  Callers must hold the context mutex
+    class MemoryPool {
+    public:
+        MemoryPool(Context *context);
+        ~MemoryPool();
+        cl_mem allocate(size_t bytes, size_t *allocatedBytes);
+        void release(cl_mem clmem, size_t allocatedBytes, size_t requestedBytes);
+        void trim(size_t maxCachedBytes);  // releases cached buffers, oldest first, until at most maxCachedBytes are cached
+
+        bool enabled = true;
+        size_t maxCachedBytes;
+        MemoryPoolStats stats;
+
+    protected:
+        struct FreeBlock {
+            cl_mem clmem;
+            uint64_t freedAt;
+            // markers on each stream, at the time of the free. Only once these have completed can
+            // we be sure no previously-launched kernel is still using the buffer
+            std::vector<cl_event> pendingEvents;
+        };
+        size_t roundUpToSizeClass(size_t bytes);
+        bool isReady(FreeBlock &block);
+        void releaseBlock(FreeBlock &block, size_t sizeClass);
+
+        Context *context;
+        uint64_t nextFreedAt = 0;
+        std::map<size_t, std::deque<FreeBlock> > freeBlocksBySizeClass;
+    };
+
+    MemoryPoolStats getMemoryPoolStats();
+    void trimMemoryPool(size_t maxCachedBytes = 0);
 }
 
 #define CU_MEMHOSTALLOC_PORTABLE 123
 
+// flags are accepted, but ignored: all host allocations are portable and mapped
+#define cudaHostAllocDefault 0
+#define cudaHostAllocPortable 1
+#define cudaHostAllocMapped 2
+#define cudaHostAllocWriteCombined 4
+
 enum MemoryTypeEnum {
     CU_MEMORYTYPE_DEVICE = 60000,
     CU_MEMORYTYPE_HOST
@@ -48,6 +157,12 @@ extern "C" {
 
     size_t cuMemHostAlloc(void **pHostPointer, unsigned int bytes, int type=CU_MEMHOSTALLOC_PORTABLE);
     size_t cuMemFreeHost(void *hostPointer);
+    size_t cuMemHostGetDevicePointer(CUdeviceptr *pDevicePointer, void *hostPointer, unsigned int flags);
+
+    size_t cudaHostAlloc(void **pHostPointer, size_t bytes, unsigned int flags);
+    size_t cudaMallocHost(void **pHostPointer, size_t bytes);
+    size_t cudaFreeHost(void *hostPointer);
+    size_t cudaHostGetDevicePointer(void **pDevicePointer, void *hostPointer, unsigned int flags);
 
     size_t cudaMemsetAsync(void *devPtr, int value, size_t count, char *queue);
     size_t cudaMemcpy(void *dst, const void *, size_t, cudaMemcpyKind kind);
@@ -78,3 +193,4 @@ size_t cudaMalloc(float **pMemory, size_t N);
 
 #define cuDeviceTotalMem_v2 cuDeviceTotalMem
 #define cuMemGetInfo_v2 cuMemGetInfo
+#define cuMemHostGetDevicePointer_v2 cuMemHostGetDevicePointer
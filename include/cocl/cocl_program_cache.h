@@ -0,0 +1,50 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// persistent, on-disk, cache of built OpenCL program binaries, so that we dont need to call
+// the OpenCL compiler for every kernel, every time a process starts
+//
+// files are keyed on a hash of the cl sourcecode, device name, driver version and build options
+// off by default, since it writes to disk. Configured using env vars:
+// - COCL_KERNEL_CACHE=1: enable, storing the binaries in ~/.coriander/kernelcache
+// - COCL_KERNEL_CACHE_DIR: enable, storing the binaries here instead
+// - COCL_KERNEL_CACHE=0: disable, even if COCL_KERNEL_CACHE_DIR is set
+// - COCL_KERNEL_CACHE_MAX_MB: once the cache is bigger than this, least-recently-used binaries are deleted
+
+#pragma once
+
+#include "EasyCL/EasyCL.h"
+
+#include <string>
+#include <cstdint>
+
+namespace cocl {
+
+struct ProgramCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writes = 0;
+    uint64_t evictions = 0;
+    uint64_t loadFailures = 0;  // cache file found, but corrupt, or driver refused the binary
+};
+
+// returns a built program, or 0 if caching is disabled, or nothing suitable is cached
+cl_program loadCachedProgram(easycl::EasyCL *cl, const std::string &clSourcecode, const std::string &options);
+// program should be already built, for cl->device
+void storeCachedProgram(easycl::EasyCL *cl, cl_program program, const std::string &clSourcecode, const std::string &options);
+ProgramCacheStats getProgramCacheStats();
+// overrides the env vars, eg for tests and benchmarks. An empty dir disables the cache
+void configureProgramCache(const std::string &dir, uint64_t maxBytes);
+
+} // namespace cocl
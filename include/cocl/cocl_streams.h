@@ -2,6 +2,11 @@
 
 #include "cocl/cocl_events.h"
 
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+
 namespace easycl {
     class EasyCL;
     class CLQueue;
@@ -32,6 +37,8 @@ typedef void (*cudacallbacktype)(char *stream, size_t status, void*userdata);
 #define cudaStreamDefault 0
 
 namespace cocl {
+    class CoclGraph;
+
     class CoclCallbackInfo {
     public:
         cudacallbacktype callback;
@@ -40,6 +47,40 @@ namespace cocl {
     };
     void coclCallback(cl_event event, cl_int status, void *userdata);
 
+    // device-side ring buffer, for uploading by-value struct kernel args, one per stream
+    // each launch packs its structs into one region of the ring, and uploads them with a single
+    // non-blocking write, on the stream's queue. Since the queue is in-order, the write always
+    // happens after earlier kernels on the stream. A region can be reused once a marker, queued
+    // after the kernel that reads it, has completed
+    // configured using env var COCL_STAGING_RING_KB (default 1024, 0 turns it off)
+    class StagingRing {
+    public:
+        StagingRing(easycl::EasyCL *cl, size_t capacity);
+        ~StagingRing();
+        // reserves a region, copies data into it, and queues the upload. returns false if there
+        // isnt room right now, without waiting, in which case the caller should use its own buffer
+        bool upload(cl_command_queue queue, const char *data, size_t bytes, size_t *offset);
+        // the region at offset is in use until event completes. takes ownership of event
+        void retire(size_t offset, cl_event event);
+        cl_mem clmem;
+    private:
+        class Region {
+        public:
+            size_t offset;
+            size_t bytes;
+            cl_event done;  // 0 whilst the launch using this region is still being queued
+        };
+        std::mutex mutex;
+        size_t capacity;
+        size_t head = 0;
+        std::deque<Region> regions;
+        std::vector<char> hostData;  // must stay untouched until the write from it has completed
+    };
+
+    // true if COCL_PROFILING=1, or COCL_TRACE is set, in which case every stream's queue is created with
+    // CL_QUEUE_PROFILING_ENABLE, so cudaEventElapsedTime can read event timestamps
+    bool isProfilingEnabled();
+
     // a coclstream:
     // - is associated with one virtual cuda stream, from the point of view of the client
     // - is associated with exactly one opencl queue
@@ -49,6 +90,21 @@ namespace cocl {
     public:
         CoclStream(easycl::EasyCL *cl);
         ~CoclStream();
+        // returns 0 if the staging ring is turned off
+        StagingRing *getStagingRing();
+        // returns true if everything queued so far has finished, without waiting. While the
+        // marker from the last call is still incomplete, this just checks that marker's status,
+        // so it is cheap enough to poll in a loop
+        bool query();
         easycl::CLQueue *clqueue;
+        // set between cudaStreamBeginCapture and cudaStreamEndCapture. Commands on the stream are
+        // recorded into it, instead of being queued
+        CoclGraph *capturingGraph = 0;
+    private:
+        easycl::EasyCL *cl;
+        std::mutex queryMutex;
+        cl_event lastQueryMarker = 0;
+        std::once_flag stagingRingCreated;
+        std::unique_ptr<StagingRing> stagingRing;
     };
 }
@@ -0,0 +1,65 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// timeline tracing of the runtime, for viewing in chrome://tracing, or https://ui.perfetto.dev
+//
+// turned on by env var COCL_TRACE=somefile.json. Spans are appended to a per-thread buffer, and
+// all the buffers are written out, as Chrome trace-event JSON, when the process exits
+//
+// host spans (TraceScope) show time spent in the runtime, on each thread. Device spans
+// (DeviceTraceSpan) show when the commands queued between start and end ran on the device. They
+// need timestamps from OpenCL, so tracing turns on COCL_PROFILING too
+
+#pragma once
+
+#include "clew.h"
+
+#include <string>
+#include <cstdint>
+
+namespace cocl {
+
+bool isTracingEnabled();
+uint64_t traceNowUs();  // microseconds since tracing started
+void traceSpan(const char *category, const std::string &name, uint64_t startUs, uint64_t endUs);
+
+// records a span from construction to destruction, on the calling thread
+class TraceScope {
+public:
+    TraceScope(const char *category, const std::string &name);
+    TraceScope(const char *category, const char *name);
+    ~TraceScope();
+private:
+    bool enabled;
+    const char *category;
+    std::string name;
+    uint64_t startUs;
+};
+
+// queues a marker on construction, and another on end(). Once the second has completed, a span
+// covering the time between them is recorded on a timeline for the queue
+// does nothing when tracing is off
+class DeviceTraceSpan {
+public:
+    DeviceTraceSpan(const char *category, const std::string &name, cl_command_queue queue);
+    DeviceTraceSpan(const char *category, const char *name, cl_command_queue queue);
+    ~DeviceTraceSpan();  // calls end(), if not already called
+    void end();
+    class Pending;  // handed to the OpenCL callback, once end() has been called
+private:
+    void start(const char *category, const std::string &name, cl_command_queue queue);
+    Pending *pending = 0;
+};
+
+} // namespace cocl
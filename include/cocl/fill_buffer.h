@@ -18,11 +18,12 @@
 
 namespace cocl {
 
-// non-blocking "async"
+// non-blocking "async". Queues a kernel setting countBytes bytes to value, from offsetBytes on.
+// Neither needs to be aligned
 int myEnqueueFillBuffer(
     cl_command_queue queue,
     cl_mem clmem,
-    unsigned int value,
-    int offsetBytes, int countInts);
+    unsigned char value,
+    size_t offsetBytes, size_t countBytes);
 
 } // namespace cocl
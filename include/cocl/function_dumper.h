@@ -125,6 +125,8 @@ public:
     llvm::Type *returnType = 0;
     bool usesVmem = false;
     bool usesScratch = false;
+    int vmemSegmentCount = 1;  // see KernelDumper::vmemSegmentCount
+    bool usesDynamicShared = false;  // see KernelDumper::usesDynamicShared
 
 protected:
     // llvm::Function::iterator block_it;
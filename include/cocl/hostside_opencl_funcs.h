@@ -20,6 +20,8 @@
 #include "cocl/cocl_launch_args.h"
 #include "cocl/hostside_opencl_funcs_ext.h"
 
+#include <mutex>
+
 namespace easycl {
     class CLKernel;
     class EasyCL;
@@ -27,6 +29,7 @@ namespace easycl {
 
 namespace cocl {
     class CoclStream;
+    class KernelSite;
 
     struct GenerateOpenCLResult {
         std::string clSourcecode;
@@ -34,9 +37,14 @@ namespace cocl {
         std::string shortKernelName;
         std::string uniqueKernelName;
     };
-    GenerateOpenCLResult generateOpenCL(int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, std::string origKernelName, std::string devicellsourcecode);
+    GenerateOpenCLResult generateOpenCL(int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, std::string origKernelName, const char *devicellcode, const char *deviceclcode,
+        int vmemSegmentCount = 1);
     easycl::CLKernel *compileOpenCLKernel(std::string originalKernelName, std::string uniqueKernelName, std::string shortKernelName, std::string clSourcecode);
     easycl::CLKernel *compileOpenCLKernel(std::string shortKernelName, std::string clSourcecode);
+    // hold this whilst setting args on, and running, a kernel returned by compileOpenCLKernel
+    std::mutex &getKernelLaunchMutex(easycl::CLKernel *kernel);
+    class KernelLaunchState;
+    KernelLaunchState *getKernelLaunchState(easycl::CLKernel *kernel);
 
 
     class LaunchConfiguration {
@@ -45,18 +53,27 @@ namespace cocl {
         size_t block[3];
         easycl::CLQueue *queue = 0;  // NOT owned by us
         cocl::CoclStream *coclStream = 0; // NOT owned
+        size_t sharedMem = 0;  // bytes of dynamic shared memory, ie extern __shared__
 
-        std::vector<std::unique_ptr<Arg> > args;
+        // the vectors are cleared after each launch, but keep their capacity, so steady-state
+        // launches dont allocate
+        std::vector<Arg> args;
 
-        std::map<cl_mem, int> clmemIndexByClmem;
-        std::vector<cl_mem> clmems;
+        std::vector<cl_mem> clmems;  // the distinct buffers, from firstArgClmemIndex on
+        size_t firstArgClmemIndex = 0;  // clmems before this were added by configureKernel, not by args
+        bool vmemLayout = false;  // the clmems before firstArgClmemIndex are all the vmem segments
         std::vector<int> clmemIndexByClmemArgIndex;
 
         std::vector<cl_mem> kernelArgsToBeReleased;
+        // by-value structs, packed together, for kernelGo to upload through the stream's StagingRing
+        std::vector<char> stagedStructs;
+        std::vector<int> stagedStructArgIndexes;  // the offset arg of each staged struct
         std::string kernelName = "";
         std::string uniqueKernelName = "";
         std::string shortKernelName = "";
-        std::string devicellsourcecode = "";
+        const char *devicellcode = 0;  // NOT owned: points at the device code embedded in the host binary
+        const char *deviceclcode = 0;  // NOT owned: OpenCL generated at build time, if any
+        cocl::KernelSite *kernelSite = 0;  // NOT owned: the Context owns it
     };
 }
 
@@ -46,7 +46,11 @@ extern "C" {
 
     size_t cuInit(unsigned int flags);
 
-    void configureKernel(const char *kernelName, const char *devicellsourcecode);
+    // kernelName and devicellcode must stay valid, and unchanged, for the life of the context: kernels
+    // are cached by these pointers. patch_hostside passes constants embedded in the host binary
+    void configureKernel(const char *kernelName, const char *devicellcode);
+    // deviceclcode is the table embedded by patch_hostside --deviceclfile
+    void configureKernelWithCl(const char *kernelName, const char *devicellcode, const char *deviceclcode);
     void addClmemArg(cl_mem clmem);
     void setKernelArgHostsideBuffer(char *pCpuStruct, int structAllocateSize);
     void setKernelArgGpuBuffer(char *memory_as_charstar, int32_t elementSize);
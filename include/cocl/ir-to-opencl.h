@@ -29,11 +29,49 @@ public:
     std::string clSourcecode = "";
     bool usesVmem = false;
     bool usesScratch = false;
+    bool usesDynamicShared = false;  // takes a local arg for extern __shared__ memory, after scratch
 };
 
+// vmemSegmentCount is the number of leading clmems which are vmem segments: see KernelDumper::vmemSegmentCount
 ModuleClRes convertModuleToCl(
-    int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, llvm::Module *M, std::string specificFunction, std::string generatedName, bool offsets_32bit);
+    int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, llvm::Module *M, std::string specificFunction, std::string generatedName, bool offsets_32bit,
+    int vmemSegmentCount = 1);
+// llString can be textual IR, or bitcode. Parses llString each time
 ModuleClRes convertLlStringToCl(
-    int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, std::string llString, std::string specificFunction, std::string generatedName, bool offsets_32bit);
+    int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, std::string llString, std::string specificFunction, std::string generatedName, bool offsets_32bit,
+    int vmemSegmentCount = 1);
+// devicellcode is the device code patch_hostside embedded in the host binary, ie text, or encoded
+// bitcode. It is decoded and parsed once, and kept, keyed on the devicellcode pointer, so it
+// needs to stay the same, at the same address. Only the most recently used few modules are kept
+const int maxCachedDeviceModules = 8;
+ModuleClRes convertDeviceCodeToCl(
+    int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, const char *devicellcode, std::string specificFunction, std::string generatedName, bool offsets_32bit,
+    int vmemSegmentCount = 1);
+struct DeviceModuleCacheStats {
+    int hits = 0;
+    int misses = 0;
+};
+DeviceModuleCacheStats getDeviceModuleCacheStats();
+
+// the kernels listed in the module's nvvm.annotations, in order
+std::vector<std::string> getKernelNames(llvm::Module *M);
+// the number of clmem args the hostside sends for kernel F, for the usual launch case
+int countKernelClmemArgs(llvm::Function *F);
+
+// the name the kernel gets inside the generated OpenCL
+std::string getShortKernelName(const std::string &kernelName);
+
+// ahead-of-time generation: `cocl --devicecl-aot` runs `ir-to-opencl --all-kernels` at build time,
+// which converts every kernel in the device IR, for the usual launch case, where each pointer
+// argument lives in a different buffer. patch_hostside embeds the resulting table next to the IR.
+// Throws if any kernel fails to convert, so problems show up at build time
+// Kernels are converted on numThreads threads, or one per core if numThreads is 0. The table is
+// the same for any numThreads
+std::string convertAllKernelsToClTable(std::string llString, int numThreads = 1);
+// looks up kernelName in a table from convertAllKernelsToClTable. Returns false if the table
+// has nothing matching this exact buffer layout, in which case the caller should generate as usual
+bool findPrecompiledCl(
+    const char *table, const std::string &kernelName, int uniqueClmemCount, const std::vector<int> &clmemIndexByClmemArgIndex,
+    bool offsets_32bit, int vmemSegmentCount, ModuleClRes *res);
 
 } // namespace cocl
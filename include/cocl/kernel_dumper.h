@@ -58,6 +58,17 @@ public:
     bool usesVmem = false;
     bool usesScratch = false;
 
+    // the leading clmems, which getGlobalPointer looks up vmem segments in. For kernels which
+    // use vmem, the hostside passes the buffer of every allocation, in segment order
+    int vmemSegmentCount = 1;
+    // the kernel uses extern __shared__ memory, so takes the dynamic shared memory as a last,
+    // local, arg, after scratch. Set by toCl
+    bool usesDynamicShared = false;
+
+    // seconds toCl spent in FunctionDumper::runGeneration, over all functions, for
+    // ir_to_opencl_bench. The rest of toCl is mostly writing out the OpenCL
+    double generateSeconds = 0;
+
 protected:
     bool _addIRToCl = false;
     cocl::GlobalNames globalNames;
@@ -17,4 +17,7 @@ public:
     static int readInt32Constant(llvm::Value *value);
     static float readFloatConstant(llvm::Value *value);
     static std::string dumpFloatConstant(bool forceSingle, llvm::ConstantFP *constantFP);
+    // extern __shared__ arrays: declared, not defined, in the shared address space. They all
+    // start at the dynamic shared memory, whose size is given at launch
+    static bool isDynamicSharedMemory(const llvm::Value *value);
 };
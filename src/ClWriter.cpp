@@ -253,6 +253,13 @@ void SharedClWriter::writeDeclaration(std::string indent, TypeDumper *typeDumper
         // GlobalVariable *globalVariable = cast<GlobalVariable>(value);
         // int count = pointerType->getArrayNumElements();
         // cout << "num elements " << count << endl;
+        if(ReadIR::isDynamicSharedMemory(value)) {
+            // extern __shared__: a pointer to the dynamic shared memory, rather than an array of its own
+            string primitiveTypeStr = typeDumper->dumpType(primitiveType);
+            os << indent << "local " << primitiveTypeStr << " *" << localValueInfo->name << " = (local " << primitiveTypeStr
+                << " *)pGlobalVars->dynamicShared;\n";
+            return;
+        }
         os << indent << "local " << typeDumper->dumpType(primitiveType) << " " << localValueInfo->name << "[" << numElements << "];\n";
     } else {
         cout << "sharedclwriter writedeclaration not implmeneted for htis type:" << endl;
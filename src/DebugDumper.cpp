@@ -74,7 +74,7 @@ void DebugDumper::dump() {
                         cout << "buffer " << argIdx << ": offsetArg out of bounds => skipping arg" << endl;
                         continue;
                     }
-                    offsetBytes = llvm::cast<Int64Arg>(launchConfiguration->args[offsetArg].get())->v;
+                    offsetBytes = launchConfiguration->args[offsetArg].getOffset();
                 } else {
                     offsetBytes = argConfig["offsetbytes"].as<int>();
                 }
@@ -16,6 +16,7 @@
 
 #include "cocl/hostside_opencl_funcs.h"
 #include "cocl/cocl_streams.h"
+#include "cocl/cocl_memory.h"
 
 #include <iostream>
 #include <memory>
@@ -33,6 +34,7 @@ using namespace easycl;
 #define COCL_PRINT(x)
 
 #define OFFSETS_32BIT_ENV_VAR "COCL_OFFSETS_32BIT"
+#define LAUNCH_BLOCKING_ENV_VAR "COCL_LAUNCH_BLOCKING"
 
 namespace cocl {
     std::mutex clcontextcreation_mutex;
@@ -43,10 +45,31 @@ namespace cocl {
         cocl::CoclDevice *coclDevice = cocl::getCoclDeviceByGpuOrdinal(gpuOrdinal);
         cl.reset(EasyCL::createForPlatformDeviceIds(coclDevice->platformId, coclDevice->deviceId));
         default_stream.reset(new CoclStream(cl.get()));
+        memoryPool.reset(new MemoryPool(this));
+        localMemSize = easycl::getDeviceInfoInt64(coclDevice->deviceId, CL_DEVICE_LOCAL_MEM_SIZE);
+        maxParameterSize = easycl::getDeviceInfoInt64(coclDevice->deviceId, CL_DEVICE_MAX_PARAMETER_SIZE);
     }
     Context::~Context() {
         COCL_PRINT(cout << "~Context() " << this << endl);
     }
+    void Context::registerStream(CoclStream *stream) {
+        std::lock_guard< std::mutex > guard(streamsMutex);
+        streams.insert(stream);
+    }
+    void Context::unregisterStream(CoclStream *stream) {
+        std::lock_guard< std::mutex > guard(streamsMutex);
+        streams.erase(stream);
+    }
+    void Context::synchronize() {
+        std::lock_guard< std::mutex > guard(streamsMutex);
+        cl_int err = clFinish(default_stream->clqueue->queue);
+        EasyCL::checkError(err);
+        for(auto it=streams.begin(); it != streams.end(); it++) {
+            err = clFinish((*it)->clqueue->queue);
+            EasyCL::checkError(err);
+        }
+        cl->finish();
+    }
 
     ContextMutex::ContextMutex(Context *context) : context(context) {
         context->mu.lock();
@@ -62,6 +85,12 @@ namespace cocl {
                 this->offsets_32bit = true;
             }
         }
+        if(getenv(LAUNCH_BLOCKING_ENV_VAR) != 0) {
+            if(string(getenv(LAUNCH_BLOCKING_ENV_VAR)) == "1") {
+                cout << LAUNCH_BLOCKING_ENV_VAR << " enabled" << endl;
+                this->launchBlocking = true;
+            }
+        }
     }
     ThreadVars::~ThreadVars() {
     }
@@ -91,8 +120,7 @@ size_t cuCtxGetDevice(CUdevice *pdevice) {
 size_t cuCtxSynchronize(void) {
     COCL_PRINT(cout << "cuCtxSynchronize" << endl);
     ThreadVars *v = getThreadVars();
-    EasyCL *cl = v->getContext()->getCl();
-    cl->finish();
+    v->getContext()->synchronize();
     return 0;
 }
 
@@ -0,0 +1,88 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/cocl_devicell.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Compression.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+namespace cocl {
+
+namespace {
+
+const char bitcodeMagic[8] = {'C', 'O', 'C', 'L', 'B', 'C', '0', '1'};
+
+// host byte order: patch_hostside runs on the same architecture as the program it patches
+struct DeviceBitcodeHeader {
+    char magic[8];
+    uint64_t storedBytes;  // bytes following the header
+    uint64_t bitcodeBytes;  // bytes once decompressed
+    uint32_t compressed;
+    uint32_t reserved;
+};
+
+} // namespace
+
+std::string encodeDeviceBitcode(const std::string &bitcode, bool compress) {
+    DeviceBitcodeHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, bitcodeMagic, sizeof(bitcodeMagic));
+    header.bitcodeBytes = bitcode.size();
+
+    llvm::SmallVector<char, 0> compressedBitcode;
+    // if this llvm was built without zlib, we just store the bitcode as-is
+    if(compress && llvm::zlib::isAvailable() &&
+            llvm::zlib::compress(bitcode, compressedBitcode, llvm::zlib::BestSizeCompression) == llvm::zlib::StatusOK &&
+            compressedBitcode.size() < bitcode.size()) {
+        header.compressed = 1;
+        header.storedBytes = compressedBitcode.size();
+        return string((const char *)&header, sizeof(header)) + string(compressedBitcode.data(), compressedBitcode.size());
+    }
+    header.storedBytes = bitcode.size();
+    return string((const char *)&header, sizeof(header)) + bitcode;
+}
+
+bool isEncodedDeviceBitcode(const char *embedded) {
+    return strncmp(embedded, bitcodeMagic, sizeof(bitcodeMagic)) == 0;
+}
+
+std::string decodeDeviceCode(const char *embedded) {
+    if(!isEncodedDeviceBitcode(embedded)) {
+        return embedded;
+    }
+    DeviceBitcodeHeader header;
+    memcpy(&header, embedded, sizeof(header));  // the global might not be aligned
+    const char *stored = embedded + sizeof(header);
+    if(!header.compressed) {
+        return string(stored, header.storedBytes);
+    }
+    if(!llvm::zlib::isAvailable()) {
+        throw runtime_error("device code is compressed, but this build of Coriander doesnt have zlib");
+    }
+    llvm::SmallVector<char, 0> bitcode;
+    if(llvm::zlib::uncompress(llvm::StringRef(stored, header.storedBytes), bitcode, header.bitcodeBytes) != llvm::zlib::StatusOK ||
+            bitcode.size() != header.bitcodeBytes) {
+        throw runtime_error("failed to decompress device code");
+    }
+    return string(bitcode.data(), bitcode.size());
+}
+
+} // namespace cocl
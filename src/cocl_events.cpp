@@ -19,6 +19,7 @@
 #include "cocl/hostside_opencl_funcs.h"
 #include "cocl/cocl_streams.h"
 #include "cocl/cocl_context.h"
+#include "cocl/cocl_graphs.h"
 
 #include "EasyCL/EasyCL.h"
 
@@ -65,6 +66,11 @@ size_t cuStreamWaitEvent(char *_queue, CoclEvent *event, unsigned int flags) {
     // pthread_mutex_lock(&cocl_events_mutex);
     std::lock_guard< std::mutex > guard(cocl_events_mutex);
     CoclStream *stream = (CoclStream *)_queue;
+    if(stream != 0 && stream->capturingGraph != 0) {
+        // captured graphs are a single stream, so there is nothing to join with
+        stream->capturingGraph->invalidated = true;
+        return cudaErrorStreamCaptureUnsupported;
+    }
     CLQueue *queue = stream->clqueue;
     if(queue == 0) {
         cout << "cuStreamWaitEvent stream==0 not implemented" << std::endl;
@@ -119,6 +125,7 @@ size_t cuEventCreate(CoclEvent **pevent, unsigned int flags) {
     std::lock_guard< std::mutex > guard(cocl_events_mutex);
     // pthread_mutex_lock(&cocl_events_mutex);
     CoclEvent *event = new CoclEvent();
+    event->timingDisabled = flags == cudaEventDisableTiming || (flags & CU_EVENT_DISABLE_TIMING) != 0;
     *pevent = event;
     COCL_PRINT("cuEventCreate flags=" << flags << " new CoclEvent=" << event);
     // throw runtime_error("fake stop");
@@ -148,8 +155,37 @@ size_t cudaProfilerStop() {
     return 0;
 }
 
+// reads CL_PROFILING_COMMAND_END of the markers queued by cuEventRecord. This needs
+// COCL_PROFILING=1, since OpenCL only timestamps commands on queues created with profiling enabled
+// The events can be on different streams, since all queues in a context use the same device clock
 size_t cudaEventElapsedTime(float *p_elapsedTime, cocl::CoclEvent *start, cocl::CoclEvent *stop) {
+    std::lock_guard< std::mutex > guard(cocl_events_mutex);
     *p_elapsedTime = 0.0f;
+    if(start->timingDisabled || stop->timingDisabled || start->event == 0 || stop->event == 0) {
+        return cudaErrorInvalidResourceHandle;
+    }
+    if(!isProfilingEnabled()) {
+        static bool warned = false;
+        if(!warned) {
+            cerr << "cudaEventElapsedTime: Warning: set COCL_PROFILING=1 to enable event timing" << endl;
+            warned = true;
+        }
+        return cudaErrorNotYetImplemented;
+    }
+    cl_event events[2] = {start->event, stop->event};
+    cl_ulong timestamps[2];
+    for(int i = 0; i < 2; i++) {
+        cl_int status;
+        cl_int err = clGetEventInfo(events[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, 0);
+        EasyCL::checkError(err);
+        if(status != CL_COMPLETE) {
+            return cudaErrorNotReady;
+        }
+        err = clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &timestamps[i], 0);
+        EasyCL::checkError(err);
+    }
+    *p_elapsedTime = (float)((double)((int64_t)(timestamps[1] - timestamps[0])) / 1000000.0);
+    COCL_PRINT("cudaEventElapsedTime " << *p_elapsedTime << "ms");
     return 0;
 }
 
@@ -168,6 +204,10 @@ size_t cuEventRecord(CoclEvent *event, char *_queue) {
     if(coclStream == 0) {
         coclStream = v->currentContext->default_stream.get();
     }
+    if(coclStream->capturingGraph != 0) {
+        coclStream->capturingGraph->invalidated = true;
+        return cudaErrorStreamCaptureUnsupported;
+    }
     CLQueue *queue = coclStream->clqueue;
     COCL_PRINT("  cuEventRecord queue=" << queue);
     // CLQueue *queue = (CLQueue *)_queue;
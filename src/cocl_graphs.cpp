@@ -0,0 +1,278 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/cocl_graphs.h"
+
+#include "cocl/cocl_error.h"
+#include "cocl/cocl_memory.h"
+#include "cocl/cocl_context.h"
+#include "cocl/fill_buffer.h"
+#include "cocl/cocl_trace.h"
+
+#include "EasyCL/EasyCL.h"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+using namespace std;
+using namespace cocl;
+using namespace easycl;
+
+#undef COCL_PRINT
+#define COCL_PRINT(x)
+
+namespace cocl {
+    CoclGraph::~CoclGraph() {
+        for(auto it=nodes.begin(); it != nodes.end(); it++) {
+            if(it->clkernel != 0) {
+                clReleaseKernel(it->clkernel);
+            }
+        }
+        for(auto it=ownedBuffers.begin(); it != ownedBuffers.end(); it++) {
+            clReleaseMemObject(*it);
+        }
+    }
+
+    static Memory *findMemoryOrThrow(const void *pointer, string what) {
+        Memory *memory = findMemory((const char *)pointer);
+        if(memory == 0) {
+            throw runtime_error("stream capture: couldnt find memory for " + what);
+        }
+        if(memory->hostAllocation != 0) {
+            // replaying would need to unmap and map it again, around each use
+            throw runtime_error("stream capture: " + what + " is the device pointer of a host allocation, which cant be captured");
+        }
+        return memory;
+    }
+
+    void CoclGraph::addMemcpy(void *dst, const void *src, size_t bytes, size_t kind) {
+        GraphNode node;
+        node.bytes = bytes;
+        if(kind == cudaMemcpyHostToDevice) {
+            node.type = GraphNode::CopyHtoD;
+            node.name = "memcpy HtoD";
+            node.hostSrc = src;
+        } else {
+            Memory *srcMemory = findMemoryOrThrow(src, "src");
+            node.src = srcMemory->clmem;
+            node.srcOffset = srcMemory->getOffset((const char *)src);
+        }
+        if(kind == cudaMemcpyDeviceToHost) {
+            node.type = GraphNode::CopyDtoH;
+            node.name = "memcpy DtoH";
+            node.hostDst = dst;
+        } else {
+            Memory *dstMemory = findMemoryOrThrow(dst, "dst");
+            node.dst = dstMemory->clmem;
+            node.dstOffset = dstMemory->getOffset((char *)dst);
+        }
+        if(kind == cudaMemcpyDeviceToDevice) {
+            node.type = GraphNode::CopyDtoD;
+            node.name = "memcpy DtoD";
+        } else if(kind != cudaMemcpyHostToDevice && kind != cudaMemcpyDeviceToHost) {
+            throw runtime_error("stream capture: unhandled cudaMemcpyKind");
+        }
+        nodes.push_back(node);
+    }
+
+    void CoclGraph::addMemset(void *location, int value, size_t bytes) {
+        Memory *memory = findMemoryOrThrow(location, "memset");
+        GraphNode node;
+        node.type = GraphNode::Fill;
+        node.name = "cudaMemsetAsync";
+        node.dst = memory->clmem;
+        node.dstOffset = memory->getOffset((char *)location);
+        node.bytes = bytes;
+        node.value = (unsigned char)value;
+        if(node.dstOffset + bytes > memory->bytes) {
+            throw runtime_error("stream capture: cudaMemsetAsync would write past the end of the allocation");
+        }
+        nodes.push_back(node);
+    }
+
+    // a new cl_kernel, from the same program as clkernel, so its args are ours alone
+    static cl_kernel newKernelLike(cl_kernel clkernel) {
+        cl_program program;
+        EasyCL::checkError(clGetKernelInfo(clkernel, CL_KERNEL_PROGRAM, sizeof(program), &program, 0));
+        size_t nameBytes = 0;
+        EasyCL::checkError(clGetKernelInfo(clkernel, CL_KERNEL_FUNCTION_NAME, 0, 0, &nameBytes));
+        vector<char> name(nameBytes + 1, 0);
+        EasyCL::checkError(clGetKernelInfo(clkernel, CL_KERNEL_FUNCTION_NAME, nameBytes, &name[0], 0));
+        cl_int err;
+        cl_kernel newKernel = clCreateKernel(program, &name[0], &err);
+        EasyCL::checkError(err);
+        return newKernel;
+    }
+
+    CoclGraphExec::CoclGraphExec(const CoclGraph *graph) :
+            nodes(graph->nodes), ownedBuffers(graph->ownedBuffers) {
+        for(auto it=ownedBuffers.begin(); it != ownedBuffers.end(); it++) {
+            clRetainMemObject(*it);
+        }
+        for(auto it=nodes.begin(); it != nodes.end(); it++) {
+            if(it->type != GraphNode::Kernel) {
+                continue;
+            }
+            it->clkernel = newKernelLike(it->clkernel);
+            for(size_t i = 0; i < it->args.size(); i++) {
+                const GraphNode::KernelArg &arg = it->args[i];
+                EasyCL::checkError(clSetKernelArg(it->clkernel, i, arg.size, arg.hasValue ? &arg.value : 0));
+            }
+        }
+    }
+
+    CoclGraphExec::~CoclGraphExec() {
+        // OpenCL keeps anything still in use by queued commands alive until they have finished
+        for(auto it=nodes.begin(); it != nodes.end(); it++) {
+            if(it->clkernel != 0) {
+                clReleaseKernel(it->clkernel);
+            }
+        }
+        for(auto it=ownedBuffers.begin(); it != ownedBuffers.end(); it++) {
+            clReleaseMemObject(*it);
+        }
+        if(lastLaunchDone != 0) {
+            clReleaseEvent(lastLaunchDone);
+        }
+    }
+
+    void CoclGraphExec::launch(CoclStream *stream) {
+        cl_command_queue queue = stream->clqueue->queue;
+        std::lock_guard< std::mutex > guard(mutex);
+        if(lastLaunchDone != 0 && lastQueue != queue) {
+            // the queues are in-order, so we only need this when the last launch was on another one
+            EasyCL::checkError(clEnqueueBarrierWithWaitList(queue, 1, &lastLaunchDone, 0));
+        }
+        // the kernels all have their own args, so we dont need any kernel's launch mutex
+        for(auto it=nodes.begin(); it != nodes.end(); it++) {
+            DeviceTraceSpan deviceTraceSpan("graph", it->name, queue);
+            switch(it->type) {
+                case GraphNode::Kernel:
+                    EasyCL::checkError(clEnqueueNDRangeKernel(queue, it->clkernel, 3, 0, it->global, it->block, 0, 0, 0));
+                    break;
+                case GraphNode::CopyHtoD:
+                    EasyCL::checkError(clEnqueueWriteBuffer(queue, it->dst, CL_FALSE, it->dstOffset, it->bytes, it->hostSrc, 0, 0, 0));
+                    break;
+                case GraphNode::CopyDtoH:
+                    EasyCL::checkError(clEnqueueReadBuffer(queue, it->src, CL_FALSE, it->srcOffset, it->bytes, it->hostDst, 0, 0, 0));
+                    break;
+                case GraphNode::CopyDtoD:
+                    EasyCL::checkError(clEnqueueCopyBuffer(queue, it->src, it->dst, it->srcOffset, it->dstOffset, it->bytes, 0, 0, 0));
+                    break;
+                case GraphNode::Fill:
+                    myEnqueueFillBuffer(queue, it->dst, it->value, it->dstOffset, it->bytes);
+                    break;
+            }
+        }
+        if(lastLaunchDone != 0) {
+            clReleaseEvent(lastLaunchDone);
+            lastLaunchDone = 0;
+        }
+        EasyCL::checkError(clEnqueueMarkerWithWaitList(queue, 0, 0, &lastLaunchDone));
+        lastQueue = queue;
+    }
+}
+
+size_t cudaStreamBeginCapture(char *_queue, int mode) {
+    CoclStream *stream = (CoclStream *)_queue;
+    ThreadVars *v = getThreadVars();
+    if(stream == 0 || stream == v->getContext()->default_stream.get()) {
+        return cudaErrorStreamCaptureUnsupported;
+    }
+    if(stream->capturingGraph != 0) {
+        return cudaErrorIllegalState;
+    }
+    COCL_PRINT("cudaStreamBeginCapture stream=" << (void *)stream);
+    CoclGraph *graph = new CoclGraph();
+    graph->captureStream = stream;
+    stream->capturingGraph = graph;
+    return 0;
+}
+
+size_t cudaStreamEndCapture(char *_queue, CoclGraph **pGraph) {
+    CoclStream *stream = (CoclStream *)_queue;
+    *pGraph = 0;
+    if(stream == 0 || stream->capturingGraph == 0) {
+        return cudaErrorStreamCaptureUnmatched;
+    }
+    CoclGraph *graph = stream->capturingGraph;
+    stream->capturingGraph = 0;
+    graph->captureStream = 0;
+    if(graph->invalidated) {
+        delete graph;
+        return cudaErrorStreamCaptureInvalidated;
+    }
+    COCL_PRINT("cudaStreamEndCapture nodes=" << graph->nodes.size());
+    *pGraph = graph;
+    return 0;
+}
+
+size_t cudaStreamIsCapturing(char *_queue, cudaStreamCaptureStatus *pCaptureStatus) {
+    CoclStream *stream = (CoclStream *)_queue;
+    if(stream == 0 || stream->capturingGraph == 0) {
+        *pCaptureStatus = cudaStreamCaptureStatusNone;
+    } else if(stream->capturingGraph->invalidated) {
+        *pCaptureStatus = cudaStreamCaptureStatusInvalidated;
+    } else {
+        *pCaptureStatus = cudaStreamCaptureStatusActive;
+    }
+    return 0;
+}
+
+size_t cudaGraphInstantiate(CoclGraphExec **pGraphExec, CoclGraph *graph,
+        void **pErrorNode, char *pLogBuffer, size_t bufferSize) {
+    if(pErrorNode != 0) {
+        *pErrorNode = 0;
+    }
+    if(pLogBuffer != 0 && bufferSize > 0) {
+        pLogBuffer[0] = 0;
+    }
+    TraceScope traceScope("graph", "cudaGraphInstantiate");
+    *pGraphExec = new CoclGraphExec(graph);
+    return 0;
+}
+
+size_t cudaGraphLaunch(CoclGraphExec *graphExec, char *_queue) {
+    CoclStream *stream = (CoclStream *)_queue;
+    ThreadVars *v = getThreadVars();
+    if(stream == 0) {
+        stream = v->currentContext->default_stream.get();
+    }
+    if(stream->capturingGraph != 0) {
+        stream->capturingGraph->invalidated = true;
+        return cudaErrorStreamCaptureUnsupported;
+    }
+    TraceScope traceScope("graph", "cudaGraphLaunch");
+    graphExec->launch(stream);
+    cl_int err;
+    if(v->launchBlocking) {
+        err = clFinish(stream->clqueue->queue);
+    } else {
+        err = clFlush(stream->clqueue->queue);
+    }
+    EasyCL::checkError(err);
+    return 0;
+}
+
+size_t cudaGraphExecDestroy(CoclGraphExec *graphExec) {
+    delete graphExec;
+    return 0;
+}
+
+size_t cudaGraphDestroy(CoclGraph *graph) {
+    delete graph;
+    return 0;
+}
@@ -18,16 +18,22 @@
 #include "cocl/cocl_streams.h"
 #include "cocl/cocl_context.h"
 #include "cocl/cocl_device.h"
+#include "cocl/cocl_defs.h"
 
 #include "cocl/fill_buffer.h"
+#include "cocl/cocl_trace.h"
+#include "cocl/cocl_graphs.h"
 
 #include <iostream>
 #include <memory>
 #include <vector>
 #include <map>
+#include <cstdlib>
 #include <set>
+#include <algorithm>
 
 #include "EasyCL/EasyCL.h"
+#include "EasyCL/util/easycl_stringhelper.h"
 
 using namespace std;
 using namespace cocl;
@@ -37,6 +43,9 @@ using namespace easycl;
 #undef COCL_PRINT
 #endif
 
+#define MEMORY_POOL_ENV_VAR "COCL_MEMORY_POOL"
+#define MEMORY_POOL_MAX_MB_ENV_VAR "COCL_MEMORY_POOL_MAX_MB"
+
 #ifdef COCL_SPAM_MEMORY
 #define COCL_PRINT(x) std::cout << "[MEM] " << x << std::endl;
 #else
@@ -44,52 +53,452 @@ using namespace easycl;
 #endif
 
 namespace cocl {
-    // we should index these, but a set is ok-ish for now. maybe
+    static void checkFitsInVmemSegment(size_t bytes) {
+        if(bytes > ((size_t)1 << COCL_VMEM_SEGMENT_SHIFT)) {
+            throw runtime_error("allocation of " + easycl::toString(bytes) + " bytes is too big: the most we can allocate at once is " +
+                easycl::toString((size_t)1 << COCL_VMEM_SEGMENT_SHIFT) + " bytes");
+        }
+    }
 
     Memory::Memory(cl_mem clmem, size_t bytes) :
             clmem(clmem), bytes(bytes) {
+        // caller should be holding the context mutex
         ThreadVars *v = getThreadVars();
-        fakePos = v->getContext()->nextAllocPos;
-        // we should align it actually.  on 128-bytes?
-        fakePos = ((fakePos + 127) / 128) * 128;
-        v->getContext()->nextAllocPos = fakePos + bytes;
-        v->getContext()->memoryByAllocPos[fakePos] = this;
-        v->getContext()->memories.insert(this);
+        Context *context = v->getContext();
+        // each allocation gets a segment of its own, so kernels can find the buffer for a
+        // device pointer from its segment alone. Segment 0 is never used, so 0 is never a valid pointer
+        if(context->freeVmemSegments.size() > 0) {
+            vmemSegment = *context->freeVmemSegments.begin();
+            context->freeVmemSegments.erase(context->freeVmemSegments.begin());
+        } else {
+            context->vmemSegments.push_back(0);
+            vmemSegment = context->vmemSegments.size();
+        }
+        context->vmemSegments[vmemSegment - 1] = this;
+        fakePos = vmemSegment << COCL_VMEM_SEGMENT_SHIFT;
+        context->memoryByAllocPos[fakePos] = this;
+        context->memoryByClmem[clmem] = this;
+        context->memories.insert(this);
+        context->memoryGeneration++;
     }
 
     Memory *Memory::newDeviceAlloc(size_t bytes) {
         ThreadVars *v = getThreadVars();
         Context *context = v->getContext();
+        checkFitsInVmemSegment(bytes);
         ContextMutex contextMutex(context);
-        EasyCL *cl = v->getContext()->getCl();
-        cl_int err;
-        cl_mem clmem = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE, bytes,
-                                               NULL, &err);
-        EasyCL::checkError(err);
+        size_t allocatedBytes = 0;
+        cl_mem clmem = context->memoryPool->allocate(bytes, &allocatedBytes);
         Memory *memory = new Memory(clmem, bytes);
+        memory->allocatedBytes = allocatedBytes;
         return memory;
     }
 
     Memory::~Memory() {
         ThreadVars *v = getThreadVars();
-        v->getContext()->memoryByAllocPos.erase(fakePos);
-        v->getContext()->memories.erase(this);
-        cl_int err = clReleaseMemObject(clmem);
-        v->getContext()->getCl()->checkError(err);
-        // TODO: should remove from map and set too
+        Context *context = v->getContext();
+        ContextMutex contextMutex(context);
+        context->memoryGeneration++;
+        context->memoryByAllocPos.erase(fakePos);
+        context->memoryByClmem.erase(clmem);
+        context->memories.erase(this);
+        context->vmemSegments[vmemSegment - 1] = 0;
+        context->freeVmemSegments.insert(vmemSegment);
+        while(context->vmemSegments.size() > 0 && context->vmemSegments.back() == 0) {
+            context->freeVmemSegments.erase(context->vmemSegments.size());
+            context->vmemSegments.pop_back();
+        }
+        if(hostAllocation == 0) {
+            context->memoryPool->release(clmem, allocatedBytes, bytes);
+        }
     }
 
-    Memory *findMemory(const char *passedInAsCharStar) {
+    Memory *Memory::newHostMapped(HostAllocation *hostAllocation, cl_mem clmem, size_t bytes) {
+        // caller should be holding the context mutex
+        Memory *memory = new Memory(clmem, bytes);
+        memory->allocatedBytes = bytes;
+        memory->hostAllocation = hostAllocation;
+        return memory;
+    }
+
+    HostAllocation::HostAllocation(size_t bytes) :
+            bytes(bytes) {
+        checkFitsInVmemSegment(bytes);
         ThreadVars *v = getThreadVars();
         Context *context = v->getContext();
+        cl_int err;
+        cl_mem clmem = clCreateBuffer(*context->getCl()->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+            bytes, 0, &err);
+        EasyCL::checkError(err);
+        hostPos = (char *)clEnqueueMapBuffer(context->default_stream->clqueue->queue, clmem, CL_TRUE,
+            CL_MAP_READ | CL_MAP_WRITE, 0, bytes, 0, 0, 0, &err);
+        if(err != CL_SUCCESS) {
+            clReleaseMemObject(clmem);
+            EasyCL::checkError(err);
+        }
         ContextMutex contextMutex(context);
-        size_t pos = (size_t)passedInAsCharStar;
-        for(auto it=v->getContext()->memories.begin(), e=v->getContext()->memories.end(); it != e; it++) {
-            Memory *memory = *it;
-            if(pos >= memory->fakePos && pos < memory->fakePos + memory->bytes) {
-                return memory;
+        deviceMemory = Memory::newHostMapped(this, clmem, bytes);
+        context->hostAllocationsByPos[hostPos] = this;
+        context->numHostAllocations++;
+    }
+
+    HostAllocation::~HostAllocation() {
+        ThreadVars *v = getThreadVars();
+        Context *context = v->getContext();
+        cl_mem clmem = deviceMemory->clmem;
+        {
+            ContextMutex contextMutex(context);
+            context->hostAllocationsByPos.erase(hostPos);
+            context->numHostAllocations--;
+        }
+        // kernels, or copies, using the memory might still be running
+        context->synchronize();
+        delete deviceMemory;
+        cl_int err = clEnqueueUnmapMemObject(context->default_stream->clqueue->queue, clmem, hostPos,
+            lastMapped != 0 ? 1 : 0, lastMapped != 0 ? &lastMapped : 0, 0);
+        EasyCL::checkError(err);
+        err = clFinish(context->default_stream->clqueue->queue);
+        EasyCL::checkError(err);
+        if(lastMapped != 0) {
+            clReleaseEvent(lastMapped);
+        }
+        err = clReleaseMemObject(clmem);
+        EasyCL::checkError(err);
+    }
+
+    HostAllocation *findHostAllocation(const void *hostPointer) {
+        ThreadVars *v = getThreadVars();
+        Context *context = v->getContext();
+        ContextMutex contextMutex(context);
+        const char *pos = (const char *)hostPointer;
+        auto it = context->hostAllocationsByPos.upper_bound(pos);
+        if(it == context->hostAllocationsByPos.begin()) {
+            return 0;
+        }
+        it--;
+        HostAllocation *hostAllocation = it->second;
+        if(pos >= hostAllocation->hostPos && pos < hostAllocation->hostPos + hostAllocation->bytes) {
+            return hostAllocation;
+        }
+        return 0;
+    }
+
+    HostAllocationsOnDevice::HostAllocationsOnDevice(cl_command_queue queue) :
+            queue(queue) {
+    }
+
+    HostAllocationsOnDevice::~HostAllocationsOnDevice() {
+        if(unmapped) {
+            try {
+                remap();
+            } catch(runtime_error &e) {
+                cout << "failed to map host allocation again: " << e.what() << endl;
+            }
+        }
+    }
+
+    void HostAllocationsOnDevice::add(Memory *memory) {
+        if(memory == 0 || memory->hostAllocation == 0) {
+            return;
+        }
+        if(unmapped) {
+            throw runtime_error("HostAllocationsOnDevice::add: already unmapped");
+        }
+        for(auto it=hostAllocations.begin(); it != hostAllocations.end(); it++) {
+            if(*it == memory->hostAllocation) {
+                return;
+            }
+        }
+        hostAllocations.push_back(memory->hostAllocation);
+    }
+
+    void HostAllocationsOnDevice::addClmems(const std::vector<cl_mem> &clmems) {
+        Context *context = getThreadVars()->getContext();
+        if(context->numHostAllocations.load() == 0) {
+            return;
+        }
+        for(auto it=clmems.begin(); it != clmems.end(); it++) {
+            if(*it != 0) {
+                add(findMemoryByClmem(*it));
+            }
+        }
+    }
+
+    void HostAllocationsOnDevice::unmap() {
+        // always locked in the same order, so two launches sharing host allocations cant deadlock
+        sort(hostAllocations.begin(), hostAllocations.end());
+        for(size_t i = 0; i < hostAllocations.size(); i++) {
+            HostAllocation *hostAllocation = hostAllocations[i];
+            hostAllocation->mutex.lock();
+            // the last map might have been on another queue
+            cl_int err = clEnqueueUnmapMemObject(queue, hostAllocation->deviceMemory->clmem, hostAllocation->hostPos,
+                hostAllocation->lastMapped != 0 ? 1 : 0, hostAllocation->lastMapped != 0 ? &hostAllocation->lastMapped : 0, 0);
+            if(err != CL_SUCCESS) {
+                // the ones before this one are unmapped, and the destructor maps them again
+                hostAllocation->mutex.unlock();
+                hostAllocations.resize(i);
+                unmapped = i > 0;
+                EasyCL::checkError(err);
+            }
+        }
+        unmapped = true;
+    }
+
+    void HostAllocationsOnDevice::remap() {
+        if(!unmapped) {
+            return;
+        }
+        unmapped = false;
+        string error = "";
+        for(auto it=hostAllocations.begin(); it != hostAllocations.end(); it++) {
+            HostAllocation *hostAllocation = *it;
+            cl_int err;
+            cl_event mapped = 0;
+            char *hostPos = (char *)clEnqueueMapBuffer(queue, hostAllocation->deviceMemory->clmem, CL_FALSE,
+                CL_MAP_READ | CL_MAP_WRITE, 0, hostAllocation->bytes, 0, 0, &mapped, &err);
+            if(err == CL_SUCCESS) {
+                if(hostAllocation->lastMapped != 0) {
+                    clReleaseEvent(hostAllocation->lastMapped);
+                }
+                hostAllocation->lastMapped = mapped;
+                if(hostPos != hostAllocation->hostPos) {
+                    // drivers keep CL_MEM_ALLOC_HOST_PTR buffers in place, but the spec doesnt promise it
+                    error = "host allocation was mapped again at a different address";
+                }
+            } else {
+                error = "failed to map host allocation again: " + easycl::toString(err);
+            }
+            hostAllocation->mutex.unlock();
+        }
+        if(error != "") {
+            throw runtime_error(error);
+        }
+    }
+
+    double MemoryPoolStats::hitRate() const {
+        return numAllocs == 0 ? 0.0 : (double)numHits / numAllocs;
+    }
+
+    double MemoryPoolStats::fragmentation() const {
+        return bytesAllocated == 0 ? 0.0 : 1.0 - (double)bytesRequested / bytesAllocated;
+    }
+
+    MemoryPool::MemoryPool(Context *context) :
+            context(context) {
+        maxCachedBytes = (size_t)1024 * 1024 * 1024;
+        if(getenv(MEMORY_POOL_ENV_VAR) != 0 && string(getenv(MEMORY_POOL_ENV_VAR)) == "0") {
+            enabled = false;
+        }
+        if(getenv(MEMORY_POOL_MAX_MB_ENV_VAR) != 0) {
+            maxCachedBytes = (size_t)atoll(getenv(MEMORY_POOL_MAX_MB_ENV_VAR)) * 1024 * 1024;
+        }
+    }
+
+    MemoryPool::~MemoryPool() {
+        trim(0);
+    }
+
+    size_t MemoryPool::roundUpToSizeClass(size_t bytes) {
+        // powers of two up to 1MB, then multiples of 1MB. This keeps the number of size classes
+        // small, so freed blocks get reused, at the cost of up to 50% waste on small allocations
+        const size_t minClass = 512;
+        const size_t largeClass = 1024 * 1024;
+        if(bytes <= minClass) {
+            return minClass;
+        }
+        if(bytes < largeClass) {
+            size_t sizeClass = minClass;
+            while(sizeClass < bytes) {
+                sizeClass <<= 1;
+            }
+            return sizeClass;
+        }
+        return ((bytes + largeClass - 1) / largeClass) * largeClass;
+    }
+
+    bool MemoryPool::isReady(FreeBlock &block) {
+        for(auto it=block.pendingEvents.begin(); it != block.pendingEvents.end(); it++) {
+            cl_int status;
+            cl_int err = clGetEventInfo(*it, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, 0);
+            EasyCL::checkError(err);
+            if(status != CL_COMPLETE) {
+                return false;
+            }
+        }
+        for(auto it=block.pendingEvents.begin(); it != block.pendingEvents.end(); it++) {
+            clReleaseEvent(*it);
+        }
+        block.pendingEvents.clear();
+        return true;
+    }
+
+    void MemoryPool::releaseBlock(FreeBlock &block, size_t sizeClass) {
+        for(auto it=block.pendingEvents.begin(); it != block.pendingEvents.end(); it++) {
+            clReleaseEvent(*it);
+        }
+        // OpenCL keeps the buffer alive until any queued commands using it have finished
+        cl_int err = clReleaseMemObject(block.clmem);
+        EasyCL::checkError(err);
+        stats.numDriverReleases++;
+        stats.bytesCached -= sizeClass;
+        stats.numCachedBlocks--;
+    }
+
+    cl_mem MemoryPool::allocate(size_t bytes, size_t *allocatedBytes) {
+        stats.numAllocs++;
+        size_t sizeClass = enabled ? roundUpToSizeClass(bytes) : bytes;
+        if(enabled) {
+            auto classIt = freeBlocksBySizeClass.find(sizeClass);
+            if(classIt != freeBlocksBySizeClass.end()) {
+                std::deque<FreeBlock> &blocks = classIt->second;
+                for(auto it=blocks.begin(); it != blocks.end(); it++) {
+                    if(isReady(*it)) {
+                        cl_mem clmem = it->clmem;
+                        blocks.erase(it);
+                        if(blocks.empty()) {
+                            freeBlocksBySizeClass.erase(classIt);
+                        }
+                        stats.numHits++;
+                        stats.bytesCached -= sizeClass;
+                        stats.numCachedBlocks--;
+                        stats.bytesRequested += bytes;
+                        stats.bytesAllocated += sizeClass;
+                        COCL_PRINT("MemoryPool reusing bytes=" << bytes << " sizeClass=" << sizeClass);
+                        *allocatedBytes = sizeClass;
+                        return clmem;
+                    }
+                }
+            }
+        }
+        EasyCL *cl = context->getCl();
+        cl_int err;
+        cl_mem clmem = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE, sizeClass,
+                                               NULL, &err);
+        if(err != CL_SUCCESS && enabled && freeBlocksBySizeClass.size() > 0) {
+            // maybe we're holding onto too much: give everything back to the driver, and try again
+            COCL_PRINT("MemoryPool clCreateBuffer failed, trimming, and retrying");
+            trim(0);
+            clmem = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE, sizeClass,
+                                               NULL, &err);
+        }
+        EasyCL::checkError(err);
+        stats.numDriverAllocs++;
+        stats.bytesRequested += bytes;
+        stats.bytesAllocated += sizeClass;
+        COCL_PRINT("MemoryPool new buffer bytes=" << bytes << " sizeClass=" << sizeClass);
+        *allocatedBytes = sizeClass;
+        return clmem;
+    }
+
+    void MemoryPool::release(cl_mem clmem, size_t allocatedBytes, size_t requestedBytes) {
+        stats.numFrees++;
+        stats.bytesRequested -= requestedBytes;
+        stats.bytesAllocated -= allocatedBytes;
+        if(!enabled || allocatedBytes > maxCachedBytes) {
+            cl_int err = clReleaseMemObject(clmem);
+            EasyCL::checkError(err);
+            stats.numDriverReleases++;
+            return;
+        }
+        FreeBlock block;
+        block.clmem = clmem;
+        block.freedAt = nextFreedAt++;
+        {
+            // with a single stream, everything is in-order on that one queue, so we can reuse
+            // immediately. Otherwise, a kernel on another stream might still be using this buffer
+            std::lock_guard< std::mutex > guard(context->streamsMutex);
+            if(context->streams.size() > 0) {
+                cl_event event;
+                cl_int err = clEnqueueMarkerWithWaitList(context->default_stream->clqueue->queue, 0, 0, &event);
+                EasyCL::checkError(err);
+                block.pendingEvents.push_back(event);
+                for(auto it=context->streams.begin(); it != context->streams.end(); it++) {
+                    err = clEnqueueMarkerWithWaitList((*it)->clqueue->queue, 0, 0, &event);
+                    EasyCL::checkError(err);
+                    block.pendingEvents.push_back(event);
+                }
+            }
+        }
+        freeBlocksBySizeClass[allocatedBytes].push_back(block);
+        stats.bytesCached += allocatedBytes;
+        stats.numCachedBlocks++;
+        if(stats.bytesCached > maxCachedBytes) {
+            trim(maxCachedBytes);
+        }
+    }
+
+    void MemoryPool::trim(size_t maxCachedBytes) {
+        while(stats.bytesCached > maxCachedBytes) {
+            // each size class is in order of freeing, so the oldest block overall is at the front of one of them
+            auto oldestIt = freeBlocksBySizeClass.end();
+            for(auto it=freeBlocksBySizeClass.begin(); it != freeBlocksBySizeClass.end(); it++) {
+                if(oldestIt == freeBlocksBySizeClass.end() || it->second.front().freedAt < oldestIt->second.front().freedAt) {
+                    oldestIt = it;
+                }
+            }
+            if(oldestIt == freeBlocksBySizeClass.end()) {
+                break;
+            }
+            releaseBlock(oldestIt->second.front(), oldestIt->first);
+            oldestIt->second.pop_front();
+            if(oldestIt->second.empty()) {
+                freeBlocksBySizeClass.erase(oldestIt);
             }
         }
+    }
+
+    MemoryPoolStats getMemoryPoolStats() {
+        Context *context = getThreadVars()->getContext();
+        ContextMutex contextMutex(context);
+        return context->memoryPool->stats;
+    }
+
+    void trimMemoryPool(size_t maxCachedBytes) {
+        Context *context = getThreadVars()->getContext();
+        ContextMutex contextMutex(context);
+        context->memoryPool->trim(maxCachedBytes);
+    }
+
+    // last successful findMemory, per thread.  Valid only whilst the context's memoryGeneration
+    // is unchanged, ie no allocations have been created or freed since.  We keep a copy of the
+    // range, so that checking it never touches a Memory another thread might be deleting
+    struct LastFoundMemory {
+        Context *context = 0;
+        uint64_t generation = 0;
+        Memory *memory = 0;
+        size_t fakePos = 0;
+        size_t bytes = 0;
+    };
+    static thread_local LastFoundMemory lastFoundMemory;
+
+    Memory *findMemory(const char *passedInAsCharStar) {
+        ThreadVars *v = getThreadVars();
+        Context *context = v->getContext();
+        size_t pos = (size_t)passedInAsCharStar;
+
+        // fast path: kernels tend to be launched with the same few buffers over and over
+        if(lastFoundMemory.memory != 0 && lastFoundMemory.context == context &&
+                lastFoundMemory.generation == context->memoryGeneration.load() &&
+                pos >= lastFoundMemory.fakePos && pos < lastFoundMemory.fakePos + lastFoundMemory.bytes) {
+            return lastFoundMemory.memory;
+        }
+
+        ContextMutex contextMutex(context);
+        // find the last allocation starting at or before pos, then check pos falls within it
+        auto it = context->memoryByAllocPos.upper_bound((long long)pos);
+        if(it == context->memoryByAllocPos.begin()) {
+            return 0;
+        }
+        it--;
+        Memory *memory = it->second;
+        if(pos >= memory->fakePos && pos < memory->fakePos + memory->bytes) {
+            lastFoundMemory.context = context;
+            lastFoundMemory.generation = context->memoryGeneration.load();
+            lastFoundMemory.memory = memory;
+            lastFoundMemory.fakePos = memory->fakePos;
+            lastFoundMemory.bytes = memory->bytes;
+            return memory;
+        }
         return 0;
     }
 
@@ -98,13 +507,11 @@ namespace cocl {
         Context *context = v->getContext();
         ContextMutex contextMutex(context);
 
-        for(auto it=v->getContext()->memories.begin(), e=v->getContext()->memories.end(); it != e; it++) {
-            Memory *memory = *it;
-            if(clmem == memory->clmem) {
-                return memory;
-            }
+        auto it = context->memoryByClmem.find(clmem);
+        if(it == context->memoryByClmem.end()) {
+            return 0;
         }
-        return 0;
+        return it->second;
     }
 
     size_t Memory::getOffset(const char *passedInAsCharStar) {
@@ -114,16 +521,46 @@ namespace cocl {
 
 size_t cuMemHostAlloc(void **pHostPointer, unsigned int bytes, int type) {
     COCL_PRINT("cuMemHostAlloc redirected bytes=" << bytes);
-    *pHostPointer = malloc(bytes);
+    HostAllocation *hostAllocation = new HostAllocation(bytes);
+    *pHostPointer = hostAllocation->hostPos;
     return 0;
 }
 
 size_t cuMemFreeHost(void *hostPointer) {
     COCL_PRINT("cuMemFreeHost redirected");
-    free(hostPointer);
+    HostAllocation *hostAllocation = findHostAllocation(hostPointer);
+    if(hostAllocation == 0 || hostAllocation->hostPos != (char *)hostPointer) {
+        throw runtime_error("cuMemFreeHost: pointer wasnt allocated by cuMemHostAlloc");
+    }
+    delete hostAllocation;
+    return 0;
+}
+
+size_t cuMemHostGetDevicePointer(CUdeviceptr *pDevicePointer, void *hostPointer, unsigned int flags) {
+    HostAllocation *hostAllocation = findHostAllocation(hostPointer);
+    if(hostAllocation == 0) {
+        throw runtime_error("cuMemHostGetDevicePointer: pointer wasnt allocated by cuMemHostAlloc");
+    }
+    *pDevicePointer = (CUdeviceptr)(hostAllocation->deviceMemory->fakePos + ((char *)hostPointer - hostAllocation->hostPos));
     return 0;
 }
 
+size_t cudaHostAlloc(void **pHostPointer, size_t bytes, unsigned int flags) {
+    return cuMemHostAlloc(pHostPointer, bytes, CU_MEMHOSTALLOC_PORTABLE);
+}
+
+size_t cudaMallocHost(void **pHostPointer, size_t bytes) {
+    return cuMemHostAlloc(pHostPointer, bytes, CU_MEMHOSTALLOC_PORTABLE);
+}
+
+size_t cudaFreeHost(void *hostPointer) {
+    return cuMemFreeHost(hostPointer);
+}
+
+size_t cudaHostGetDevicePointer(void **pDevicePointer, void *hostPointer, unsigned int flags) {
+    return cuMemHostGetDevicePointer((CUdeviceptr *)pDevicePointer, hostPointer, flags);
+}
+
 size_t cuMemGetInfo(size_t *free, size_t *total) {
     COCL_PRINT("cuMemGetInfo redirected");
     ThreadVars *v = getThreadVars();
@@ -134,17 +571,102 @@ size_t cuMemGetInfo(size_t *free, size_t *total) {
     return 0;
 }
 
+// the null stream means the context's default stream, as for kernel launches
+static CoclStream *getStreamOrDefault(ThreadVars *v, char *_queue) {
+    CoclStream *coclStream = (CoclStream *)_queue;
+    if(coclStream == 0) {
+        coclStream = v->currentContext->default_stream.get();
+    }
+    return coclStream;
+}
+
+// async operations are ordered by their stream's queue, and by events, not by the host waiting.
+// we just need to make sure the device actually starts on them
+static void flushStream(ThreadVars *v, CoclStream *coclStream) {
+    cl_int err;
+    if(v->launchBlocking) {
+        err = clFinish(coclStream->clqueue->queue);
+    } else {
+        err = clFlush(coclStream->clqueue->queue);
+    }
+    EasyCL::checkError(err);
+}
+
+// queues a copy between device memory and host memory. If the host memory is pinned, and the range
+// fits in it, this is a device-side copy, from or to the host allocation's own buffer. Otherwise
+// it is a read or write, from or to the host pointer
+static void enqueueHostCopy(cl_command_queue queue, bool toHost, Memory *deviceMemory, size_t deviceOffset,
+        void *hostPointer, size_t bytes, cl_bool blocking) {
+    Context *context = getThreadVars()->getContext();
+    HostAllocation *hostAllocation = 0;
+    if(context->numHostAllocations.load() > 0) {
+        hostAllocation = findHostAllocation(hostPointer);
+        if(hostAllocation != 0 && (char *)hostPointer + bytes > hostAllocation->hostPos + hostAllocation->bytes) {
+            hostAllocation = 0;
+        }
+    }
+    HostAllocationsOnDevice onDevice(queue);
+    onDevice.add(deviceMemory);
+    if(hostAllocation != 0) {
+        onDevice.add(hostAllocation->deviceMemory);
+    }
+    onDevice.unmap();
+    cl_int err;
+    if(hostAllocation != 0) {
+        COCL_PRINT("copy via host allocation " << (void *)hostAllocation->hostPos << " toHost=" << toHost);
+        size_t hostOffset = (char *)hostPointer - hostAllocation->hostPos;
+        cl_mem hostClmem = hostAllocation->deviceMemory->clmem;
+        if(toHost) {
+            err = clEnqueueCopyBuffer(queue, deviceMemory->clmem, hostClmem, deviceOffset, hostOffset, bytes, 0, 0, 0);
+        } else {
+            err = clEnqueueCopyBuffer(queue, hostClmem, deviceMemory->clmem, hostOffset, deviceOffset, bytes, 0, 0, 0);
+        }
+    } else if(toHost) {
+        err = clEnqueueReadBuffer(queue, deviceMemory->clmem, blocking, deviceOffset, bytes, hostPointer, 0, 0, 0);
+    } else {
+        err = clEnqueueWriteBuffer(queue, deviceMemory->clmem, blocking, deviceOffset, bytes, hostPointer, 0, 0, 0);
+    }
+    EasyCL::checkError(err);
+    onDevice.remap();
+    if(blocking && !onDevice.empty()) {
+        // the host memory is only usable again once it has been mapped again
+        EasyCL::checkError(clFinish(queue));
+    }
+}
+
+static void enqueueDeviceCopy(cl_command_queue queue, Memory *dstMemory, size_t dstOffset,
+        Memory *srcMemory, size_t srcOffset, size_t bytes) {
+    HostAllocationsOnDevice onDevice(queue);
+    onDevice.add(srcMemory);
+    onDevice.add(dstMemory);
+    onDevice.unmap();
+    cl_int err = clEnqueueCopyBuffer(queue, srcMemory->clmem, dstMemory->clmem, srcOffset, dstOffset, bytes, 0, 0, 0);
+    EasyCL::checkError(err);
+    onDevice.remap();
+}
+
+static const char *getMemcpyTraceName(size_t kind) {
+    switch(kind) {
+        case cudaMemcpyDeviceToHost: return "memcpy DtoH";
+        case cudaMemcpyHostToDevice: return "memcpy HtoD";
+        case cudaMemcpyDeviceToDevice: return "memcpy DtoD";
+        default: return "memcpy";
+    }
+}
+
 size_t cudaMemcpyAsync (void *dst, const void *src, size_t count, size_t cudaMemcpyKind, char *_queue) {
     ThreadVars *v = getThreadVars();
-    CoclStream *coclStream = (CoclStream *)_queue;
+    CoclStream *coclStream = getStreamOrDefault(v, _queue);
     COCL_PRINT("cudaMemcpyAsync kind=" << cudaMemcpyKind << " ctx=" << (void *)v->currentContext
        << " src=" << src << " dst=" << dst << " count=" << count);
-
-    if(coclStream == 0) {
-        coclStream = v->currentContext->default_stream.get();
+    if(coclStream->capturingGraph != 0) {
+        coclStream->capturingGraph->addMemcpy(dst, src, count, cudaMemcpyKind);
+        return 0;
     }
+
     CLQueue *queue = coclStream->clqueue;
-    cl_int err;
+    TraceScope traceScope("memcpy", getMemcpyTraceName(cudaMemcpyKind));
+    DeviceTraceSpan deviceTraceSpan("memcpy", getMemcpyTraceName(cudaMemcpyKind), queue->queue);
     if(cudaMemcpyKind == cudaMemcpyDeviceToHost) {
         Memory *srcMemory = findMemory((const char *)src);
         if(srcMemory == 0) {
@@ -152,9 +674,7 @@ size_t cudaMemcpyAsync (void *dst, const void *src, size_t count, size_t cudaMem
             throw runtime_error("couldnt find memory for src");
         }
         size_t src_offset = srcMemory->getOffset((const char *)src);
-        err = clEnqueueReadBuffer(queue->queue, srcMemory->clmem, CL_FALSE, src_offset,
-                                         count, dst, 0, NULL, NULL);
-        EasyCL::checkError(err);
+        enqueueHostCopy(queue->queue, true, srcMemory, src_offset, dst, count, CL_FALSE);
     } else if(cudaMemcpyKind == cudaMemcpyHostToDevice) {
         Memory *dstMemory = findMemory((char *)dst);
         if(dstMemory == 0) {
@@ -162,9 +682,7 @@ size_t cudaMemcpyAsync (void *dst, const void *src, size_t count, size_t cudaMem
             throw runtime_error("couldnt find memory for dst");
         }
         size_t dst_offset = dstMemory->getOffset((char *)dst);
-        err = clEnqueueWriteBuffer(queue->queue, dstMemory->clmem, CL_FALSE, dst_offset,
-                                          count, src, 0, NULL, NULL);
-        EasyCL::checkError(err);
+        enqueueHostCopy(queue->queue, false, dstMemory, dst_offset, (void *)src, count, CL_FALSE);
     } else if(cudaMemcpyKind == cudaMemcpyDeviceToDevice) {
         Memory *dstMemory = findMemory((char *)dst);
         size_t dst_offset = dstMemory->getOffset((char *)dst);
@@ -179,62 +697,48 @@ size_t cudaMemcpyAsync (void *dst, const void *src, size_t count, size_t cudaMem
             cout << "coudlnt find memory for src " << (const void *)src << endl;
             throw runtime_error("couldnt find memory for src");
         }
-
-        err = clEnqueueCopyBuffer(
-            queue->queue,
-            srcMemory->clmem,
-            dstMemory->clmem,
-            src_offset,
-            dst_offset,
-            count,
-            0,
-            0,
-            0);
-        EasyCL::checkError(err);
+        enqueueDeviceCopy(queue->queue, dstMemory, dst_offset, srcMemory, src_offset, count);
     } else {
         throw runtime_error("unhandled cudaMemcpyKind");
     }
-
+    deviceTraceSpan.end();
+    flushStream(v, coclStream);
     return 0;
 }
 
 size_t cudaMemsetAsync(void *location, int value, size_t count, char *_queue) {
     COCL_PRINT("cudaMemsetAsync value=" << value << " count=" << count << " queue=" << (long)_queue);
 
-    // this is not terribly async for now :-P
-
-    Memory *memory = findMemory((char *)location);
+    // queued on the stream, like a kernel launch, so it is ordered with respect to the stream's
+    // kernels, copies and events, without the host having to wait
     ThreadVars *v = getThreadVars();
+    CoclStream *coclStream = getStreamOrDefault(v, _queue);
+    if(coclStream->capturingGraph != 0) {
+        coclStream->capturingGraph->addMemset(location, value, count);
+        return 0;
+    }
+    Memory *memory = findMemory((char *)location);
+    if(memory == 0) {
+        throw runtime_error("cudaMemsetAsync: location not in any allocation");
+    }
     size_t offsetBytes = memory->getOffset((char *)location);
-    // std::cout << "memory " << (long)memory << std::endl;
-    // std::cout << " memory bytes " << memory->bytes << std::endl;
-    // std::cout << " offsetBytes " << offsetBytes << std::endl;
-
-    cl_int err;
-
-    err = clFinish(v->currentContext->default_stream.get()->clqueue->queue);
-    EasyCL::checkError(err);
-    // std::cout << "clfinished the queue" << std::endl;
-
-    if(count % 4 == 0) {
-        unsigned int fourbytes = 0;
-        for(int j=0; j < 4; j++) {
-            fourbytes <<= 8;
-            fourbytes |= (value & 255);
-        }
-        int intCount = count >> 2;
-        myEnqueueFillBuffer(
-            v->currentContext->default_stream.get()->clqueue->queue,
-            memory->clmem,
-            fourbytes,
-            offsetBytes, intCount);
-    } else {
-        cout << "memset should be multiple of 4 count" << std::endl;
-        throw std::runtime_error("cudaMemsetAsync should have count multiple of 4");
+    if(offsetBytes + count > memory->bytes) {
+        throw runtime_error("cudaMemsetAsync: would write past the end of the allocation");
     }
-    err = clFinish(v->currentContext->default_stream.get()->clqueue->queue);
-    EasyCL::checkError(err);
-    // COCL_PRINT("finished cudaMemsetAsync");
+
+    TraceScope traceScope("memset", "cudaMemsetAsync");
+    DeviceTraceSpan deviceTraceSpan("memset", "cudaMemsetAsync", coclStream->clqueue->queue);
+    HostAllocationsOnDevice onDevice(coclStream->clqueue->queue);
+    onDevice.add(memory);
+    onDevice.unmap();
+    myEnqueueFillBuffer(
+        coclStream->clqueue->queue,
+        memory->clmem,
+        (unsigned char)value,
+        offsetBytes, count);
+    onDevice.remap();
+    deviceTraceSpan.end();
+    flushStream(v, coclStream);
     return 0;
 }
 
@@ -244,8 +748,14 @@ size_t cuMemsetD8(CUdeviceptr location, unsigned char value, uint32_t count) {
     ThreadVars *v = getThreadVars();
     Memory *memory = findMemory((char *)location);
     size_t offset = memory->getOffset((char *)location);
+    TraceScope traceScope("memset", "cuMemsetD8");
+    DeviceTraceSpan deviceTraceSpan("memset", "cuMemsetD8", v->currentContext->default_stream.get()->clqueue->queue);
+    HostAllocationsOnDevice onDevice(v->currentContext->default_stream.get()->clqueue->queue);
+    onDevice.add(memory);
+    onDevice.unmap();
     cl_int err = clEnqueueFillBuffer(v->currentContext->default_stream.get()->clqueue->queue, memory->clmem, &value, sizeof(unsigned char), offset, count * sizeof(unsigned char), 0, 0, 0);
     EasyCL::checkError(err);
+    onDevice.remap();
     return 0;
 }
 
@@ -254,8 +764,14 @@ size_t cuMemsetD32(CUdeviceptr location, unsigned int value, uint32_t count) {
     ThreadVars *v = getThreadVars();
     size_t offset = memory->getOffset((char *)location);
     COCL_PRINT("cuMemsetD32 redirected value " << value << " count=" << count << " location=" << location << " memory=" << (void *)memory);
+    TraceScope traceScope("memset", "cuMemsetD32");
+    DeviceTraceSpan deviceTraceSpan("memset", "cuMemsetD32", v->currentContext->default_stream.get()->clqueue->queue);
+    HostAllocationsOnDevice onDevice(v->currentContext->default_stream.get()->clqueue->queue);
+    onDevice.add(memory);
+    onDevice.unmap();
     cl_int err = clEnqueueFillBuffer(v->currentContext->default_stream.get()->clqueue->queue, memory->clmem, &value, sizeof(int), offset, count * sizeof(int), 0, 0, 0);
     EasyCL::checkError(err);
+    onDevice.remap();
     return 0;
 }
 
@@ -270,36 +786,27 @@ size_t cuDeviceTotalMem(size_t *value, CUdeviceptr device) {
 
 size_t cudaMemcpy(void *dst, const void *src, size_t bytes, cudaMemcpyKind kind) {
     COCL_PRINT("cudamempcy using opencl cudaMemcpyKind " << kind << " count=" << bytes);
-    cl_int err;
     ThreadVars *v = getThreadVars();
+    TraceScope traceScope("memcpy", getMemcpyTraceName(kind));
+    // kernel launches are asynchronous, so wait for any outstanding work, on any stream,
+    // as the legacy default stream would
+    v->getContext()->synchronize();
+    DeviceTraceSpan deviceTraceSpan("memcpy", getMemcpyTraceName(kind), v->currentContext->default_stream.get()->clqueue->queue);
+    cl_command_queue queue = v->currentContext->default_stream.get()->clqueue->queue;
     if(kind == cudaMemcpyDeviceToHost) {
         Memory *srcMemory = findMemory((const char *)src);
         size_t offset = srcMemory->getOffset((const char *)src);
-        err = clEnqueueReadBuffer(v->currentContext->default_stream.get()->clqueue->queue, srcMemory->clmem, CL_TRUE, offset,
-                                         bytes, dst, 0, NULL, NULL);
-        EasyCL::checkError(err);
+        enqueueHostCopy(queue, true, srcMemory, offset, dst, bytes, CL_TRUE);
     } else if(kind == cudaMemcpyHostToDevice) {
         Memory *dstMemory = findMemory((char *)dst);
         size_t offset = dstMemory->getOffset((char *)dst);
-        err = clEnqueueWriteBuffer(v->currentContext->default_stream.get()->clqueue->queue, dstMemory->clmem, CL_TRUE, offset,
-                                          bytes, src, 0, NULL, NULL);
-        EasyCL::checkError(err);
+        enqueueHostCopy(queue, false, dstMemory, offset, (void *)src, bytes, CL_TRUE);
     } else if(kind == cudaMemcpyDeviceToDevice) {
         Memory *srcMemory = findMemory((const char *)src);
         size_t src_offset = srcMemory->getOffset((const char *)src);
         Memory *dstMemory = findMemory((char *)dst);
         size_t dst_offset = dstMemory->getOffset((char *)dst);
-        err = clEnqueueCopyBuffer(
-            v->currentContext->default_stream.get()->clqueue->queue,
-            srcMemory->clmem,
-            dstMemory->clmem,
-            src_offset,
-            dst_offset,
-            bytes,
-            0,
-            0,
-            0);
-        EasyCL::checkError(err);
+        enqueueDeviceCopy(queue, dstMemory, dst_offset, srcMemory, src_offset, bytes);
     } else {
         cout << "cudaMemcpy cudaMemcpyKind using opencl " << kind << endl;
         throw runtime_error("unhandled cudaMemcpyKind");
@@ -307,54 +814,65 @@ size_t cudaMemcpy(void *dst, const void *src, size_t bytes, cudaMemcpyKind kind)
     return 0;
 }
 
+// non-blocking: the write is queued on the stream, after anything already queued there, and the
+// host returns straight away. As for cudaMemcpyAsync, src should stay valid, and unmodified,
+// until the stream, or an event recorded after the copy, has been synchronized
 size_t cuMemcpyHtoDAsync(CUdeviceptr dst, const void *src, size_t bytes, char *_queue) {
-    CoclStream *coclStream = (CoclStream *)_queue;
+    ThreadVars *v = getThreadVars();
+    CoclStream *coclStream = getStreamOrDefault(v, _queue);
     CLQueue *queue = coclStream->clqueue;
     COCL_PRINT("cuMemcpyHtoDAsync dst=" << dst << " src=" << src << " bytes=" << bytes);
+    if(coclStream->capturingGraph != 0) {
+        coclStream->capturingGraph->addMemcpy((void *)dst, src, bytes, cudaMemcpyHostToDevice);
+        return 0;
+    }
     Memory *dstMemory = findMemory((char *)dst);
+    if(dstMemory == 0) {
+        throw runtime_error("cuMemcpyHtoDAsync: couldnt find memory for dst");
+    }
     size_t offset = dstMemory->getOffset((char *)dst);
-    cl_int err;
 
-    err = clEnqueueWriteBuffer(queue->queue, dstMemory->clmem, CL_TRUE, offset,
-                                      bytes, src, 0, NULL, NULL);
-    EasyCL::checkError(err);
-
-    err = clFinish(queue->queue);
-    EasyCL::checkError(err);
-    COCL_PRINT(" ... done cuMemcpyHtoDAsync dst=" << dst << " src=" << src << " bytes=" << bytes);
+    TraceScope traceScope("memcpy", "memcpy HtoD");
+    DeviceTraceSpan deviceTraceSpan("memcpy", "memcpy HtoD", queue->queue);
+    enqueueHostCopy(queue->queue, false, dstMemory, offset, (void *)src, bytes, CL_FALSE);
+    deviceTraceSpan.end();
+    flushStream(v, coclStream);
+    COCL_PRINT(" ... queued cuMemcpyHtoDAsync dst=" << dst << " src=" << src << " bytes=" << bytes);
     return 0;
 }
 
+// non-blocking: dst is only valid once the stream, or an event recorded after the copy, has
+// been synchronized
 size_t  cuMemcpyDtoHAsync(void *dst, CUdeviceptr src, size_t bytes, char *_queue) {
-    CoclStream *coclStream = (CoclStream *)_queue;
+    ThreadVars *v = getThreadVars();
+    CoclStream *coclStream = getStreamOrDefault(v, _queue);
     CLQueue *queue = coclStream->clqueue;
     COCL_PRINT("cuMemcpyDtoHAsync queue=" << (void *)queue << " dst=" << dst << " src=" << src << " bytes=" << bytes);
+    if(coclStream->capturingGraph != 0) {
+        coclStream->capturingGraph->addMemcpy(dst, (const void *)src, bytes, cudaMemcpyDeviceToHost);
+        return 0;
+    }
     Memory *srcMemory = findMemory((char *)src);
+    if(srcMemory == 0) {
+        throw runtime_error("cuMemcpyDtoHAsync: couldnt find memory for src");
+    }
     size_t offset = srcMemory->getOffset((char *)src);
 
     // adding this because otherwise seems I need to call synchronize, on intel hd beignet, before
     // copying data back (even though the copy should wait, by virtue of being on the same queue, I think)
     // this error shows up only in testblas, for now
-
+    // (the barrier is only queued; the host doesnt wait for it)
+    TraceScope traceScope("memcpy", "memcpy DtoH");
+    DeviceTraceSpan deviceTraceSpan("memcpy", "memcpy DtoH", queue->queue);
     cl_int err = clEnqueueBarrierWithWaitList(
         queue->queue, 0, 0, 0
     );
     EasyCL::checkError(err);
 
-    COCL_PRINT("   cuMemcpyDtoHAsync ...enqueued barrier with wait list")
-
-    err = clFinish(queue->queue);
-    EasyCL::checkError(err);
-
-    err = clEnqueueReadBuffer(queue->queue, srcMemory->clmem, CL_TRUE, offset,
-                                     bytes, dst, 0, NULL, NULL);
-    EasyCL::checkError(err);
-
-    COCL_PRINT("   cuMemcpyDtoHAsync ...enqueued read buffer")
-    EasyCL::checkError(err);
-    err = clFinish(queue->queue);
-    EasyCL::checkError(err);
-    COCL_PRINT("   cuMemcpyDtoHAsync ...finished clfinish")
+    enqueueHostCopy(queue->queue, true, srcMemory, offset, dst, bytes, CL_FALSE);
+    deviceTraceSpan.end();
+    flushStream(v, coclStream);
+    COCL_PRINT("   cuMemcpyDtoHAsync ...queued read buffer")
     return 0;
 }
 
@@ -395,6 +913,10 @@ size_t cudaMalloc(float **pMemory, size_t N) {
 size_t cudaFree(void *_memory) {
     Memory *memory = findMemory((char *)_memory);
     COCL_PRINT("cudafree using opencl memory=" << memory);
+    if(memory != 0 && memory->hostAllocation != 0) {
+        // its HostAllocation owns it, and would be left with a dangling deviceMemory
+        throw runtime_error("cudaFree: pointer is the device pointer of a host allocation. Use cudaFreeHost on the host pointer instead");
+    }
     delete memory;
     return 0;
 }
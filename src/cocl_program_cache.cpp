@@ -0,0 +1,325 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/cocl_program_cache.h"
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace easycl;
+
+#ifdef COCL_PRINT
+#undef COCL_PRINT
+#endif
+
+#ifdef COCL_SPAM_KERNELLAUNCH
+#define COCL_PRINT(x) std::cout << "[PROGCACHE] " << x << std::endl;
+#else
+#define COCL_PRINT(x)
+#endif
+
+#define KERNEL_CACHE_ENV_VAR "COCL_KERNEL_CACHE"
+#define KERNEL_CACHE_DIR_ENV_VAR "COCL_KERNEL_CACHE_DIR"
+#define KERNEL_CACHE_MAX_MB_ENV_VAR "COCL_KERNEL_CACHE_MAX_MB"
+
+namespace cocl {
+
+namespace {
+
+const char fileMagic[8] = {'C', 'O', 'C', 'L', 'B', 'I', 'N', '1'};
+
+struct ProgramCacheConfig {
+    bool enabled = false;
+    string dir = "";
+    uint64_t maxBytes = (uint64_t)512 * 1024 * 1024;
+};
+
+std::mutex programCacheMutex;  // guards stats, and eviction
+ProgramCacheStats programCacheStats;
+
+// FNV-1a. We need hashes that are stable across runs and compilers, so cant use std::hash
+uint64_t fnv1a64(const string &value, uint64_t hash) {
+    for(size_t i = 0; i < value.size(); i++) {
+        hash ^= (unsigned char)value[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+string getDeviceString(cl_device_id device, cl_device_info name) {
+    size_t size = 0;
+    cl_int err = clGetDeviceInfo(device, name, 0, 0, &size);
+    if(err != CL_SUCCESS) {
+        return "";
+    }
+    vector<char> value(size + 1, 0);
+    err = clGetDeviceInfo(device, name, size, &value[0], 0);
+    if(err != CL_SUCCESS) {
+        return "";
+    }
+    return string(&value[0]);
+}
+
+#ifndef _WIN32
+void makeDirs(const string &path) {
+    for(size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        mkdir(path.substr(0, pos).c_str(), 0755);
+        if(pos == string::npos) {
+            break;
+        }
+    }
+}
+#endif
+
+std::mutex programCacheConfigMutex;  // programCacheConfig, and programCacheConfigured
+ProgramCacheConfig programCacheConfig;
+bool programCacheConfigured = false;
+
+void readConfigFromEnv(ProgramCacheConfig *config) {
+#ifndef _WIN32
+    // off unless asked for, since it writes to disk
+    string enable = getenv(KERNEL_CACHE_ENV_VAR) != 0 ? getenv(KERNEL_CACHE_ENV_VAR) : "";
+    if(enable == "0") {
+        return;
+    }
+    if(getenv(KERNEL_CACHE_DIR_ENV_VAR) != 0) {
+        config->dir = getenv(KERNEL_CACHE_DIR_ENV_VAR);
+    } else if(enable == "1" && getenv("HOME") != 0) {
+        config->dir = string(getenv("HOME")) + "/.coriander/kernelcache";
+    } else {
+        return;
+    }
+    if(getenv(KERNEL_CACHE_MAX_MB_ENV_VAR) != 0) {
+        config->maxBytes = (uint64_t)atoll(getenv(KERNEL_CACHE_MAX_MB_ENV_VAR)) * 1024 * 1024;
+    }
+    makeDirs(config->dir);
+    config->enabled = true;
+#endif
+}
+
+ProgramCacheConfig getConfig() {
+    std::lock_guard< std::mutex > guard(programCacheConfigMutex);
+    if(!programCacheConfigured) {
+        readConfigFromEnv(&programCacheConfig);
+        programCacheConfigured = true;
+    }
+    return programCacheConfig;
+}
+
+// the key covers everything that could change the binary. We name the file after one hash,
+// and store a second, independent, one inside it, to catch collisions
+string getKeyString(EasyCL *cl, const string &clSourcecode, const string &options) {
+    ostringstream key;
+    key << getDeviceString(cl->device, CL_DEVICE_NAME) << '\n';
+    key << getDeviceString(cl->device, CL_DEVICE_VENDOR) << '\n';
+    key << getDeviceString(cl->device, CL_DEVICE_VERSION) << '\n';
+    key << getDeviceString(cl->device, CL_DRIVER_VERSION) << '\n';
+    key << options << '\n';
+    key << clSourcecode;
+    return key.str();
+}
+
+string getCacheFilePath(const ProgramCacheConfig &config, const string &key) {
+    char hashString[17];
+    snprintf(hashString, sizeof(hashString), "%016llx", (unsigned long long)fnv1a64(key, 14695981039346656037ull));
+    return config.dir + "/" + hashString + ".bin";
+}
+
+uint64_t getCheckHash(const string &key) {
+    return fnv1a64(key, 0x9e3779b97f4a7c15ull);
+}
+
+#ifndef _WIN32
+void evictIfNeeded(const ProgramCacheConfig &config) {
+    // caller should hold programCacheMutex
+    DIR *dir = opendir(config.dir.c_str());
+    if(dir == 0) {
+        return;
+    }
+    vector<pair<time_t, string> > files;
+    uint64_t totalBytes = 0;
+    while(struct dirent *entry = readdir(dir)) {
+        string name = entry->d_name;
+        if(name.size() < 4 || name.substr(name.size() - 4) != ".bin") {
+            continue;
+        }
+        string path = config.dir + "/" + name;
+        struct stat fileStat;
+        if(stat(path.c_str(), &fileStat) != 0) {
+            continue;
+        }
+        totalBytes += fileStat.st_size;
+        files.push_back(make_pair(fileStat.st_mtime, path));
+    }
+    closedir(dir);
+    if(totalBytes <= config.maxBytes) {
+        return;
+    }
+    // we touch files on each hit, so oldest mtime is least recently used
+    sort(files.begin(), files.end());
+    for(auto it=files.begin(); it != files.end() && totalBytes > config.maxBytes; it++) {
+        struct stat fileStat;
+        if(stat(it->second.c_str(), &fileStat) == 0 && unlink(it->second.c_str()) == 0) {
+            COCL_PRINT("evicting " << it->second);
+            totalBytes -= fileStat.st_size;
+            programCacheStats.evictions++;
+        }
+    }
+}
+#endif
+
+} // namespace
+
+cl_program loadCachedProgram(EasyCL *cl, const string &clSourcecode, const string &options) {
+#ifdef _WIN32
+    return 0;
+#else
+    ProgramCacheConfig config = getConfig();
+    if(!config.enabled) {
+        return 0;
+    }
+    string key = getKeyString(cl, clSourcecode, options);
+    string path = getCacheFilePath(config, key);
+    FILE *f = fopen(path.c_str(), "rb");
+    if(f == 0) {
+        std::lock_guard< std::mutex > guard(programCacheMutex);
+        programCacheStats.misses++;
+        return 0;
+    }
+    char magic[sizeof(fileMagic)];
+    uint64_t checkHash = 0;
+    uint64_t binarySize = 0;
+    vector<unsigned char> binary;
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, fileMagic, sizeof(magic)) == 0 &&
+        fread(&checkHash, sizeof(checkHash), 1, f) == 1 && checkHash == getCheckHash(key) &&
+        fread(&binarySize, sizeof(binarySize), 1, f) == 1 && binarySize > 0;
+    if(ok) {
+        binary.resize(binarySize);
+        ok = fread(&binary[0], 1, binarySize, f) == binarySize;
+    }
+    fclose(f);
+
+    cl_program program = 0;
+    if(ok) {
+        const unsigned char *binaryPtr = &binary[0];
+        size_t binaryLength = binarySize;
+        cl_int binaryStatus = CL_SUCCESS;
+        cl_int err = CL_SUCCESS;
+        program = clCreateProgramWithBinary(*cl->context, 1, &cl->device, &binaryLength, &binaryPtr, &binaryStatus, &err);
+        if(err != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+            if(program != 0) {
+                clReleaseProgram(program);
+            }
+            program = 0;
+        } else if(clBuildProgram(program, 1, &cl->device, options.c_str(), 0, 0) != CL_SUCCESS) {
+            // eg driver was updated in a way that didnt change the version string
+            clReleaseProgram(program);
+            program = 0;
+        }
+    }
+    std::lock_guard< std::mutex > guard(programCacheMutex);
+    if(program == 0) {
+        COCL_PRINT("failed to load " << path << ", removing it");
+        unlink(path.c_str());
+        programCacheStats.loadFailures++;
+        programCacheStats.misses++;
+        return 0;
+    }
+    utimes(path.c_str(), 0);  // mark as recently used, for eviction
+    COCL_PRINT("loaded " << path);
+    programCacheStats.hits++;
+    return program;
+#endif
+}
+
+void storeCachedProgram(EasyCL *cl, cl_program program, const string &clSourcecode, const string &options) {
+#ifndef _WIN32
+    ProgramCacheConfig config = getConfig();
+    if(!config.enabled) {
+        return;
+    }
+    size_t binarySize = 0;
+    cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, 0);
+    if(err != CL_SUCCESS || binarySize == 0) {
+        return;
+    }
+    vector<unsigned char> binary(binarySize);
+    unsigned char *binaryPtr = &binary[0];
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binaryPtr, 0);
+    if(err != CL_SUCCESS) {
+        return;
+    }
+
+    string key = getKeyString(cl, clSourcecode, options);
+    string path = getCacheFilePath(config, key);
+    // write to a temporary file, then rename, so other processes never see a partial file
+    ostringstream tmpPath;
+    tmpPath << path << ".tmp." << getpid() << "." << (uint64_t)program;
+    FILE *f = fopen(tmpPath.str().c_str(), "wb");
+    if(f == 0) {
+        return;
+    }
+    uint64_t checkHash = getCheckHash(key);
+    uint64_t binarySize64 = binarySize;
+    bool ok = fwrite(fileMagic, sizeof(fileMagic), 1, f) == 1 &&
+        fwrite(&checkHash, sizeof(checkHash), 1, f) == 1 &&
+        fwrite(&binarySize64, sizeof(binarySize64), 1, f) == 1 &&
+        fwrite(&binary[0], 1, binarySize, f) == binarySize;
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || rename(tmpPath.str().c_str(), path.c_str()) != 0) {
+        unlink(tmpPath.str().c_str());
+        return;
+    }
+    COCL_PRINT("stored " << path << " bytes=" << binarySize);
+    std::lock_guard< std::mutex > guard(programCacheMutex);
+    programCacheStats.writes++;
+    evictIfNeeded(config);
+#endif
+}
+
+void configureProgramCache(const string &dir, uint64_t maxBytes) {
+    std::lock_guard< std::mutex > guard(programCacheConfigMutex);
+    programCacheConfig = ProgramCacheConfig();
+    programCacheConfigured = true;
+#ifndef _WIN32
+    if(dir != "") {
+        programCacheConfig.dir = dir;
+        programCacheConfig.maxBytes = maxBytes;
+        makeDirs(dir);
+        programCacheConfig.enabled = true;
+    }
+#endif
+}
+
+ProgramCacheStats getProgramCacheStats() {
+    std::lock_guard< std::mutex > guard(programCacheMutex);
+    return programCacheStats;
+}
+
+} // namespace cocl
@@ -15,8 +15,11 @@
 #include "cocl/cocl_streams.h"
 
 #include "cocl/cocl_events.h"
+#include "cocl/cocl_error.h"
 #include "cocl/hostside_opencl_funcs.h"
 #include "cocl/cocl_context.h"
+#include "cocl/cocl_trace.h"
+#include "cocl/cocl_graphs.h"
 
 #include "EasyCL/EasyCL.h"
 
@@ -25,6 +28,8 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <cstring>
+#include <cstdlib>
 
 
 using namespace std;
@@ -36,6 +41,9 @@ using namespace easycl;
 // #define COCL_PRINT(stuff) \
 //     stuff ;
 
+#define STAGING_RING_KB_ENV_VAR "COCL_STAGING_RING_KB"
+#define PROFILING_ENV_VAR "COCL_PROFILING"
+
 namespace cocl {
     void coclCallback(cl_event event, cl_int status, void *userdata) {
         // cout << "coclCallback running " << endl;
@@ -46,12 +54,143 @@ namespace cocl {
         delete info;
     }
 
-    CoclStream::CoclStream(EasyCL *cl) {
-        this->clqueue = cl->newQueue();
+    // struct args are placed at multiples of this, like device allocations
+    static const size_t stagingRingAlignment = 128;
+
+    StagingRing::StagingRing(EasyCL *cl, size_t capacity) :
+            capacity(capacity), hostData(capacity) {
+        cl_int err;
+        clmem = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE, capacity, 0, &err);
+        EasyCL::checkError(err);
+    }
+    StagingRing::~StagingRing() {
+        // wait for any kernels still reading from the ring
+        for(auto it=regions.begin(); it != regions.end(); it++) {
+            if(it->done != 0) {
+                clWaitForEvents(1, &it->done);
+                clReleaseEvent(it->done);
+            }
+        }
+        clReleaseMemObject(clmem);
+    }
+    bool StagingRing::upload(cl_command_queue queue, const char *data, size_t bytes, size_t *offset) {
+        std::lock_guard< std::mutex > guard(mutex);
+        // we reserve whole multiples of the alignment, but only copy what the caller gave us
+        size_t reserved = (bytes + stagingRingAlignment - 1) / stagingRingAlignment * stagingRingAlignment;
+        if(reserved > capacity) {
+            return false;
+        }
+        size_t start = head + reserved > capacity ? 0 : head;
+        // any region we overlap must be finished with. We check them all, rather than just the
+        // oldest, since after wrapping, we can overlap newer regions too
+        for(auto it=regions.begin(); it != regions.end(); it++) {
+            if(start < it->offset + it->bytes && it->offset < start + reserved) {
+                cl_int status = CL_QUEUED;
+                if(it->done == 0 || clGetEventInfo(it->done, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                        sizeof(status), &status, 0) != CL_SUCCESS || status != CL_COMPLETE) {
+                    COCL_PRINT("staging ring full, falling back");
+                    return false;
+                }
+            }
+        }
+        for(auto it=regions.begin(); it != regions.end();) {
+            if(start < it->offset + it->bytes && it->offset < start + reserved) {
+                clReleaseEvent(it->done);
+                it = regions.erase(it);
+            } else {
+                it++;
+            }
+        }
+        memcpy(&hostData[start], data, bytes);
+        cl_int err = clEnqueueWriteBuffer(queue, clmem, CL_FALSE, start, bytes, &hostData[start], 0, 0, 0);
+        EasyCL::checkError(err);
+        regions.push_back(Region { start, reserved, 0 });
+        head = start + reserved;
+        *offset = start;
+        return true;
+    }
+    void StagingRing::retire(size_t offset, cl_event event) {
+        std::lock_guard< std::mutex > guard(mutex);
+        for(auto it=regions.rbegin(); it != regions.rend(); it++) {
+            if(it->offset == offset && it->done == 0) {
+                it->done = event;
+                return;
+            }
+        }
+        clReleaseEvent(event);
+    }
+
+    bool isProfilingEnabled() {
+        // tracing needs device timestamps too
+        static bool enabled = (getenv(PROFILING_ENV_VAR) != 0 && string(getenv(PROFILING_ENV_VAR)) == "1") ||
+            isTracingEnabled();
+        return enabled;
+    }
+
+    CoclStream::CoclStream(EasyCL *cl) :
+            cl(cl) {
+        if(isProfilingEnabled()) {
+            cl_int err;
+            cl_command_queue queue = clCreateCommandQueue(*cl->context, cl->device, CL_QUEUE_PROFILING_ENABLE, &err);
+            EasyCL::checkError(err);
+            this->clqueue = new CLQueue(cl, queue);
+        } else {
+            this->clqueue = cl->newQueue();
+        }
     }
     CoclStream::~CoclStream() {
+        if(lastQueryMarker != 0) {
+            clReleaseEvent(lastQueryMarker);
+        }
+        stagingRing.reset();
         delete clqueue;
     }
+    bool CoclStream::query() {
+        std::lock_guard< std::mutex > guard(queryMutex);
+        cl_int err;
+        if(lastQueryMarker != 0) {
+            cl_int status;
+            err = clGetEventInfo(lastQueryMarker, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, 0);
+            EasyCL::checkError(err);
+            if(status < 0) {
+                EasyCL::checkError(status);  // something on the queue failed
+            }
+            if(status != CL_COMPLETE) {
+                // the queue is in-order, so anything queued after the marker isnt finished either
+                return false;
+            }
+            clReleaseEvent(lastQueryMarker);
+            lastQueryMarker = 0;
+        }
+        // there might have been more work queued since the last marker, so we need a new one
+        cl_event marker;
+        err = clEnqueueMarkerWithWaitList(clqueue->queue, 0, 0, &marker);
+        EasyCL::checkError(err);
+        err = clFlush(clqueue->queue);
+        EasyCL::checkError(err);
+        cl_int status;
+        err = clGetEventInfo(marker, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, 0);
+        EasyCL::checkError(err);
+        if(status == CL_COMPLETE) {
+            clReleaseEvent(marker);
+            return true;
+        }
+        lastQueryMarker = marker;
+        return false;
+    }
+
+    StagingRing *CoclStream::getStagingRing() {
+        std::call_once(stagingRingCreated, [this]() {
+            size_t capacityKb = 1024;
+            if(getenv(STAGING_RING_KB_ENV_VAR) != 0) {
+                capacityKb = atoi(getenv(STAGING_RING_KB_ENV_VAR));
+            }
+            if(capacityKb > 0) {
+                stagingRing.reset(new StagingRing(cl, capacityKb * 1024));
+            }
+        });
+        return stagingRing.get();
+    }
 }
 
 size_t cudaStreamSynchronize(char *_queue) {
@@ -61,6 +200,16 @@ size_t cudaStreamSynchronize(char *_queue) {
     if(stream == 0) {
         stream = v->currentContext->default_stream.get();
     }
+    if(stream->capturingGraph != 0) {
+        // nothing captured has been queued yet, so there is nothing to wait for
+        stream->capturingGraph->invalidated = true;
+        return cudaErrorStreamCaptureUnsupported;
+    }
+    if(stream == v->currentContext->default_stream.get()) {
+        // legacy default stream semantics: waits for work on all other streams too
+        v->currentContext->synchronize();
+        return 0;
+    }
     CLQueue *queue = stream->clqueue;
     COCL_PRINT(cout << "cudaStreamSynchronize queue=" << queue << endl);
     if(queue == 0) {
@@ -81,6 +230,7 @@ size_t cuStreamCreate(char **_pstream, unsigned int flags) {
     ThreadVars *v = getThreadVars();
     EasyCL *cl = v->getContext()->getCl();
     CoclStream *coclStream = new CoclStream(cl);
+    v->getContext()->registerStream(coclStream);
     *pstream = coclStream;
     return 0;
 }
@@ -91,6 +241,7 @@ size_t cudaStreamCreate(char **_pstream) {
 
 size_t cuStreamDestroy_v2(char *_queue) {
     CoclStream *stream = (CoclStream *)_queue;
+    getThreadVars()->getContext()->unregisterStream(stream);
     delete stream;
     return 0;
 }
@@ -100,15 +251,23 @@ size_t cudaStreamDestroy(char *_queue) {
 }
 
 size_t cudaStreamQuery(char *_queue) {
-    return cuStreamSynchronize(_queue);
+    CoclStream *stream = (CoclStream *)_queue;
+    if(stream == 0) {
+        stream = getThreadVars()->getContext()->default_stream.get();
+    }
+    return stream->query() ? cudaSuccess : cudaErrorNotReady;
 }
 
 size_t cuStreamQuery(char *_queue) {
-    return cuStreamSynchronize(_queue);
+    return cudaStreamQuery(_queue);
 }
 
 size_t cudaStreamAddCallback(char *_queue, cudacallbacktype callback, void *userdata, int flags) {
     CoclStream *stream = (CoclStream *)_queue;
+    if(stream->capturingGraph != 0) {
+        stream->capturingGraph->invalidated = true;
+        return cudaErrorStreamCaptureUnsupported;
+    }
     CLQueue *queue = stream->clqueue;
     // we need to queue an event, and attach the callback to that;
     cl_int err;
@@ -0,0 +1,289 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/cocl_trace.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <cstdlib>
+
+using namespace std;
+
+#define TRACE_ENV_VAR "COCL_TRACE"
+
+namespace cocl {
+
+namespace {
+
+struct TraceEvent {
+    const char *category;
+    string name;
+    uint64_t startUs;
+    uint64_t durationUs;
+    int pid;  // 0 for host threads, 1 for device queues
+    uint64_t tid;
+};
+
+// one per thread. Only its own thread appends, so the mutex is only ever contended whilst
+// writing out at exit
+struct TraceBuffer {
+    std::mutex mutex;
+    vector<TraceEvent> events;
+    uint64_t tid;
+};
+
+// deliberately never destroyed, so it outlives thread_local buffers, and callbacks from driver threads
+struct TraceState {
+    bool enabled = false;
+    string path;
+    chrono::steady_clock::time_point start;
+    std::mutex mutex;  // guards everything below
+    set<TraceBuffer *> buffers;
+    vector<TraceEvent> retiredEvents;  // from threads which have exited
+    map<cl_command_queue, uint64_t> queueIds;
+    uint64_t nextTid = 1;
+    bool written = false;
+};
+
+void writeTrace();
+
+TraceState &getState() {
+    static TraceState *state = new TraceState();
+    static std::once_flag configured;
+    std::call_once(configured, []() {
+        if(getenv(TRACE_ENV_VAR) != 0 && string(getenv(TRACE_ENV_VAR)) != "") {
+            state->path = getenv(TRACE_ENV_VAR);
+            state->start = chrono::steady_clock::now();
+            state->enabled = true;
+            atexit(writeTrace);
+        }
+    });
+    return *state;
+}
+
+class ThreadTraceBuffer {
+public:
+    ThreadTraceBuffer() {
+        TraceState &state = getState();
+        buffer = new TraceBuffer();
+        std::lock_guard< std::mutex > guard(state.mutex);
+        buffer->tid = state.nextTid++;
+        state.buffers.insert(buffer);
+    }
+    ~ThreadTraceBuffer() {
+        TraceState &state = getState();
+        std::lock_guard< std::mutex > guard(state.mutex);
+        state.buffers.erase(buffer);
+        state.retiredEvents.insert(state.retiredEvents.end(), buffer->events.begin(), buffer->events.end());
+        delete buffer;
+    }
+    TraceBuffer *buffer;
+};
+
+TraceBuffer *getThreadBuffer() {
+    static thread_local ThreadTraceBuffer threadBuffer;
+    return threadBuffer.buffer;
+}
+
+void addEvent(TraceEvent event) {
+    TraceBuffer *buffer = getThreadBuffer();
+    if(event.pid == 0) {
+        event.tid = buffer->tid;
+    }
+    std::lock_guard< std::mutex > guard(buffer->mutex);
+    buffer->events.push_back(std::move(event));
+}
+
+string escapeJson(const string &value) {
+    string escaped;
+    for(size_t i = 0; i < value.size(); i++) {
+        char c = value[i];
+        if(c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if((unsigned char)c < 0x20) {
+            escaped += ' ';
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void writeEvent(ostream &f, const TraceEvent &event, bool *first) {
+    f << (*first ? "\n" : ",\n");
+    *first = false;
+    f << "{\"name\": \"" << escapeJson(event.name) << "\", \"cat\": \"" << event.category
+        << "\", \"ph\": \"X\", \"ts\": " << event.startUs << ", \"dur\": " << event.durationUs
+        << ", \"pid\": " << event.pid << ", \"tid\": " << event.tid << "}";
+}
+
+void writeTrace() {
+    TraceState &state = getState();
+    std::lock_guard< std::mutex > guard(state.mutex);
+    if(state.written) {
+        return;
+    }
+    state.written = true;
+    ofstream f(state.path.c_str());
+    if(!f) {
+        cerr << "COCL_TRACE: couldnt open " << state.path << " for writing" << endl;
+        return;
+    }
+    f << "{\"traceEvents\": [";
+    f << "\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"host\"}}";
+    f << ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"device queues\"}}";
+    bool first = false;
+    for(auto it=state.retiredEvents.begin(); it != state.retiredEvents.end(); it++) {
+        writeEvent(f, *it, &first);
+    }
+    for(auto it=state.buffers.begin(); it != state.buffers.end(); it++) {
+        std::lock_guard< std::mutex > bufferGuard((*it)->mutex);
+        for(auto eventIt=(*it)->events.begin(); eventIt != (*it)->events.end(); eventIt++) {
+            writeEvent(f, *eventIt, &first);
+        }
+    }
+    f << "\n]}\n";
+}
+
+} // namespace
+
+bool isTracingEnabled() {
+    return getState().enabled;
+}
+
+uint64_t traceNowUs() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - getState().start).count();
+}
+
+void traceSpan(const char *category, const string &name, uint64_t startUs, uint64_t endUs) {
+    if(!isTracingEnabled()) {
+        return;
+    }
+    addEvent(TraceEvent { category, name, startUs, endUs - startUs, 0, 0 });
+}
+
+TraceScope::TraceScope(const char *category, const string &name) :
+        enabled(isTracingEnabled()), category(category) {
+    if(enabled) {
+        this->name = name;
+        startUs = traceNowUs();
+    }
+}
+
+TraceScope::TraceScope(const char *category, const char *name) :
+        enabled(isTracingEnabled()), category(category) {
+    if(enabled) {
+        this->name = name;
+        startUs = traceNowUs();
+    }
+}
+
+TraceScope::~TraceScope() {
+    if(enabled) {
+        traceSpan(category, name, startUs, traceNowUs());
+    }
+}
+
+class DeviceTraceSpan::Pending {
+public:
+    const char *category;
+    string name;
+    cl_command_queue queue;
+    uint64_t queuedUs;  // host time at which startMarker was queued
+    cl_event startMarker;
+};
+
+// runs on a driver thread, once the end marker has completed
+static void deviceSpanCallback(cl_event endMarker, cl_int status, void *userdata) {
+    DeviceTraceSpan::Pending *pending = (DeviceTraceSpan::Pending *)userdata;
+    cl_ulong startQueued = 0;
+    cl_ulong startEnd = 0;
+    cl_ulong endEnd = 0;
+    bool ok = status == CL_COMPLETE &&
+        clGetEventProfilingInfo(pending->startMarker, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &startQueued, 0) == CL_SUCCESS &&
+        clGetEventProfilingInfo(pending->startMarker, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &startEnd, 0) == CL_SUCCESS &&
+        clGetEventProfilingInfo(endMarker, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &endEnd, 0) == CL_SUCCESS;
+    if(ok && startEnd >= startQueued && endEnd >= startEnd) {
+        // device timestamps use their own clock, so we line them up with the host clock using
+        // the time the start marker was queued
+        uint64_t tid;
+        {
+            TraceState &state = getState();
+            std::lock_guard< std::mutex > guard(state.mutex);
+            auto it = state.queueIds.find(pending->queue);
+            if(it == state.queueIds.end()) {
+                it = state.queueIds.insert(make_pair(pending->queue, (uint64_t)state.queueIds.size() + 1)).first;
+            }
+            tid = it->second;
+        }
+        uint64_t startUs = pending->queuedUs + (startEnd - startQueued) / 1000;
+        addEvent(TraceEvent { pending->category, pending->name, startUs, (endEnd - startEnd) / 1000, 1, tid });
+    }
+    clReleaseEvent(pending->startMarker);
+    clReleaseEvent(endMarker);
+    delete pending;
+}
+
+DeviceTraceSpan::DeviceTraceSpan(const char *category, const string &name, cl_command_queue queue) {
+    if(isTracingEnabled()) {
+        start(category, name, queue);
+    }
+}
+
+DeviceTraceSpan::DeviceTraceSpan(const char *category, const char *name, cl_command_queue queue) {
+    if(isTracingEnabled()) {
+        start(category, name, queue);
+    }
+}
+
+void DeviceTraceSpan::start(const char *category, const string &name, cl_command_queue queue) {
+    pending = new Pending();
+    pending->category = category;
+    pending->name = name;
+    pending->queue = queue;
+    pending->queuedUs = traceNowUs();
+    if(clEnqueueMarkerWithWaitList(queue, 0, 0, &pending->startMarker) != CL_SUCCESS) {
+        delete pending;
+        pending = 0;
+    }
+}
+
+DeviceTraceSpan::~DeviceTraceSpan() {
+    end();
+}
+
+void DeviceTraceSpan::end() {
+    if(pending == 0) {
+        return;
+    }
+    // tracing shouldnt break the program, so on failure, we just lose this span
+    cl_event endMarker = 0;
+    if(clEnqueueMarkerWithWaitList(pending->queue, 0, 0, &endMarker) != CL_SUCCESS ||
+            clSetEventCallback(endMarker, CL_COMPLETE, deviceSpanCallback, pending) != CL_SUCCESS) {
+        if(endMarker != 0) {
+            clReleaseEvent(endMarker);
+        }
+        clReleaseEvent(pending->startMarker);
+        delete pending;
+    }
+    pending = 0;
+}
+
+} // namespace cocl
@@ -20,6 +20,7 @@
 
 #include <iostream>
 #include <string>
+#include <algorithm>
 
 namespace cocl {
 
@@ -36,28 +37,36 @@ inline int getNumThreads() {
                 // kind of ok
 }
 
-// CL: number of blocks for threads.
-inline int GET_BLOCKS(const int N) {
-  return (N + getNumThreads() - 1) / getNumThreads();
-}
+// the kernel loops, so we dont need more than this many blocks, however big the buffer
+static const int maxBlocks = 1024;
 
 int myEnqueueFillBuffer(
     cl_command_queue queue,
     cl_mem clmem,
-    unsigned int value,
-    int offsetBytes, int countInts) {
+    unsigned char value,
+    size_t offsetBytes, size_t countBytes) {
 
+    if(countBytes == 0) {
+        return 0;
+    }
     easycl::CLKernel *kernel = compileOpenCLKernel("enqueueFillBuffer", get_enqueueFillBuffer_sourcecode());
+    std::lock_guard< std::mutex > guard(getKernelLaunchMutex(kernel));
 
-    kernel->inout(&clmem);
-    kernel->in((int32_t)(offsetBytes >> 2));
+    unsigned int fourbytes = value;
+    fourbytes |= fourbytes << 8;
+    fourbytes |= fourbytes << 16;
 
-    kernel->in((int32_t)countInts);
-    kernel->in(value);
+    kernel->inout(&clmem);
+    kernel->in((int64_t)offsetBytes);
+    kernel->in((int64_t)countBytes);
+    kernel->in(fourbytes);
 
+    // each thread writes 16 bytes at a time, through the loop. We need at least 16 threads, for the
+    // unaligned bytes at each end
+    size_t numVecs = countBytes / 16 + 16;
     int workgroupSize = getNumThreads();
-    int globalSize = GET_BLOCKS(countInts) * workgroupSize;
-    kernel->run_1d(&queue, globalSize, workgroupSize);
+    size_t numBlocks = std::min((numVecs + workgroupSize - 1) / workgroupSize, (size_t)maxBlocks);
+    kernel->run_1d(&queue, numBlocks * workgroupSize, workgroupSize);
     return 0;
 }
 
@@ -66,22 +75,34 @@ int myEnqueueFillBuffer(
 // http://stackoverflow.com/questions/38556710/clenqueuefillbuffer-fills-a-buffer-correctly-only-at-random/43727913#43727913
 std::string get_enqueueFillBuffer_sourcecode() {
     return R"(
-// CL: grid stride looping
-#define CL_KERNEL_LOOP(i, n)                        \
-  for (int i = get_group_id(0) * get_local_size(0) + get_local_id(0); \
-      i < (n);                                       \
-      i += get_local_size(0) * get_num_groups(0))
-
+// fills N bytes, from byte offset offset, with the byte in the low byte of value (which holds
+// four copies of it). The bytes before the first 16-byte aligned address, and after the last
+// one, are written one at a time; everything in between 16 bytes at a time
 kernel void enqueueFillBuffer(
-        global unsigned int *target_data, const int target_offset,
-        const int N,
+        global unsigned char *target_data, const long offset,
+        const long N,
         unsigned int value) {
-    global unsigned int *target = target_data + target_offset;
-  CL_KERNEL_LOOP(n, N) {
-    if(n < N) {
-        target[n] = value;
+    global unsigned char *target = target_data + offset;
+    long head = (16 - (offset & 15)) & 15;
+    if(head > N) {
+        head = N;
+    }
+    long numVecs = (N - head) >> 4;
+    long tailStart = head + (numVecs << 4);
+
+    global uint4 *body = (global uint4 *)(target + head);
+    uint4 value4 = (uint4)(value, value, value, value);
+    for(long i = get_global_id(0); i < numVecs; i += get_global_size(0)) {
+        body[i] = value4;
+    }
+
+    long id = get_global_id(0);
+    if(id < head) {
+        target[id] = (unsigned char)value;
+    }
+    if(tailStart + id < N) {
+        target[tailStart + id] = (unsigned char)value;
     }
-  }
 }
 )";
 }
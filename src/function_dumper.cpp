@@ -21,6 +21,7 @@
 #include "cocl/new_instruction_dumper.h"
 
 #include "llvm/IR/Function.h"
+#include "llvm/IR/CFG.h"
 
 #include <sstream>
 
@@ -202,7 +203,6 @@ std::string FunctionDumper::dumpKernelFunctionDeclarationWithoutReturn(llvm::Fun
             declaration << ", ";
         }
         declaration << "global char* clmem" << clmemIdx;
-        declaration << ", unsigned long clmem_vmem_offset" << clmemIdx;
         i++;
     }
     int clmemArgIndex = 0;
@@ -302,6 +302,9 @@ std::string FunctionDumper::dumpKernelFunctionDeclarationWithoutReturn(llvm::Fun
         declaration << ", ";
     }
     declaration << "local int *scratch";
+    if(usesDynamicShared) {
+        declaration << ", local char *dynamicShared";
+    }
     declaration << ")";
     return declaration.str();
 }
@@ -381,80 +384,247 @@ bool FunctionDumper::runGeneration(const std::map<llvm::Function *, llvm::Type *
         localValueInfo->setExpression(localValueInfo->name);
     }
 
-    size_t numBlocks = 0;
-    for(auto block_it=F->begin(); block_it != F->end(); block_it++) {
-        numBlocks++;
+    size_t numBlocks = functionBlockIndex.size();
+    vector<BasicBlock *> blocks(numBlocks);
+    for(auto it=functionBlockIndex.begin(); it != functionBlockIndex.end(); it++) {
+        blocks[it->second] = it->first;
     }
     set<BasicBlock *> blocksDumped;
 
-    int iteration = 0;
-    while(blocksDumped.size() < numBlocks) {
-        for(auto block_it = F->begin(); block_it != F->end(); block_it++) {
-            BasicBlock *basicBlock = &*block_it;
-            if(blocksDumped.find(basicBlock) != blocksDumped.end()) {
-                // already dumped this block
+    // We dump the blocks in passes over the function, in layout order, as the old retry loop did,
+    // but only visit each block once everything it needs has been generated, rather than trying
+    // every outstanding block on every pass:
+    // - each of its phis has been assigned, by the terminator of some predecessor
+    // - each value it uses from another block has been generated: an instruction once its block
+    //   has been dumped, and a phi once it has been assigned
+    // - the same, for the values its terminator assigns to the phis of its successors
+    // A block whose needs are met behind the position of the current pass waits for the next pass.
+    // So in valid SSA each block is generated exactly once, in the same place as the retry loop
+    // put it, without exceptions, in time linear in the size of the function
+    map<Value *, vector<int> > waitingBlocksByValue;
+    vector<int> numUnmetByBlock(numBlocks, 0);
+    auto addNeed = [&](int blockIndex, set<Value *> &needs, Value *value) {
+        Instruction *inst = dyn_cast<Instruction>(value);
+        if(inst == 0 || (inst->getParent() == blocks[blockIndex] && !isa<PHINode>(inst))) {
+            return;
+        }
+        if(needs.insert(value).second) {
+            waitingBlocksByValue[value].push_back(blockIndex);
+            numUnmetByBlock[blockIndex]++;
+        }
+    };
+    for(size_t i = 0; i < numBlocks; i++) {
+        BasicBlock *basicBlock = blocks[i];
+        set<Value *> needs;
+        for(auto inst_it=basicBlock->begin(); inst_it != basicBlock->end(); inst_it++) {
+            Instruction *inst = &*inst_it;
+            if(isa<PHINode>(inst)) {
+                addNeed(i, needs, inst);
                 continue;
             }
-            string label = localNames.getOrCreateName(basicBlock);
-
-            // check whether we have the address space for the phis yet
-            bool phisOutstanding = false;
-            for(auto phi_it=basicBlock->begin(); phi_it != basicBlock->end(); phi_it++) {
-                Instruction *inst = &*phi_it;
-                if(!isa<PHINode>(inst)) {
-                    break;
-                }
-                PHINode *phi = cast<PHINode>(inst);
-                if(localValueInfos.find(phi) == localValueInfos.end()) {
-                    phisOutstanding = true;
+            for(auto op_it=inst->op_begin(); op_it != inst->op_end(); op_it++) {
+                addNeed(i, needs, op_it->get());
+            }
+        }
+        for(auto succ_it=succ_begin(basicBlock); succ_it != succ_end(basicBlock); succ_it++) {
+            for(auto phi_it=succ_it->begin(); phi_it != succ_it->end(); phi_it++) {
+                PHINode *phi = dyn_cast<PHINode>(&*phi_it);
+                if(phi == 0) {
                     break;
                 }
+                addNeed(i, needs, phi->getIncomingValueForBlock(basicBlock));
             }
-            if(phisOutstanding) {
-                continue;
-            }
+        }
+    }
 
-            BasicBlockDumper basicBlockDumper(
-                M, basicBlock, globalNames, &localNames, typeDumper, functionNamesMap,
-                &globalExpressionByValue, &localValueInfos);
-            if(_addIRToCl) {
-                basicBlockDumper.addIRToCl();
-            }
-            bool finished = false;
-            try {
-                finished = basicBlockDumper.runGeneration(returnTypeByFunction);
-            } catch(NeedValueDependencyException &e) {
-                continue;
+    set<pair<int, int> > readyBlocks;  // (pass, block index)
+    map<BasicBlock *, pair<int, int> > readyKeyByBlock;
+    auto markReady = [&](BasicBlock *block, int pass, int index) {
+        if(blocksDumped.find(block) != blocksDumped.end()) {
+            return;
+        }
+        int blockIndex = functionBlockIndex.at(block);
+        pair<int, int> key(blockIndex > index ? pass : pass + 1, blockIndex);
+        auto readyIt = readyKeyByBlock.find(block);
+        if(readyIt != readyKeyByBlock.end()) {
+            if(readyIt->second <= key) {
+                return;
             }
-            if(!finished) {
-                neededFunctions.insert(basicBlockDumper.neededFunctions.begin(), basicBlockDumper.neededFunctions.end());
-                return false;
+            readyBlocks.erase(readyIt->second);
+        }
+        readyKeyByBlock[block] = key;
+        readyBlocks.insert(key);
+    };
+    set<Value *> generatedValues;
+    auto markGenerated = [&](Value *value, int pass, int index) {
+        if(!generatedValues.insert(value).second) {
+            return;
+        }
+        auto waitingIt = waitingBlocksByValue.find(value);
+        if(waitingIt == waitingBlocksByValue.end()) {
+            return;
+        }
+        for(auto it=waitingIt->second.begin(); it != waitingIt->second.end(); it++) {
+            if(--numUnmetByBlock[*it] == 0) {
+                markReady(blocks[*it], pass, index);
             }
+        }
+    };
+    for(size_t i = 0; i < numBlocks; i++) {
+        if(numUnmetByBlock[i] == 0) {
+            markReady(blocks[i], 0, -1);
+        }
+    }
 
-            ostringstream blockstream;
-            blockstream << label << ":;\n";
-            basicBlockDumper.toCl(blockstream);
+    // tries to dump basicBlock, returning 1 if it was dumped, 0 if it isnt ready yet, and -1 if
+    // it needs functions we havent generated yet
+    auto tryDumpBlock = [&](BasicBlock *basicBlock) -> int {
+        string label = localNames.getOrCreateName(basicBlock);
+
+        // check whether we have the address space for the phis yet
+        for(auto phi_it=basicBlock->begin(); phi_it != basicBlock->end(); phi_it++) {
+            Instruction *inst = &*phi_it;
+            if(!isa<PHINode>(inst)) {
+                break;
+            }
+            PHINode *phi = cast<PHINode>(inst);
+            if(localValueInfos.find(phi) == localValueInfos.end()) {
+                return 0;
+            }
+        }
 
-            // shimFunctionsNeeded.insert(basicBlockDumper.shimFunctionsNeeded.begin(), basicBlockDumper.shimFunctionsNeeded.end());
-            shims.copyFrom(basicBlockDumper.shims);
+        BasicBlockDumper basicBlockDumper(
+            M, basicBlock, globalNames, &localNames, typeDumper, functionNamesMap,
+            &globalExpressionByValue, &localValueInfos);
+        if(_addIRToCl) {
+            basicBlockDumper.addIRToCl();
+        }
+        bool finished = false;
+        try {
+            finished = basicBlockDumper.runGeneration(returnTypeByFunction);
+        } catch(NeedValueDependencyException &e) {
+            return 0;
+        }
+        if(!finished) {
             neededFunctions.insert(basicBlockDumper.neededFunctions.begin(), basicBlockDumper.neededFunctions.end());
-            if(basicBlockDumper.usesVmem) {
-                this->usesVmem = true;
+            return -1;
+        }
+
+        ostringstream blockstream;
+        blockstream << label << ":;\n";
+        basicBlockDumper.toCl(blockstream);
+
+        // shimFunctionsNeeded.insert(basicBlockDumper.shimFunctionsNeeded.begin(), basicBlockDumper.shimFunctionsNeeded.end());
+        shims.copyFrom(basicBlockDumper.shims);
+        neededFunctions.insert(basicBlockDumper.neededFunctions.begin(), basicBlockDumper.neededFunctions.end());
+        if(basicBlockDumper.usesVmem) {
+            this->usesVmem = true;
+        }
+        if(basicBlockDumper.usesScratch) {
+            this->usesScratch = true;
+        }
+
+        try {
+            blockstream << dumpTerminator(&returnType, basicBlock->getTerminator());
+        } catch(NeedValueDependencyException &e) {
+            return 0;
+        }
+
+        ouros << blockstream.str();
+        blocksDumped.insert(basicBlock);
+        return 1;
+    };
+    // the values a dumped block makes available to the blocks after it
+    auto markBlockGenerated = [&](BasicBlock *basicBlock, int pass, int index) {
+        for(auto inst_it=basicBlock->begin(); inst_it != basicBlock->end(); inst_it++) {
+            if(!isa<PHINode>(&*inst_it)) {
+                markGenerated(&*inst_it, pass, index);
             }
-            if(basicBlockDumper.usesScratch) {
-                this->usesScratch = true;
+        }
+        for(auto succ_it=succ_begin(basicBlock); succ_it != succ_end(basicBlock); succ_it++) {
+            for(auto phi_it=succ_it->begin(); phi_it != succ_it->end(); phi_it++) {
+                PHINode *phi = dyn_cast<PHINode>(&*phi_it);
+                if(phi == 0) {
+                    break;
+                }
+                if(localValueInfos.find(phi) != localValueInfos.end()) {
+                    markGenerated(phi, pass, index);
+                }
             }
+        }
+    };
+
+    // blocks which needed a value we hadnt generated yet. Shouldnt happen, given the needs above,
+    // but if it does, we try them again after the next block has been dumped, as the old loop would
+    vector<BasicBlock *> stalledBlocks;
+    while(!readyBlocks.empty()) {
+        pair<int, int> key = *readyBlocks.begin();
+        readyBlocks.erase(readyBlocks.begin());
+        BasicBlock *basicBlock = blocks[key.second];
+        readyKeyByBlock.erase(basicBlock);
+
+        int res = tryDumpBlock(basicBlock);
+        if(res == -1) {
+            return false;
+        }
+        if(res == 0) {
+            stalledBlocks.push_back(basicBlock);
+            continue;
+        }
+        markBlockGenerated(basicBlock, key.first, key.second);
+        for(auto it=stalledBlocks.begin(); it != stalledBlocks.end(); it++) {
+            markReady(*it, key.first, key.second);
+        }
+        stalledBlocks.clear();
+    }
 
-            try {
-                blockstream << dumpTerminator(&returnType, basicBlock->getTerminator());
-            } catch(NeedValueDependencyException &e) {
+    if(blocksDumped.size() < numBlocks) {
+        // some blocks need a value which, by the rules above, is never generated, eg those of a
+        // loop with no way in. Fall back on the old retry loop for these, until it makes no progress
+        bool progress = true;
+        while(progress && blocksDumped.size() < numBlocks) {
+            progress = false;
+            for(size_t i = 0; i < numBlocks; i++) {
+                if(blocksDumped.find(blocks[i]) != blocksDumped.end()) {
+                    continue;
+                }
+                int res = tryDumpBlock(blocks[i]);
+                if(res == -1) {
+                    return false;
+                }
+                if(res == 1) {
+                    progress = true;
+                }
+            }
+        }
+    }
+    if(blocksDumped.size() < numBlocks) {
+        // whatever is left can only be dumped if it never runs. We keep the labels, since blocks
+        // we have dumped might still jump to them
+        set<BasicBlock *> reachable;
+        vector<BasicBlock *> toVisit(1, blocks[0]);
+        while(!toVisit.empty()) {
+            BasicBlock *basicBlock = toVisit.back();
+            toVisit.pop_back();
+            if(!reachable.insert(basicBlock).second) {
                 continue;
             }
-
-            ouros << blockstream.str();
+            for(auto succ_it=succ_begin(basicBlock); succ_it != succ_end(basicBlock); succ_it++) {
+                toVisit.push_back(*succ_it);
+            }
+        }
+        for(size_t i = 0; i < numBlocks; i++) {
+            BasicBlock *basicBlock = blocks[i];
+            if(blocksDumped.find(basicBlock) != blocksDumped.end()) {
+                continue;
+            }
+            if(reachable.find(basicBlock) != reachable.end()) {
+                throw runtime_error("couldnt generate all blocks of function " + F->getName().str() +
+                    ": some depend on values which are never generated");
+            }
+            ouros << localNames.getOrCreateName(basicBlock) << ":;\n";
             blocksDumped.insert(basicBlock);
         }
-        iteration++;
     }
 
     _generationDone = true;
@@ -499,11 +669,26 @@ void FunctionDumper::toCl(ostream &os) {
         os << shimCode << "\n";
     }
     if(isKernel) {
-    os << R"(    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+        // the segment table is copied into each work-item's private memory, 8 bytes per segment.
+        // Kernels which dont use vmem only get one segment
+        os << "    const struct GlobalVars globalVars = { scratch, {";
+        for(int i = 0; i < vmemSegmentCount; i++) {
+            os << (i == 0 ? " " : ", ");
+            if(i < kernelNumUniqueClmems) {
+                os << "clmem" << i;
+            } else {
+                os << "0";
+            }
+        }
+        os << " }";
+        if(usesDynamicShared) {
+            os << ", dynamicShared";
+        }
+        os << R"( };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
 )";
-}
+    }
 
     writeDeclarations("    ", os);
     os << "\n";
@@ -25,6 +25,7 @@
 #include <map>
 #include <set>
 #include <cstdlib>
+#include <cstring>
 #include <mutex>
 
 #include "EasyCL/EasyCL.h"
@@ -37,6 +38,10 @@
 #include "cocl/ir-to-opencl-common.h"
 
 #include "cocl/DebugDumper.h"
+#include "cocl/cocl_program_cache.h"
+#include "cocl/cocl_devicell.h"
+#include "cocl/cocl_trace.h"
+#include "cocl/cocl_graphs.h"
 
 using namespace std;
 using namespace easycl;
@@ -62,24 +67,13 @@ void hostside_opencl_funcs_assure_initialized(void) {
 
 }
 
-namespace cocl {
-    // this lock works as follows:
-    // - configureKernel takes out a lock, and does not release it. This first level of locking will remain locked, until
-    //   the kernelGo funcgtion is called, and completed
-    // - then, each setArg etc method takes out an additional level of locking, in case they are called in parallel
-    //   (this second level might not be stricly necessary, I'm not sure...)
-    //   this second level is per-call, released at hte end
-    // - finally, kernelGo is called, takes out a second-level lock, then at the end releases both levels
-    //
-    // I suppose we could do this with two standard locks, rather than one recursive one. Might be easier to udnerstand/read
-    // in fact
-    std::recursive_mutex launchMutex;
-}
-
 using namespace cocl;
 
-static LaunchConfiguration launchConfiguration;
-static DebugDumper debugDumper(&launchConfiguration);
+// the launch being built up, between cudaConfigureCall and kernelGo, is per-thread, so
+// threads can configure and enqueue launches in parallel, without any global lock.  Shared
+// state, ie the kernel and sourcecode caches, lives in the Context, under its own locks
+static thread_local LaunchConfiguration launchConfiguration;
+static thread_local DebugDumper debugDumper(&launchConfiguration);
 
 std::unique_ptr< ArgStore_base > g_arg;
 
@@ -90,18 +84,16 @@ size_t cuInit(unsigned int flags) {
 int cudaConfigureCall(
         dim3 grid,
         dim3 block, long long sharedMem, char *queue_as_voidstar) {
-    // pthread_mutex_lock(&launchMutex);
-    // std::lock_guard< std::recursive_mutex > guard(launchMutex);
-    launchMutex.lock();
     CoclStream *coclStream = (CoclStream *)queue_as_voidstar;
     ThreadVars *v = getThreadVars();
     if(coclStream == 0) {
         coclStream = v->currentContext->default_stream.get();
     }
     CLQueue *clqueue = coclStream->clqueue;
-    if(sharedMem != 0) {
-        COCL_PRINT("cudaConfigureCall: Not implemented: non-zero shared memory");
-        throw runtime_error("cudaConfigureCall: Not implemented: non-zero shared memory");
+    size_t localMemSize = v->getContext()->localMemSize;
+    if(sharedMem < 0 || (size_t)sharedMem > localMemSize) {
+        throw runtime_error("cudaConfigureCall: sharedMem of " + easycl::toString(sharedMem) +
+            " bytes is more than the device's local memory, of " + easycl::toString(localMemSize) + " bytes");
     }
     int grid_x = grid.x;
     int grid_y = grid.y;
@@ -114,6 +106,7 @@ int cudaConfigureCall(
 
     launchConfiguration.queue = clqueue;
     launchConfiguration.coclStream = coclStream;
+    launchConfiguration.sharedMem = (size_t)sharedMem;
     launchConfiguration.grid[0] = grid_x;
     launchConfiguration.grid[1] = grid_y;
     launchConfiguration.grid[2] = grid_z;
@@ -125,15 +118,17 @@ int cudaConfigureCall(
 
 namespace cocl {
 
-std::string Int32Arg::str() {
-    ostringstream oss;
-    oss << "Int32Arg=" << v;
-    return oss.str();
-}
-
-std::string Int64Arg::str() {
+std::string Arg::str() const {
     ostringstream oss;
-    oss << "Int64Arg=" << v;
+    switch(kind) {
+        case AK_Int8Arg: oss << "Int8Arg=" << (int)v.i8; break;
+        case AK_Int32Arg: oss << "Int32Arg=" << v.i32; break;
+        case AK_UInt32Arg: oss << "UInt32Arg=" << v.u32; break;
+        case AK_Int64Arg: oss << "Int64Arg=" << v.i64; break;
+        case AK_FloatArg: oss << "FloatArg=" << v.f; break;
+        case AK_NullPtrArg: oss << "NullPtrArg"; break;
+        case AK_ClmemArg: oss << "ClmemArg=" << (void *)v.clmem; break;
+    }
     return oss.str();
 }
 
@@ -145,6 +140,57 @@ int32_t getNumKernelCalls() {
     return getThreadVars()->getContext()->numKernelCalls;
 }
 
+KernelLaunchState *getKernelLaunchState(CLKernel *kernel) {
+    Context *context = getThreadVars()->getContext();
+    std::lock_guard< std::mutex > guard(context->kernelCacheMutex);
+    return context->kernelLaunchStates[kernel].get();
+}
+
+std::mutex &getKernelLaunchMutex(CLKernel *kernel) {
+    return getKernelLaunchState(kernel)->mutex;
+}
+
+static CLKernel *buildKernel(EasyCL *cl, string clSourcecode, string kernelName, string options, cl_kernel *pClkernel) {
+    // builds the program ourselves, rather than via cl->buildKernelFromString, so we can
+    // use, and populate, the on-disk program binary cache
+    cl_int err;
+    string buildLog = "";
+    cl_program program = loadCachedProgram(cl, clSourcecode, options);
+    if(program == 0) {
+        const char *source = clSourcecode.c_str();
+        size_t sourceSize = clSourcecode.size();
+        program = clCreateProgramWithSource(*cl->context, 1, &source, &sourceSize, &err);
+        EasyCL::checkError(err);
+        cl_int buildErr;
+        {
+            TraceScope traceScope("build", kernelName);
+            buildErr = clBuildProgram(program, 1, &cl->device, options.c_str(), 0, 0);
+        }
+
+        size_t logSize = 0;
+        err = clGetProgramBuildInfo(program, cl->device, CL_PROGRAM_BUILD_LOG, 0, 0, &logSize);
+        if(err == CL_SUCCESS && logSize > 1) {
+            std::vector<char> log(logSize + 1, 0);
+            clGetProgramBuildInfo(program, cl->device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], 0);
+            buildLog = &log[0];
+        }
+        if(buildErr != CL_SUCCESS) {
+            clReleaseProgram(program);
+            throw runtime_error("Failed to build opencl program " + kernelName + ": error " + easycl::toString(buildErr) + "\n" + buildLog);
+        }
+        storeCachedProgram(cl, program, clSourcecode, options);
+    }
+    cl_kernel clkernel = clCreateKernel(program, kernelName.c_str(), &err);
+    if(err != CL_SUCCESS) {
+        clReleaseProgram(program);
+        EasyCL::checkError(err);
+    }
+    CLKernel *kernel = new CLKernel(cl, "__internal__", kernelName, clSourcecode, program, clkernel);
+    kernel->buildLog = buildLog;
+    *pClkernel = clkernel;
+    return kernel;
+}
+
 CLKernel *compileOpenCLKernel(string originalKernelName, string clSourcecode) {
     return compileOpenCLKernel(originalKernelName, originalKernelName, originalKernelName, clSourcecode);
 }
@@ -158,11 +204,12 @@ CLKernel *compileOpenCLKernel(string originalKernelName, string uniqueKernelName
     EasyCL *cl = v->getContext()->getCl();
     ofstream f;
     v->getContext()->numKernelCalls++;
+    std::lock_guard< std::mutex > guard(v->getContext()->kernelCacheMutex);
     if(v->getContext()->kernelCache.find(uniqueKernelName) != v->getContext()->kernelCache.end()) {
         return v->getContext()->kernelCache[uniqueKernelName];
     }
-    // compile the kernel.  we are still locking the mutex, but I cnat think of a better
-    // way right now...
+    // compile the kernel.  we hold the kernel cache lock whilst doing so, since EasyCL isnt
+    // threadsafe, and so that two threads dont both build the same kernel
 
     string filename = "/tmp/" + easycl::toString(v->getContext()->kernelCache.size()) + ".cl";
     if(getenv("COCL_LOAD_CL") != 0) {
@@ -184,8 +231,9 @@ CLKernel *compileOpenCLKernel(string originalKernelName, string uniqueKernelName
     }
 
     CLKernel *kernel = 0;
+    cl_kernel clkernel = 0;
     try {
-        kernel = cl->buildKernelFromString(clSourcecode, shortKernelName, "", "__internal__", true);
+        kernel = buildKernel(cl, clSourcecode, shortKernelName, "", &clkernel);
         if(getenv("COCL_DUMP_BUILD_LOGS") != 0) {
             if(kernel->buildLog != "") {
                 std::cout << kernel->buildLog << std::endl;
@@ -205,63 +253,98 @@ CLKernel *compileOpenCLKernel(string originalKernelName, string uniqueKernelName
         throw e;
     }
     v->getContext()->kernelCache[uniqueKernelName] = kernel;
+    std::unique_ptr<KernelLaunchState> &launchState = v->getContext()->kernelLaunchStates[kernel];
+    launchState.reset(new KernelLaunchState());
+    launchState->clkernel = clkernel;
     cl->storeKernel(uniqueKernelName, kernel, true);  // this will cause the kernel to be deleted with cl.  Not clean yet, but a start
     return kernel;
 }
 
 GenerateOpenCLResult generateOpenCL(
-        int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, string origKernelName, string devicellsourcecode) {
+        int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, string origKernelName, const char *devicellcode,
+        const char *deviceclcode, int vmemSegmentCount) {
     // generates OpenCL source-code, based on passed-in bytecode
     // returns cached source-code if available
+    // devicellcode is either textual IR, or encoded bitcode, depending on how the host was compiled
+    // deviceclcode is the table of OpenCL generated at build time, by `cocl --devicecl-aot`, or 0
 
     ThreadVars *v = getThreadVars();
 
     ofstream f;
-    launchConfiguration.shortKernelName = origKernelName.substr(0, 20);
+    launchConfiguration.shortKernelName = getShortKernelName(origKernelName);
 
     std::ostringstream uniqueKernelName_ss;
     uniqueKernelName_ss << origKernelName;
     for(int i = 0; i < clmemIndexByClmemArgIndex.size(); i++) {
         uniqueKernelName_ss << "_" << clmemIndexByClmemArgIndex[i];
     }
+    if(vmemSegmentCount > 1) {
+        uniqueKernelName_ss << "_v" << vmemSegmentCount;
+    }
     launchConfiguration.uniqueKernelName = uniqueKernelName_ss.str();
-    if(v->getContext()->clSourceCodeCache.find(launchConfiguration.uniqueKernelName) != v->getContext()->clSourceCodeCache.end()) {
-        std::string clSourcecode = v->getContext()->clSourceCodeCache[launchConfiguration.uniqueKernelName];
-        return GenerateOpenCLResult { clSourcecode, origKernelName, launchConfiguration.shortKernelName, launchConfiguration.uniqueKernelName };
+    {
+        std::lock_guard< std::mutex > guard(v->getContext()->clSourceCodeCacheMutex);
+        if(v->getContext()->clSourceCodeCache.find(launchConfiguration.uniqueKernelName) != v->getContext()->clSourceCodeCache.end()) {
+            std::string clSourcecode = v->getContext()->clSourceCodeCache[launchConfiguration.uniqueKernelName];
+            return GenerateOpenCLResult { clSourcecode, origKernelName, launchConfiguration.shortKernelName, launchConfiguration.uniqueKernelName };
+        }
     }
 
+    // we dont hold the lock during generation, so two threads might occasionally generate the same kernel
+    // at the same time. Generation is deterministic, so whichever one inserts into the cache first is fine
+
+    TraceScope traceScope("generate", origKernelName);
+
     // convert to opencl first... based on the kernel name required
+    string devicellsuffix = isEncodedDeviceBitcode(devicellcode) ? ".bc" : ".ll";
     try {
-        string filename = "/tmp/" + easycl::toString(v->getContext()->clSourceCodeCache.size()) + "-device.ll";
-        if(getenv("COCL_DUMP_BYTECODE") != 0) {
-            cout << "saving deviceside bytecode to " << filename << endl;
-            ofstream f;
-            f.open(filename, ios_base::out);
-            f << devicellsourcecode << endl;
-            f.close();
+        ModuleClRes res;
+        if(findPrecompiledCl(deviceclcode, origKernelName, uniqueClmemCount, clmemIndexByClmemArgIndex, v->offsets_32bit, vmemSegmentCount, &res)) {
+            COCL_PRINT("using opencl generated at build time for " << origKernelName);
+        } else {
+            // convertDeviceCodeToCl decodes, ie decompresses, each module just once. We only decode
+            // here again for debugging
+            if(getenv("COCL_DUMP_BYTECODE") != 0) {
+                string devicellsourcecode = decodeDeviceCode(devicellcode);
+                std::unique_lock< std::mutex > lock(v->getContext()->clSourceCodeCacheMutex);
+                string filename = "/tmp/" + easycl::toString(v->getContext()->clSourceCodeCache.size()) + "-device" + devicellsuffix;
+                lock.unlock();
+                cout << "saving deviceside bytecode to " << filename << endl;
+                ofstream f;
+                f.open(filename, ios_base::out | ios_base::binary);
+                f << devicellsourcecode;
+                f.close();
+            }
+            res = convertDeviceCodeToCl(
+                uniqueClmemCount, clmemIndexByClmemArgIndex, devicellcode, origKernelName, launchConfiguration.shortKernelName, v->offsets_32bit,
+                vmemSegmentCount);
         }
-        ModuleClRes res = convertLlStringToCl(
-            uniqueClmemCount, clmemIndexByClmemArgIndex, devicellsourcecode, origKernelName, launchConfiguration.shortKernelName, v->offsets_32bit);
         std::string clSourcecode = res.clSourcecode;
         KernelInfo kernelInfo;
         kernelInfo.usesVmem = res.usesVmem;
         kernelInfo.usesScratch = res.usesScratch;
+        kernelInfo.usesDynamicShared = res.usesDynamicShared;
         clSourcecode = "// origKernelName: " + origKernelName + "\n" +
             "// uniqueKernelName: " + launchConfiguration.uniqueKernelName + "\n" +
             "// shortKernelName: " + launchConfiguration.shortKernelName + "\n" +
             "\n" +
             clSourcecode;
-        v->getContext()->clSourceCodeCache[launchConfiguration.uniqueKernelName] = clSourcecode;
-        v->getContext()->kernelInfoByUniqueName[launchConfiguration.uniqueKernelName] = kernelInfo;
+        std::lock_guard< std::mutex > guard(v->getContext()->clSourceCodeCacheMutex);
+        v->getContext()->clSourceCodeCache.insert(std::make_pair(launchConfiguration.uniqueKernelName, clSourcecode));
+        v->getContext()->kernelInfoByUniqueName.insert(std::make_pair(launchConfiguration.uniqueKernelName, kernelInfo));
         return GenerateOpenCLResult { clSourcecode, origKernelName, launchConfiguration.shortKernelName, launchConfiguration.uniqueKernelName };
     } catch(runtime_error &e) {
         cout << "generateOpenCL failed to generate opencl sourcecode" << endl;
         cout << "kernel name orig=" << origKernelName << endl;
         cout << "kernel name short=" << launchConfiguration.shortKernelName << endl;
         cout << "kernel name unique=" << launchConfiguration.uniqueKernelName << endl;
-        cout << "writing ll to /tmp/failed-kernel.ll" << endl;
-        f.open("/tmp/failed-kernel.ll", ios_base::out);
-        f << devicellsourcecode << endl;
+        cout << "writing ll to /tmp/failed-kernel" << devicellsuffix << endl;
+        f.open("/tmp/failed-kernel" + devicellsuffix, ios_base::out | ios_base::binary);
+        try {
+            f << decodeDeviceCode(devicellcode);
+        } catch(runtime_error &decodeError) {
+            // eg the device code itself is corrupt. The original error is more useful
+        }
         f.close();
         throw e;
     }
@@ -269,42 +352,104 @@ GenerateOpenCLResult generateOpenCL(
 
 } // namespace cocl
 
-void configureKernel(const char *kernelName, const char *devicellsourcecode) {
-    // pthread_mutex_lock(&launchMutex);
-    // launchMutex.lock();
-    std::lock_guard< std::recursive_mutex > guard(launchMutex);
+static KernelSite *getKernelSite(Context *context, const char *kernelName, const char *devicellcode) {
+    std::lock_guard< std::mutex > guard(context->kernelSitesMutex);
+    std::unique_ptr<KernelSite> &site = context->kernelSites[std::make_pair(kernelName, devicellcode)];
+    if(!site) {
+        site.reset(new KernelSite());
+    }
+    return site.get();
+}
+
+void configureKernel(const char *kernelName, const char *devicellcode) {
+    configureKernelWithCl(kernelName, devicellcode, 0);
+}
+
+static void clearLaunch() {
+    launchConfiguration.stagedStructs.clear();
+    launchConfiguration.stagedStructArgIndexes.clear();
+    launchConfiguration.args.clear();
+    launchConfiguration.clmems.clear();
+    launchConfiguration.clmemIndexByClmemArgIndex.clear();
+}
+
+// for a launch which wont go any further, eg because setting it up threw. OpenCL keeps released
+// buffers alive until any commands already queued with them have finished, so the struct buffers
+// can go straight away
+static void abandonLaunch() {
+    for(auto it=launchConfiguration.kernelArgsToBeReleased.begin(); it != launchConfiguration.kernelArgsToBeReleased.end(); it++) {
+        clReleaseMemObject(*it);
+    }
+    launchConfiguration.kernelArgsToBeReleased.clear();
+    clearLaunch();
+}
+
+// the clmems before firstArgClmemIndex. GlobalVars points at these, and getGlobalPointer finds
+// the buffers of pointers the kernel loads from device memory, eg from a float **, in them.
+// Kernels which use vmem get the buffer of every vmem segment, in order, with 0 for free
+// segments, and padded to a power of two, so that allocating and freeing doesnt mean building a
+// new kernel each time. Other kernels never look at them, so they just get any one buffer
+static void addLeadingClmems(Context *context, bool usesVmem) {
+    launchConfiguration.vmemLayout = usesVmem;
+    // other threads might be allocating, or freeing, at the same time
+    ContextMutex contextMutex(context);
+    if(usesVmem) {
+        size_t segmentCount = 1;
+        while(segmentCount < context->vmemSegments.size()) {
+            segmentCount <<= 1;
+        }
+        for(size_t i = 0; i < segmentCount; i++) {
+            Memory *memory = i < context->vmemSegments.size() ? context->vmemSegments[i] : 0;
+            launchConfiguration.clmems.push_back(memory != 0 ? memory->clmem : 0);
+        }
+    } else if(context->memories.size() > 0) {
+        launchConfiguration.clmems.push_back((*context->memories.begin())->clmem);
+    }
+    launchConfiguration.firstArgClmemIndex = launchConfiguration.clmems.size();
+}
+
+// for the first launch from a site, which we only found out uses vmem once we generated the
+// kernel: swaps the leading clmems for the vmem segments, keeping the args' clmems after them
+static void useVmemLayout(Context *context) {
+    std::vector<cl_mem> argClmems(launchConfiguration.clmems.begin() + launchConfiguration.firstArgClmemIndex,
+        launchConfiguration.clmems.end());
+    int oldFirstArgClmemIndex = (int)launchConfiguration.firstArgClmemIndex;
+    launchConfiguration.clmems.clear();
+    addLeadingClmems(context, true);
+    launchConfiguration.clmems.insert(launchConfiguration.clmems.end(), argClmems.begin(), argClmems.end());
+    int shift = (int)launchConfiguration.firstArgClmemIndex - oldFirstArgClmemIndex;
+    for(auto it=launchConfiguration.clmemIndexByClmemArgIndex.begin(); it != launchConfiguration.clmemIndexByClmemArgIndex.end(); it++) {
+        *it += shift;
+    }
+}
+
+void configureKernelWithCl(const char *kernelName, const char *devicellcode, const char *deviceclcode) {
     COCL_PRINT("=========================================");
     launchConfiguration.kernelName = kernelName;
-    launchConfiguration.devicellsourcecode = devicellsourcecode;
+    launchConfiguration.devicellcode = devicellcode;
+    launchConfiguration.deviceclcode = deviceclcode;
+    launchConfiguration.kernelSite = getKernelSite(getThreadVars()->getContext(), kernelName, devicellcode);
+    // in case setting up the last launch on this thread threw, before it got to kernelGo
+    abandonLaunch();
 
-    // in order to handle by-value structs containing pointers to gpu structs, we're first going
-    // to add the first Memory object to the clmems, so it is available to the kernel, for
-    // dereferencing vmemlocs
-    // we are going to assume the first memory is at vmemloc=128 :-). very hacky :-DDD
-    // Memory *firstMem = findMemory((const char *)128);
+    addLeadingClmems(getThreadVars()->getContext(), launchConfiguration.kernelSite->usesVmem);
+}
 
-    // we're simply going to assume there is a single memory allocated and take that
-    // we'll verify this assumption before launhc, if we are in fact using vmem
-    ThreadVars *v = getThreadVars();
-    Memory *firstMem = *v->getContext()->memories.begin();
-    // std::cout << "setKernelArgHostsideBuffer firstMem=" << firstMem << std::endl;
-    // if its not zero, then pass it into kernel
-    if(firstMem != 0) {
-        launchConfiguration.clmems.push_back(firstMem->clmem);
-        // addClmemArg(firstMem->clmem);
+static int findArgClmemIndex(cl_mem clmem) {
+    // kernels have a handful of buffers, so a linear scan beats a map, and doesnt allocate
+    for(size_t i = launchConfiguration.firstArgClmemIndex; i < launchConfiguration.clmems.size(); i++) {
+        if(launchConfiguration.clmems[i] == clmem) {
+            return (int)i;
+        }
     }
-
-    // pthread_mutex_unlock(&launchMutex);
+    return -1;
 }
 
 void addClmemArg(cl_mem clmem) {
-    int clmemIndex = 0;
-    if(launchConfiguration.clmemIndexByClmem.find(clmem) == launchConfiguration.clmemIndexByClmem.end()) {
+    int clmemIndex = findArgClmemIndex(clmem);
+    if(clmemIndex == -1) {
         clmemIndex = launchConfiguration.clmems.size();
         launchConfiguration.clmems.push_back(clmem);
-        launchConfiguration.clmemIndexByClmem[clmem] = clmemIndex;
-    } else {
-        clmemIndex = launchConfiguration.clmemIndexByClmem.find(clmem)->second;
     }
     launchConfiguration.clmemIndexByClmemArgIndex.push_back(clmemIndex);
 }
@@ -328,10 +473,28 @@ void setKernelArgHostsideBuffer(char *pCpuStruct, int structAllocateSize) {
     // - we wont add the clmem to the virtualmem table, so we wont delegate
     //   anything to the setKernelArgGpuBuffer method (which expects an incoming
     //   pointer to be a virtual pointer, not a cl_mem)
+    //
+    // Normally, rather than a buffer per struct, we copy the struct into launchConfiguration.stagedStructs,
+    // and kernelGo uploads all the structs for the launch in one go, into the stream's staging ring.
+    // The offset arg is relative to the start of stagedStructs, until then
 
-    std::lock_guard< std::recursive_mutex > guard(launchMutex);
-    // pthread_mutex_lock(&launchMutex);
     ThreadVars *v = getThreadVars();
+    StagingRing *stagingRing = launchConfiguration.coclStream->getStagingRing();
+    if(stagingRing != 0) {
+        COCL_PRINT("setKernelArgHostsideBuffer staged size=" << structAllocateSize);
+        size_t offset = launchConfiguration.stagedStructs.size();
+        launchConfiguration.stagedStructs.resize(offset + (structAllocateSize + 127) / 128 * 128);
+        memcpy(&launchConfiguration.stagedStructs[offset], pCpuStruct, structAllocateSize);
+        addClmemArg(stagingRing->clmem);
+        launchConfiguration.stagedStructArgIndexes.push_back(launchConfiguration.args.size());
+        if(v->offsets_32bit) {
+           launchConfiguration.args.push_back(Arg::uint32((uint32_t)offset));
+        } else {
+           launchConfiguration.args.push_back(Arg::int64((int64_t)offset));
+        }
+        return;
+    }
+
     EasyCL *cl = v->getContext()->getCl();
     cl_context *ctx = cl->context;
     // we're going to:
@@ -359,12 +522,10 @@ void setKernelArgHostsideBuffer(char *pCpuStruct, int structAllocateSize) {
 
     int offsetElements = 0;
     if(v->offsets_32bit) {
-       launchConfiguration.args.push_back(std::unique_ptr<Arg>(new UInt32Arg((uint32_t)offsetElements)));
+       launchConfiguration.args.push_back(Arg::uint32((uint32_t)offsetElements));
     } else {
-       launchConfiguration.args.push_back(std::unique_ptr<Arg>(new Int64Arg((int64_t)offsetElements)));
+       launchConfiguration.args.push_back(Arg::int64((int64_t)offsetElements));
     }
-
-    // pthread_mutex_unlock(&launchMutex);
 }
 
 void setKernelArgGpuBuffer(char *memory_as_charstar, int32_t elementSize) {
@@ -375,8 +536,6 @@ void setKernelArgGpuBuffer(char *memory_as_charstar, int32_t elementSize) {
     // The elementSize used to be used, but is no longer used/needed. Should probably be
     // removed from the method parameters at some point.
 
-    // pthread_mutex_lock(&launchMutex);
-    std::lock_guard< std::recursive_mutex > guard(launchMutex);
     ThreadVars *v = getThreadVars();
 
     Memory *memory = findMemory(memory_as_charstar);
@@ -384,9 +543,9 @@ void setKernelArgGpuBuffer(char *memory_as_charstar, int32_t elementSize) {
         COCL_PRINT("setKernelArgGpuBuffer nullptr");
         addClmemArg(0);
         if(v->offsets_32bit) {
-            launchConfiguration.args.push_back(std::unique_ptr<Arg>(new UInt32Arg(0)));
+            launchConfiguration.args.push_back(Arg::uint32(0));
         } else {
-            launchConfiguration.args.push_back(std::unique_ptr<Arg>(new Int64Arg(0)));
+            launchConfiguration.args.push_back(Arg::int64(0));
         }
     } else {
         size_t offset = memory->getOffset(memory_as_charstar);
@@ -400,153 +559,367 @@ void setKernelArgGpuBuffer(char *memory_as_charstar, int32_t elementSize) {
         addClmemArg(clmem);
 
         if(v->offsets_32bit) {
-            launchConfiguration.args.push_back(std::unique_ptr<Arg>(new UInt32Arg((uint32_t)offsetElements)));
+            launchConfiguration.args.push_back(Arg::uint32((uint32_t)offsetElements));
         } else {
-            launchConfiguration.args.push_back(std::unique_ptr<Arg>(new Int64Arg((int64_t)offsetElements)));
+            launchConfiguration.args.push_back(Arg::int64((int64_t)offsetElements));
         }
     }
-    // pthread_mutex_unlock(&launchMutex);
 }
 
 void setKernelArgInt64(int64_t value) {
-    std::lock_guard< std::recursive_mutex > guard(launchMutex);
-    // pthread_mutex_lock(&launchMutex);
-    launchConfiguration.args.push_back(std::unique_ptr<Arg>(new Int64Arg(value)));
+    launchConfiguration.args.push_back(Arg::int64(value));
     COCL_PRINT("setKernelArgInt64 " << value);
-    // pthread_mutex_unlock(&launchMutex);
 }
 
 void setKernelArgInt32(int value) {
-    std::lock_guard< std::recursive_mutex > guard(launchMutex);
-    // pthread_mutex_lock(&launchMutex);
-    launchConfiguration.args.push_back(std::unique_ptr<Arg>(new Int32Arg(value)));
+    launchConfiguration.args.push_back(Arg::int32(value));
     COCL_PRINT("setKernelArgInt32 " << value);
-    // pthread_mutex_unlock(&launchMutex);
 }
 
 void setKernelArgInt8(char value) {
-    std::lock_guard< std::recursive_mutex > guard(launchMutex);
-    // pthread_mutex_lock(&launchMutex);
-    launchConfiguration.args.push_back(std::unique_ptr<Arg>(new Int8Arg(value)));
+    launchConfiguration.args.push_back(Arg::int8(value));
     COCL_PRINT("setKernelArgInt8 " << value);
-    // pthread_mutex_unlock(&launchMutex);
 }
 
 void setKernelArgFloat(float value) {
-    std::lock_guard< std::recursive_mutex > guard(launchMutex);
-    // pthread_mutex_lock(&launchMutex);
-    launchConfiguration.args.push_back(std::unique_ptr<Arg>(new FloatArg(value)));
+    launchConfiguration.args.push_back(Arg::float32(value));
     COCL_PRINT("setKernelArgFloat " << value);
-    // pthread_mutex_unlock(&launchMutex);
+}
+
+static StagingRing *uploadStagedStructs(ThreadVars *v, size_t *ringOffset, bool useRing) {
+    // uploads the structs from setKernelArgHostsideBuffer, and points their offset args at them
+    // returns the ring used, or 0 if the ring was full, or useRing was false, and we used a buffer
+    // of our own instead
+    StagingRing *stagingRing = launchConfiguration.coclStream->getStagingRing();
+    int clmemIndex = findArgClmemIndex(stagingRing->clmem);
+    if(!useRing || !stagingRing->upload(launchConfiguration.queue->queue, &launchConfiguration.stagedStructs[0],
+            launchConfiguration.stagedStructs.size(), ringOffset)) {
+        // the structs are already laid out from offset 0, so we just swap in our own buffer
+        cl_int err;
+        cl_mem gpu_structs = clCreateBuffer(*v->getContext()->getCl()->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+            launchConfiguration.stagedStructs.size(), &launchConfiguration.stagedStructs[0], &err);
+        EasyCL::checkError(err);
+        launchConfiguration.kernelArgsToBeReleased.push_back(gpu_structs);
+        launchConfiguration.clmems[clmemIndex] = gpu_structs;
+        return 0;
+    }
+    for(auto it=launchConfiguration.stagedStructArgIndexes.begin(); it != launchConfiguration.stagedStructArgIndexes.end(); it++) {
+        launchConfiguration.args[*it].addToOffset(*ringOffset);
+    }
+    return stagingRing;
+}
+
+static void retireStagedStructs(StagingRing *stagingRing, size_t ringOffset) {
+    // the ring region can be reused once the kernel we just queued has finished
+    cl_event event;
+    cl_int err = clEnqueueMarkerWithWaitList(launchConfiguration.queue->queue, 0, 0, &event);
+    EasyCL::checkError(err);
+    stagingRing->retire(ringOffset, event);
+}
+
+static void releaseKernelArgsCallback(cl_event event, cl_int status, void *userdata) {
+    // runs on an OpenCL driver thread, once all commands queued before the marker have completed
+    std::vector<cl_mem> *toRelease = (std::vector<cl_mem> *)userdata;
+    for(auto it=toRelease->begin(); it != toRelease->end(); it++) {
+        clReleaseMemObject(*it);
+    }
+    delete toRelease;
+    clReleaseEvent(event);
+}
+
+// call with launchState->mutex held
+// buffers are always set again: once a cl_mem is released, the driver can hand out the same handle
+// for a new buffer, and a cl_kernel still bound to the old one would be left pointing at a released
+// object, even though the handle compares equal
+static void setKernelArgIfChanged(KernelLaunchState *launchState, cl_uint index, size_t size, const void *value,
+        bool isMemObject) {
+    if(launchState->lastArgs.size() <= index) {
+        launchState->lastArgs.resize(index + 1);
+    }
+    KernelArgSlot &slot = launchState->lastArgs[index];
+    // values are all at most 8 bytes. Local memory, and null pointers, have only a size
+    uint64_t bits = 0;
+    bool remembered = !isMemObject && (value == 0 || size <= sizeof(bits));
+    if(value != 0 && remembered) {
+        memcpy(&bits, value, size);
+    }
+    if(remembered && slot.isSet && slot.size == size && slot.hasValue == (value != 0) && slot.value == bits) {
+        return;
+    }
+    slot.isSet = false;
+    EasyCL::checkError(clSetKernelArg(launchState->clkernel, index, size, value));
+    slot.isSet = remembered;
+    slot.size = size;
+    slot.hasValue = value != 0;
+    slot.value = bits;
+}
+
+static uint64_t hashClmemIndexes(const std::vector<int> &clmemIndexByClmemArgIndex, int vmemSegmentCount) {
+    // FNV-1a
+    uint64_t hash = (14695981039346656037ull ^ (uint32_t)vmemSegmentCount) * 1099511628211ull;
+    for(auto it=clmemIndexByClmemArgIndex.begin(); it != clmemIndexByClmemArgIndex.end(); it++) {
+        hash = (hash ^ (uint32_t)*it) * 1099511628211ull;
+    }
+    return (hash ^ clmemIndexByClmemArgIndex.size()) * 1099511628211ull;
+}
+
+static KernelVariant *findKernelVariant(KernelSite *site, uint64_t hash, const std::vector<int> &clmemIndexByClmemArgIndex,
+        int vmemSegmentCount) {
+    auto it = site->variantsByHash.find(hash);
+    if(it == site->variantsByHash.end()) {
+        return 0;
+    }
+    for(auto variantIt=it->second.begin(); variantIt != it->second.end(); variantIt++) {
+        if((*variantIt)->vmemSegmentCount == vmemSegmentCount && (*variantIt)->clmemIndexByClmemArgIndex == clmemIndexByClmemArgIndex) {
+            return variantIt->get();
+        }
+    }
+    return 0;
+}
+
+// calls fn(index, size, value, isMemObject) for each arg of the cl_kernel, for the current launch, in order
+// value is 0 for the local memory args: scratch, and the dynamic shared memory. isMemObject is true
+// for cl_mem args
+template<typename F>
+static void forEachKernelArg(const KernelVariant *variant, F fn) {
+    cl_uint argIndex = 0;
+    for(int i = 0; i < launchConfiguration.clmems.size(); i++) {
+        COCL_PRINT("clmem" << i);
+        fn(argIndex++, sizeof(cl_mem), &launchConfiguration.clmems[i], true);
+    }
+    for(int i = 0; i < launchConfiguration.args.size(); i++) {
+        COCL_PRINT("i=" << i << " " << launchConfiguration.args[i].str());
+        const Arg &arg = launchConfiguration.args[i];
+        fn(argIndex++, arg.size(), arg.data(), arg.kind == Arg::AK_ClmemArg);
+    }
+    int workgroupSize = launchConfiguration.block[0] * launchConfiguration.block[1] * launchConfiguration.block[2];
+    COCL_PRINT("workgroupSize=" << workgroupSize);
+    // scratch, the local int array at the end of every kernel's args
+    fn(argIndex++, max(4, workgroupSize) * sizeof(int), (const void *)0, false);
+    if(variant->kernelInfo.usesDynamicShared) {
+        // OpenCL doesnt allow zero-sized local args
+        fn(argIndex++, max((size_t)4, launchConfiguration.sharedMem), (const void *)0, false);
+    }
+}
+
+// clears this thread's launch, however kernelGo exits. Otherwise, after an exception, the next
+// launch on this thread would add its args to the old ones
+class LaunchGuard {
+public:
+    ~LaunchGuard() {
+        if(stagingRing != 0) {
+            try {
+                retireStagedStructs(stagingRing, ringOffset);
+            } catch(runtime_error &e) {
+                // we're already unwinding from whatever went wrong first
+            }
+        }
+        abandonLaunch();
+    }
+    StagingRing *stagingRing = 0;  // set until the ring region is retired
+    size_t ringOffset = 0;
+};
+
+// records the launch into the graph the stream is capturing, rather than queueing it
+static void captureKernelLaunch(ThreadVars *v, KernelVariant *variant, CoclGraph *graph) {
+    COCL_PRINT("kernelGo() capturing " << launchConfiguration.kernelName);
+    if(launchConfiguration.stagedStructArgIndexes.size() > 0) {
+        // the graph might be launched any number of times, so the structs need a buffer of their
+        // own, not a region of the ring
+        size_t ringOffset = 0;
+        uploadStagedStructs(v, &ringOffset, false);
+    }
+    HostAllocationsOnDevice onDevice(launchConfiguration.queue->queue);
+    onDevice.addClmems(launchConfiguration.clmems);
+    if(!onDevice.empty()) {
+        throw runtime_error("stream capture: kernels using host allocations, via cudaHostGetDevicePointer, cant be captured");
+    }
+    GraphNode node;
+    node.type = GraphNode::Kernel;
+    node.name = launchConfiguration.kernelName;
+    node.clkernel = variant->launchState->clkernel;
+    EasyCL::checkError(clRetainKernel(node.clkernel));
+    forEachKernelArg(variant, [&node](cl_uint index, size_t size, const void *value, bool isMemObject) {
+        GraphNode::KernelArg arg = { size, value != 0, 0 };
+        if(value != 0) {
+            memcpy(&arg.value, value, size);
+        }
+        node.args.push_back(arg);
+    });
+    for(int i = 0; i < 3; i++) {
+        node.global[i] = launchConfiguration.grid[i] * launchConfiguration.block[i];
+        node.block[i] = launchConfiguration.block[i];
+    }
+    graph->nodes.push_back(node);
+    graph->ownedBuffers.insert(graph->ownedBuffers.end(),
+        launchConfiguration.kernelArgsToBeReleased.begin(), launchConfiguration.kernelArgsToBeReleased.end());
+    launchConfiguration.kernelArgsToBeReleased.clear();
+    clearLaunch();
+}
+
+// every vmem segment is a kernel arg of its own, so the number of allocations a vmem kernel can see
+// is limited by CL_DEVICE_MAX_PARAMETER_SIZE, which can be as little as 1024 bytes. Better to say so
+// here, than have the build or the launch fail with CL_INVALID_KERNEL_ARGS, or similar
+static void checkVmemArgsFit(Context *context) {
+    size_t bytes = launchConfiguration.clmems.size() * sizeof(cl_mem);
+    for(int i = 0; i < launchConfiguration.args.size(); i++) {
+        bytes += launchConfiguration.args[i].size();
+    }
+    // scratch, and maybe dynamic shared memory. local args cost a pointer each
+    bytes += 2 * sizeof(cl_mem);
+    if(bytes > context->maxParameterSize) {
+        throw runtime_error("kernel " + launchConfiguration.kernelName + " loads pointers from device memory, so gets every allocation's buffer as a kernel arg, "
+            "but the " + easycl::toString(launchConfiguration.firstArgClmemIndex) + " vmem segments, plus the other args, come to " +
+            easycl::toString(bytes) + " bytes, which is more than the device's CL_DEVICE_MAX_PARAMETER_SIZE, of " +
+            easycl::toString(context->maxParameterSize) + " bytes. The table reaches up to the highest segment in use, so try freeing some allocations first");
+    }
+}
+
+// returns the built kernel for the current launch. On the first launch of each variant, this
+// generates, and builds, the OpenCL, via the string-keyed caches, as before
+static KernelVariant *getKernelVariant(ThreadVars *v) {
+    Context *context = v->getContext();
+    KernelSite *site = launchConfiguration.kernelSite;
+    if(launchConfiguration.vmemLayout) {
+        checkVmemArgsFit(context);
+    }
+    int vmemSegmentCount = launchConfiguration.vmemLayout ? (int)launchConfiguration.firstArgClmemIndex : 1;
+    uint64_t hash = hashClmemIndexes(launchConfiguration.clmemIndexByClmemArgIndex, vmemSegmentCount);
+    {
+        std::lock_guard< std::mutex > guard(context->kernelSitesMutex);
+        KernelVariant *variant = findKernelVariant(site, hash, launchConfiguration.clmemIndexByClmemArgIndex, vmemSegmentCount);
+        if(variant != 0) {
+            context->numKernelCalls++;
+            launchConfiguration.uniqueKernelName = variant->uniqueKernelName;
+            return variant;
+        }
+    }
+
+    GenerateOpenCLResult res = generateOpenCL(
+        launchConfiguration.clmems.size(), launchConfiguration.clmemIndexByClmemArgIndex, launchConfiguration.kernelName, launchConfiguration.devicellcode,
+        launchConfiguration.deviceclcode, vmemSegmentCount);
+    std::unique_ptr<KernelVariant> variant(new KernelVariant());
+    variant->clmemIndexByClmemArgIndex = launchConfiguration.clmemIndexByClmemArgIndex;
+    variant->vmemSegmentCount = vmemSegmentCount;
+    variant->uniqueKernelName = res.uniqueKernelName;
+    variant->kernel = compileOpenCLKernel(launchConfiguration.kernelName, res.uniqueKernelName, res.shortKernelName, res.clSourcecode);
+    variant->launchState = getKernelLaunchState(variant->kernel);
+    {
+        std::lock_guard< std::mutex > guard(context->clSourceCodeCacheMutex);
+        variant->kernelInfo = context->kernelInfoByUniqueName[res.uniqueKernelName];
+    }
+
+    std::lock_guard< std::mutex > guard(context->kernelSitesMutex);
+    KernelVariant *existing = findKernelVariant(site, hash, launchConfiguration.clmemIndexByClmemArgIndex, vmemSegmentCount);
+    if(existing != 0) {
+        // another thread added it whilst we were generating. Its the same kernel, from the caches
+        return existing;
+    }
+    std::vector<std::unique_ptr<KernelVariant> > &variants = site->variantsByHash[hash];
+    variants.push_back(std::move(variant));
+    return variants.back().get();
 }
 
 void kernelGo() {
     try {
-    launchMutex.lock();
-    // pthread_mutex_lock(&launchMutex);
     // COCL_PRINT("kernelGo queue=" << (void *)launchConfiguration.queue);
 
     ThreadVars *v = getThreadVars();
+    TraceScope traceScope("launch", launchConfiguration.kernelName);
+    LaunchGuard launchGuard;
 
-    GenerateOpenCLResult res = generateOpenCL(
-        launchConfiguration.clmems.size(), launchConfiguration.clmemIndexByClmemArgIndex, launchConfiguration.kernelName, launchConfiguration.devicellsourcecode);
     COCL_PRINT("kernelGo() kernel: " << launchConfiguration.kernelName);
-    CLKernel *kernel = compileOpenCLKernel(launchConfiguration.kernelName, res.uniqueKernelName, res.shortKernelName, res.clSourcecode);
+    KernelVariant *variant = getKernelVariant(v);
+    CLKernel *kernel = variant->kernel;
     COCL_PRINT("kernelGo() uniqueKernelName: " << launchConfiguration.uniqueKernelName);
 
-    KernelInfo kernelInfo = v->getContext()->kernelInfoByUniqueName[launchConfiguration.uniqueKernelName];
+    const KernelInfo &kernelInfo = variant->kernelInfo;
     COCL_PRINT("kernel uses vmem?: " << kernelInfo.usesVmem);
     COCL_PRINT("kernel uses scratch?: " << kernelInfo.usesScratch);
-    if(kernelInfo.usesVmem) {
-        if(v->getContext()->memories.size() > 1) {
-            std::cout << std::endl;
-            std::cout << "Error: you are trying to use a kernel that uses double-indirected pointers ('float **' et al)" << std::endl;
-            std::cout << "whilst you have allocated multiple gpu buffers" << std::endl;
-            std::cout << std::endl;
-            std::cout << "This is currently not supported by Coriander" << std::endl;
-            std::cout << std::endl;
-            std::cout << "Your options are:" << std::endl;
-            std::cout << "- update your GPU kernel, to not use double-indirected pointers" << std::endl;
-            std::cout << "- allocate one single huge GPU memory buffer, instead of many smaller ones" << std::endl;
-            std::cout << std::endl;
-            throw std::runtime_error("Error: using vmem with multiple allocations");
-        } else {
-            WHEN_SPAMMING(Memory *memory = *v->getContext()->memories.begin());
-            COCL_PRINT("Memory allocation ok: one single allocation at vmem=" << memory->fakePos << " sizeByes=" << memory->bytes);
-        }
+    COCL_PRINT("kernel uses dynamic shared memory?: " << kernelInfo.usesDynamicShared << " sharedMem=" << launchConfiguration.sharedMem);
+    if(kernelInfo.usesVmem && !launchConfiguration.vmemLayout) {
+        // the first launch from this site. Now we know it uses vmem, it needs every allocation
+        launchConfiguration.kernelSite->usesVmem = true;
+        useVmemLayout(v->getContext());
+        variant = getKernelVariant(v);
+        kernel = variant->kernel;
+        COCL_PRINT("kernelGo() vmem segments: " << launchConfiguration.firstArgClmemIndex << " uniqueKernelName: " << launchConfiguration.uniqueKernelName);
     }
 
-    // ThreadVars *v = getThreadVars();
-    for(int i = 0; i < launchConfiguration.clmems.size(); i++) {
-        COCL_PRINT("clmem" << i);
-        kernel->inout(&launchConfiguration.clmems[i]);
-        // we also need to write out the offset of this clmem, in our virtual memory system
-        cl_mem clmem = launchConfiguration.clmems[i];
-        Memory *memory = findMemoryByClmem(clmem);
-        uint64_t vmemloc = 0;
-        if(memory != 0) {  // hostsidegpu buffers will be 0
-            vmemloc = memory->fakePos;
-        }
-        if(v->offsets_32bit) {
-            kernel->in((uint32_t)vmemloc);
-        } else {
-            kernel->in((int64_t)vmemloc);
-        }
+    if(launchConfiguration.coclStream->capturingGraph != 0) {
+        captureKernelLaunch(v, variant, launchConfiguration.coclStream->capturingGraph);
+        return;
     }
-    for(int i = 0; i < launchConfiguration.args.size(); i++) {
-        COCL_PRINT("i=" << i << " " << launchConfiguration.args[i]->str());
-        launchConfiguration.args[i]->inject(kernel);
+
+    StagingRing *stagingRing = 0;
+    size_t ringOffset = 0;
+    if(launchConfiguration.stagedStructArgIndexes.size() > 0) {
+        stagingRing = uploadStagedStructs(v, &ringOffset, true);
+        launchGuard.stagingRing = stagingRing;
+        launchGuard.ringOffset = ringOffset;
     }
 
+    // we set the args on the cl_kernel ourselves, rather than through CLKernel, which sets every
+    // arg again on every launch. Repeat launches only set the buffers, and the by-value args which changed
+    KernelLaunchState *launchState = variant->launchState;
+    std::unique_lock< std::mutex > kernelLock(launchState->mutex);
+    forEachKernelArg(variant, [launchState](cl_uint index, size_t size, const void *value, bool isMemObject) {
+        setKernelArgIfChanged(launchState, index, size, value, isMemObject);
+    });
+
     size_t global[3];
     for(int i = 0; i < 3; i++) {
         global[i] = launchConfiguration.grid[i] * launchConfiguration.block[i];
     }
     COCL_PRINT("grid: " << launchConfiguration.grid << " block: " << launchConfiguration.block
         << " global: " << global);
-    int workgroupSize = launchConfiguration.block[0] * launchConfiguration.block[1] * launchConfiguration.block[2];
-    COCL_PRINT("workgroupSize=" << workgroupSize);
-    kernel->localInts(max(4, workgroupSize));
 
+    // buffers of host allocations, from cudaHostGetDevicePointer, cant be used whilst mapped
+    HostAllocationsOnDevice onDevice(launchConfiguration.queue->queue);
+    onDevice.addClmems(launchConfiguration.clmems);
     try {
-        kernel->run(launchConfiguration.queue, 3, global, launchConfiguration.block);
+        DeviceTraceSpan deviceTraceSpan("kernel", launchConfiguration.kernelName, launchConfiguration.queue->queue);
+        onDevice.unmap();
+        EasyCL::checkError(clEnqueueNDRangeKernel(launchConfiguration.queue->queue, launchState->clkernel, 3, 0,
+            global, launchConfiguration.block, 0, 0, 0));
+        onDevice.remap();
     } catch(runtime_error &e) {
         if(kernel->buildLog != "") {
             std::cout << kernel->buildLog << std::endl;
         }
         cout << "kernel failed to run" << endl;
         cout << "kernel name: [" << launchConfiguration.kernelName << "]" << endl;
-        launchMutex.unlock();
-        launchMutex.unlock();
-        // pthread_mutex_unlock(&launchMutex);
-        // pthread_mutex_unlock(&launchMutex);
         throw e;
     }
+    kernelLock.unlock();
     COCL_PRINT(".. kernel queued");
     cl_int err;
-    err = clFinish(launchConfiguration.queue->queue);
-    EasyCL::checkError(err);
     debugDumper.maybeDump();
 
-    for(auto it=launchConfiguration.kernelArgsToBeReleased.begin(); it != launchConfiguration.kernelArgsToBeReleased.end(); it++) {
-        cl_mem memObject = *it;
-        err = clReleaseMemObject(memObject);
-        EasyCL::checkError(err);
+    if(stagingRing != 0) {
+        launchGuard.stagingRing = 0;
+        retireStagedStructs(stagingRing, ringOffset);
     }
-    launchConfiguration.kernelArgsToBeReleased.clear();
-    launchConfiguration.args.clear();
 
-    launchConfiguration.clmemIndexByClmem.clear();
-    launchConfiguration.clmems.clear();
-    launchConfiguration.clmemIndexByClmemArgIndex.clear();
+    if(launchConfiguration.kernelArgsToBeReleased.size() > 0) {
+        // the struct buffers are still in use by the kernel we just queued, so we hand them
+        // to a marker callback, which releases them once the kernel has finished
+        cl_event event;
+        err = clEnqueueMarkerWithWaitList(launchConfiguration.queue->queue, 0, 0, &event);
+        EasyCL::checkError(err);
+        std::vector<cl_mem> *toRelease = new std::vector<cl_mem>();
+        toRelease->swap(launchConfiguration.kernelArgsToBeReleased);
+        err = clSetEventCallback(event, CL_COMPLETE, releaseKernelArgsCallback, toRelease);
+        EasyCL::checkError(err);
+    }
+    clearLaunch();
 
-    err = clFinish(launchConfiguration.queue->queue);
+    if(v->launchBlocking) {
+        err = clFinish(launchConfiguration.queue->queue);
+    } else {
+        err = clFlush(launchConfiguration.queue->queue);
+    }
     EasyCL::checkError(err);
-
-    launchMutex.unlock();
-    launchMutex.unlock();
-    // pthread_mutex_unlock(&launchMutex);
-    // pthread_mutex_unlock(&launchMutex);
     } catch(runtime_error &e) {
         std::cout << "caught runtime error " << e.what() << std::endl;
         throw e;
@@ -18,44 +18,339 @@
 
 #include "cocl/ir-to-opencl-common.h"
 #include "cocl/kernel_dumper.h"
+#include "cocl/struct_clone.h"
+#include "cocl/cocl_trace.h"
+#include "cocl/cocl_devicell.h"
 
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+
+#include <unordered_map>
+#include <list>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <cstring>
 
 
 namespace cocl {
 
+namespace {
+// For big modules, parsing the textual device IR dominates the cost of generating each new
+// kernel variant. So we parse each module just once, and keep the result as bitcode
+// (if the host binary embedded bitcode in the first place, we use that directly).
+// Each generation then reads that bitcode into its own fresh LLVMContext. This is much faster than
+// parsing text, fine to do from several threads at once, and gives exactly the same OpenCL as
+// parsing from scratch (KernelDumper mutates the module, and adds named struct types to the
+// context, so we cant simply share one parsed module, or one context)
+class ParsedModule {
+public:
+    std::once_flag parsed;
+    std::string bitcode;
+};
+
+void parseModule(ParsedModule *parsedModule, const std::string &llString) {
+    const unsigned char *llStringBytes = (const unsigned char *)llString.data();
+    if(llvm::isBitcode(llStringBytes, llStringBytes + llString.size())) {
+        // embedded as bitcode already, by patch_hostside --devicellformat bitcode
+        parsedModule->bitcode = llString;
+        return;
+    }
+    TraceScope traceScope("parse", "parse IR");
+    llvm::StringRef llStringRef(llString);
+    std::unique_ptr<llvm::MemoryBuffer> llMemoryBuffer = llvm::MemoryBuffer::getMemBuffer(llStringRef);
+    llvm::LLVMContext context;
+    llvm::SMDiagnostic smDiagnostic;
+    std::unique_ptr<llvm::Module> M = parseIR(llMemoryBuffer->getMemBufferRef(), smDiagnostic,
+                                context);
+    if(!M) {
+        smDiagnostic.print("irtopencl", llvm::errs());
+        throw std::runtime_error("failed to parse IR");
+    }
+    llvm::raw_string_ostream bitcodeStream(parsedModule->bitcode);
+    llvm::WriteBitcodeToFile(M.get(), bitcodeStream);
+    bitcodeStream.flush();
+}
+
+// at runtime, device code arrives as pointers to constants embedded in the host binary by
+// patch_hostside, which are the same for every launch. So, like the kernel sites, modules are
+// keyed on the pointer, rather than on the contents, which can be several megabytes. Only the
+// most recently used maxCachedDeviceModules are kept
+typedef std::list<std::pair<const char *, std::shared_ptr<ParsedModule> > > DeviceModuleList;
+std::mutex deviceModulesMutex;  // everything below
+DeviceModuleList deviceModules;  // most recently used first
+std::unordered_map<const char *, DeviceModuleList::iterator> deviceModuleByDevicellcode;
+DeviceModuleCacheStats deviceModuleCacheStats;
+
+std::shared_ptr<ParsedModule> getDeviceModule(const char *devicellcode) {
+    std::shared_ptr<ParsedModule> parsedModule;
+    {
+        std::lock_guard< std::mutex > guard(deviceModulesMutex);
+        auto it = deviceModuleByDevicellcode.find(devicellcode);
+        if(it != deviceModuleByDevicellcode.end()) {
+            deviceModuleCacheStats.hits++;
+            deviceModules.splice(deviceModules.begin(), deviceModules, it->second);
+            parsedModule = it->second->second;
+        } else {
+            deviceModuleCacheStats.misses++;
+            parsedModule.reset(new ParsedModule());
+            deviceModules.push_front(std::make_pair(devicellcode, parsedModule));
+            deviceModuleByDevicellcode[devicellcode] = deviceModules.begin();
+            if(deviceModules.size() > (size_t)maxCachedDeviceModules) {
+                // anyone still generating from it holds their own shared_ptr
+                deviceModuleByDevicellcode.erase(deviceModules.back().first);
+                deviceModules.pop_back();
+            }
+        }
+    }
+    // if parsing throws, the once_flag stays unset, and the next caller tries again
+    std::call_once(parsedModule->parsed, [&]() {
+        parseModule(parsedModule.get(), decodeDeviceCode(devicellcode));
+    });
+    return parsedModule;
+}
+
+std::unique_ptr<llvm::Module> readParsedModule(ParsedModule *parsedModule, llvm::LLVMContext &context) {
+    llvm::Expected<std::unique_ptr<llvm::Module> > M = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(parsedModule->bitcode, "devicell"), context);
+    if(!M) {
+        llvm::logAllUnhandledErrors(M.takeError(), llvm::errs(), "irtopencl: ");
+        throw std::runtime_error("failed to read cached IR bitcode");
+    }
+    return std::move(*M);
+}
+
+const char precompiledTableMagic[] = "COCLCL03\n";
+} // namespace
+
+std::vector<std::string> getKernelNames(llvm::Module *M) {
+    // clang lists the kernels in !nvvm.annotations, as {function, !"kernel", i32 1}
+    std::vector<std::string> kernelNames;
+    llvm::NamedMDNode *annotations = M->getNamedMetadata("nvvm.annotations");
+    if(annotations == 0) {
+        return kernelNames;
+    }
+    for(unsigned i = 0; i < annotations->getNumOperands(); i++) {
+        llvm::MDNode *node = annotations->getOperand(i);
+        if(node->getNumOperands() < 2) {
+            continue;
+        }
+        llvm::MDString *kind = llvm::dyn_cast_or_null<llvm::MDString>(node->getOperand(1).get());
+        llvm::ValueAsMetadata *value = llvm::dyn_cast_or_null<llvm::ValueAsMetadata>(node->getOperand(0).get());
+        if(kind == 0 || kind->getString() != "kernel" || value == 0) {
+            continue;
+        }
+        if(llvm::Function *F = llvm::dyn_cast<llvm::Function>(value->getValue())) {
+            kernelNames.push_back(F->getName().str());
+        }
+    }
+    return kernelNames;
+}
+
+// the number of clmem args the hostside will send for kernel F: one per pointer, plus, for a
+// struct containing pointers, one per pointer inside it. This needs to match
+// FunctionDumper::dumpKernelFunctionDeclarationWithoutReturn
+int countKernelClmemArgs(llvm::Function *F) {
+    int count = 0;
+    for(auto it=F->arg_begin(); it != F->arg_end(); it++) {
+        llvm::PointerType *ptrType = llvm::dyn_cast<llvm::PointerType>(it->getType());
+        if(ptrType == 0) {
+            continue;
+        }
+        count++;
+        llvm::StructType *structType = llvm::dyn_cast<llvm::StructType>(ptrType->getElementType());
+        if(structType == 0 || structType->getName().str() == "struct.float4") {
+            continue;
+        }
+        StructInfo structInfo;
+        StructCloner::walkStructType(F->getParent(), &structInfo, 0, 0, std::vector<int>(), "", structType);
+        for(auto pointerit=structInfo.pointerInfos.begin(); pointerit != structInfo.pointerInfos.end(); pointerit++) {
+            llvm::Type *pointerElementType = llvm::cast<llvm::PointerType>((*pointerit)->type)->getElementType();
+            if(pointerElementType->getPrimitiveSizeInBits() != 0) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
 ModuleClRes convertModuleToCl(
         int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, llvm::Module *M, std::string specificFunction, std::string generatedName,
-        bool offsets_32bit) {
+        bool offsets_32bit, int vmemSegmentCount) {
     cocl::KernelDumper kernelDumper(M, specificFunction, generatedName, offsets_32bit);
     kernelDumper.addIRToCl();
+    kernelDumper.vmemSegmentCount = vmemSegmentCount;
     std::string cl = kernelDumper.toCl(uniqueClmemCount, clmemIndexByClmemArgIndex);
     ModuleClRes res;
     res.clSourcecode = cl;
     res.usesVmem = kernelDumper.usesVmem;
     res.usesScratch = kernelDumper.usesScratch;
+    res.usesDynamicShared = kernelDumper.usesDynamicShared;
     return res;
 }
 
+namespace {
+ModuleClRes convertParsedModuleToCl(
+        int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, ParsedModule *parsedModule, std::string specificFunction, std::string generatedName,
+        bool offsets_32bit, int vmemSegmentCount) {
+    llvm::LLVMContext context;
+    std::unique_ptr<llvm::Module> M = readParsedModule(parsedModule, context);
+    ModuleClRes res = convertModuleToCl(
+        uniqueClmemCount, clmemIndexByClmemArgIndex, M.get(), specificFunction, generatedName, offsets_32bit, vmemSegmentCount);
+    return res;
+}
+} // namespace
+
 ModuleClRes convertLlStringToCl(
         int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, std::string llString, std::string specificFunction, std::string generatedName,
-        bool offsets_32bit) {
-    llvm::StringRef llStringRef(llString);
-    std::unique_ptr<llvm::MemoryBuffer> llMemoryBuffer = llvm::MemoryBuffer::getMemBuffer(llStringRef);
-    llvm::LLVMContext context;
-    llvm::SMDiagnostic smDiagnostic;
-    std::unique_ptr<llvm::Module> M = parseIR(llMemoryBuffer->getMemBufferRef(), smDiagnostic,
-                                context);
-    if(!M) {
-        smDiagnostic.print("irtopencl", llvm::errs());
-        throw std::runtime_error("failed to parse IR");
+        bool offsets_32bit, int vmemSegmentCount) {
+    ParsedModule parsedModule;
+    parseModule(&parsedModule, llString);
+    return convertParsedModuleToCl(
+        uniqueClmemCount, clmemIndexByClmemArgIndex, &parsedModule, specificFunction, generatedName, offsets_32bit, vmemSegmentCount);
+}
+
+ModuleClRes convertDeviceCodeToCl(
+        int uniqueClmemCount, std::vector<int> &clmemIndexByClmemArgIndex, const char *devicellcode, std::string specificFunction, std::string generatedName,
+        bool offsets_32bit, int vmemSegmentCount) {
+    std::shared_ptr<ParsedModule> parsedModule = getDeviceModule(devicellcode);
+    return convertParsedModuleToCl(
+        uniqueClmemCount, clmemIndexByClmemArgIndex, parsedModule.get(), specificFunction, generatedName, offsets_32bit, vmemSegmentCount);
+}
+
+DeviceModuleCacheStats getDeviceModuleCacheStats() {
+    std::lock_guard< std::mutex > guard(deviceModulesMutex);
+    return deviceModuleCacheStats;
+}
+
+std::string getShortKernelName(const std::string &kernelName) {
+    return kernelName.substr(0, 20);
+}
+
+std::string convertAllKernelsToClTable(std::string llString, int numThreads) {
+    // parsed once, and shared by all the threads
+    ParsedModule parsedModule;
+    parseModule(&parsedModule, llString);
+    std::vector<std::pair<std::string, int> > kernels;
+    {
+        llvm::LLVMContext context;
+        std::unique_ptr<llvm::Module> M = readParsedModule(&parsedModule, context);
+        std::vector<std::string> kernelNames = getKernelNames(M.get());
+        for(auto it=kernelNames.begin(); it != kernelNames.end(); it++) {
+            kernels.push_back(std::make_pair(*it, countKernelClmemArgs(M->getFunction(*it))));
+        }
     }
-    ModuleClRes res = convertModuleToCl(uniqueClmemCount, clmemIndexByClmemArgIndex, M.get(), specificFunction, generatedName, offsets_32bit);
-    return res;
+
+    // each kernel is converted from its own copy of the module, in its own LLVMContext, so several
+    // can be converted at once. Results are stored by kernel, and the table is written in kernel
+    // order afterwards, so it is the same whichever thread finishes first
+    std::vector<ModuleClRes> resByKernel(kernels.size());
+    std::vector<std::string> errorByKernel(kernels.size());
+    std::vector<char> failedByKernel(kernels.size(), 0);
+    std::atomic<size_t> nextKernel(0);
+    auto convertKernels = [&]() {
+        for(size_t i = nextKernel++; i < kernels.size(); i = nextKernel++) {
+            std::string kernelName = kernels[i].first;
+            int numClmemArgs = kernels[i].second;
+            // clmem 0 is the first allocated buffer, added by configureKernel, so the args start at 1
+            std::vector<int> clmemIndexByClmemArgIndex;
+            for(int j = 0; j < numClmemArgs; j++) {
+                clmemIndexByClmemArgIndex.push_back(j + 1);
+            }
+            try {
+                resByKernel[i] = convertParsedModuleToCl(
+                    numClmemArgs + 1, clmemIndexByClmemArgIndex, &parsedModule, kernelName, getShortKernelName(kernelName), false, 1);
+            } catch(const std::exception &e) {
+                failedByKernel[i] = 1;
+                errorByKernel[i] = e.what();
+            }
+        }
+    };
+    if(numThreads <= 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    numThreads = std::max(1, std::min(numThreads, (int)kernels.size()));
+    std::vector<std::thread> threads;
+    for(int t = 1; t < numThreads; t++) {
+        threads.push_back(std::thread(convertKernels));
+    }
+    convertKernels();
+    for(auto it=threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+
+    // each entry is a header line: name, numClmemArgs, usesVmem, usesScratch, usesDynamicShared, numBytes;
+    // then the cl
+    std::ostringstream table;
+    table << precompiledTableMagic;
+    for(size_t i = 0; i < kernels.size(); i++) {
+        std::string kernelName = kernels[i].first;
+        if(failedByKernel[i]) {
+            throw std::runtime_error("failed to generate OpenCL for kernel " + kernelName + ": " + errorByKernel[i]);
+        }
+        const ModuleClRes &res = resByKernel[i];
+        table << kernelName << " " << kernels[i].second << " " << res.usesVmem << " " << res.usesScratch << " " << res.usesDynamicShared << " ";
+        table << res.clSourcecode.size() << "\n" << res.clSourcecode << "\n";
+    }
+    return table.str();
+}
+
+bool findPrecompiledCl(
+        const char *table, const std::string &kernelName, int uniqueClmemCount, const std::vector<int> &clmemIndexByClmemArgIndex,
+        bool offsets_32bit, int vmemSegmentCount, ModuleClRes *res) {
+    // the table only covers 64-bit offsets, with each clmem arg in its own buffer, after a single
+    // leading clmem
+    if(table == 0 || offsets_32bit || vmemSegmentCount != 1 || uniqueClmemCount != (int)clmemIndexByClmemArgIndex.size() + 1) {
+        return false;
+    }
+    for(int i = 0; i < (int)clmemIndexByClmemArgIndex.size(); i++) {
+        if(clmemIndexByClmemArgIndex[i] != i + 1) {
+            return false;
+        }
+    }
+    size_t magicLength = strlen(precompiledTableMagic);
+    if(strncmp(table, precompiledTableMagic, magicLength) != 0) {
+        return false;
+    }
+    const char *pos = table + magicLength;
+    while(*pos != 0) {
+        const char *headerEnd = strchr(pos, '\n');
+        if(headerEnd == 0) {
+            return false;
+        }
+        std::istringstream header(std::string(pos, headerEnd));
+        std::string name;
+        int numClmemArgs = 0;
+        bool usesVmem = false;
+        bool usesScratch = false;
+        bool usesDynamicShared = false;
+        size_t numBytes = 0;
+        if(!(header >> name >> numClmemArgs >> usesVmem >> usesScratch >> usesDynamicShared >> numBytes)) {
+            return false;
+        }
+        const char *cl = headerEnd + 1;
+        if(name == kernelName) {
+            if(numClmemArgs != (int)clmemIndexByClmemArgIndex.size()) {
+                return false;
+            }
+            res->clSourcecode = std::string(cl, numBytes);
+            res->usesVmem = usesVmem;
+            res->usesScratch = usesScratch;
+            res->usesDynamicShared = usesDynamicShared;
+            return true;
+        }
+        pos = cl + numBytes + 1;
+    }
+    return false;
 }
 
 } // namespace cocl
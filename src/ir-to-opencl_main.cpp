@@ -14,6 +14,7 @@
 
 #include "argparsecpp/argparsecpp.h"
 #include "cocl/kernel_dumper.h"
+#include "cocl/ir-to-opencl.h"
 
 #include "EasyCL/util/easycl_stringhelper.h"
 
@@ -37,17 +38,47 @@ int main(int argc, char *argv[]) {
     string kernelname = "";
     string cmem_indexes = "";
     bool add_ir_to_cl = false;
+    bool all_kernels = false;
+    int threads = 0;
 
     argparsecpp::ArgumentParser parser;
     parser.add_string_argument("--inputfile", &llFilename)->required();
     parser.add_string_argument("--outputfile", &ClFilename)->required();
-    parser.add_string_argument("--kernelname", &kernelname)->required();
-    parser.add_string_argument("--cmem-indexes", &cmem_indexes)->required()->help("comma-separated, eg 0,1,2,1");
+    parser.add_string_argument("--kernelname", &kernelname)->help("required, unless --all-kernels");
+    parser.add_string_argument("--cmem-indexes", &cmem_indexes)->help("comma-separated, eg 0,1,2,1. required, unless --all-kernels");
     parser.add_bool_argument("--add_ir_to_cl", &add_ir_to_cl)->help("Adds some approximation of the original IR to the opencl code, for debugging");
+    parser.add_bool_argument("--all-kernels", &all_kernels)->help("Writes a table of opencl for every kernel, for embedding with patch_hostside --deviceclfile");
+    parser.add_int_argument("--threads", &threads)->help("with --all-kernels, how many kernels to convert at once. 0 means one per core");
     if(!parser.parse_args(argc, argv)) {
         return -1;
     }
 
+    if(all_kernels) {
+        ifstream f_inll(llFilename);
+        if(!f_inll) {
+            cout << "couldnt open " << llFilename << endl;
+            return -1;
+        }
+        string llSourcecode(
+            (std::istreambuf_iterator<char>(f_inll)),
+            (std::istreambuf_iterator<char>()));
+        try {
+            string table = convertAllKernelsToClTable(llSourcecode, threads);
+            ofstream of;
+            of.open(ClFilename, ios_base::out | ios_base::binary);
+            of << table;
+            of.close();
+        } catch(runtime_error &e) {
+            cout << "got exception: " << e.what() << endl;
+            return -1;
+        }
+        return 0;
+    }
+    if(kernelname == "" || cmem_indexes == "") {
+        cout << "please provide --kernelname and --cmem-indexes, or --all-kernels" << endl;
+        return -1;
+    }
+
     vector<string> split_cmem_indexes = easycl::split(cmem_indexes, ",");
     int numCmems = 0;
     vector<int> cmemIndexes;
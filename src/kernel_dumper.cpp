@@ -20,13 +20,17 @@
 #include "cocl/type_dumper.h"
 #include "cocl/function_dumper.h"
 #include "cocl/mutations.h"
+#include "cocl/cocl_defs.h"
+#include "cocl/readIR.h"
 #include "EasyCL/util/easycl_stringhelper.h"
 
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
 
 #include <stdexcept>
 #include <iostream>
 #include <sstream>
+#include <chrono>
 
 using namespace std;
 using namespace llvm;
@@ -37,6 +41,51 @@ namespace cocl {
 void KernelDumper::declareGlobals(ostream &os) {
 }
 
+static bool refersToDynamicSharedMemory(Value *value) {
+    if(ReadIR::isDynamicSharedMemory(value)) {
+        return true;
+    }
+    if(ConstantExpr *expr = dyn_cast<ConstantExpr>(value)) {
+        for(auto it=expr->op_begin(); it != expr->op_end(); it++) {
+            if(refersToDynamicSharedMemory(it->get())) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// whether F, or anything it calls, uses extern __shared__ memory. We need to know before we
+// write out the kernel declaration, which is before we have generated the functions it calls
+static bool usesDynamicSharedMemory(Function *F) {
+    set<Function *> seen;
+    vector<Function *> toVisit;
+    toVisit.push_back(F);
+    seen.insert(F);
+    while(toVisit.size() > 0) {
+        Function *thisF = toVisit.back();
+        toVisit.pop_back();
+        for(auto blockIt=thisF->begin(); blockIt != thisF->end(); blockIt++) {
+            for(auto instIt=blockIt->begin(); instIt != blockIt->end(); instIt++) {
+                Instruction *inst = &*instIt;
+                for(auto opIt=inst->op_begin(); opIt != inst->op_end(); opIt++) {
+                    if(refersToDynamicSharedMemory(opIt->get())) {
+                        return true;
+                    }
+                }
+                if(CallInst *call = dyn_cast<CallInst>(inst)) {
+                    Function *callee = call->getCalledFunction();
+                    if(callee != 0 && !callee->isDeclaration() && seen.find(callee) == seen.end()) {
+                        seen.insert(callee);
+                        toVisit.push_back(callee);
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
+
 static std::string createShortKernelName(string origName, std::set<std::string> &usedShortNames) {
     std::string name = origName;
     name = name.substr(0, 27);
@@ -58,6 +107,7 @@ std::string KernelDumper::toCl(int uniqueClmemCount, std::vector<int> &clmemInde
     // other names will fit around it
 
     F->setName(generatedName);
+    usesDynamicShared = usesDynamicSharedMemory(F);
 
     std::set<std::string> usedShortNames;
     usedShortNames.insert(generatedName);
@@ -92,6 +142,11 @@ std::string KernelDumper::toCl(int uniqueClmemCount, std::vector<int> &clmemInde
     map<Function *, Type *> returnTypeByFunction;
     map<string, string> oldNameByNewName;
 
+    // functions whose last generation stopped at a call to a function whose return type we
+    // didnt know yet, with the functions they called. Generation is deterministic, so theres no
+    // point trying them again until at least one of those has been generated
+    map<Function *, set<Function *> > blockedOnByFunction;
+
     isKernel.insert(F);
     neededFunctions.insert(F);
 
@@ -114,6 +169,19 @@ std::string KernelDumper::toCl(int uniqueClmemCount, std::vector<int> &clmemInde
         for(auto it = neededFunctionNames.begin(); it != neededFunctionNames.end(); it++) {
             string functionName = *it;
             Function *childF = neededFunctionByName.at(functionName);
+            auto blockedIt = blockedOnByFunction.find(childF);
+            if(blockedIt != blockedOnByFunction.end()) {
+                bool blockerGenerated = false;
+                for(auto blockerIt=blockedIt->second.begin(); blockerIt != blockedIt->second.end(); blockerIt++) {
+                    if(returnTypeByFunction.find(*blockerIt) != returnTypeByFunction.end()) {
+                        blockerGenerated = true;
+                        break;
+                    }
+                }
+                if(!blockerGenerated) {
+                    continue;
+                }
+            }
             bool _isKernel = isKernel.find(childF) != isKernel.end();
             std::string origName = childF->getName().str();
             FunctionDumper childFunctionDumper(
@@ -122,8 +190,20 @@ std::string KernelDumper::toCl(int uniqueClmemCount, std::vector<int> &clmemInde
             if(_addIRToCl) {
                 childFunctionDumper.addIRToCl();
             }
-            if(!childFunctionDumper.runGeneration(returnTypeByFunction)) {
+            childFunctionDumper.vmemSegmentCount = vmemSegmentCount;
+            childFunctionDumper.usesDynamicShared = usesDynamicShared;
+            auto generateStart = chrono::steady_clock::now();
+            bool generated = childFunctionDumper.runGeneration(returnTypeByFunction);
+            generateSeconds += chrono::duration<double>(chrono::steady_clock::now() - generateStart).count();
+            if(!generated) {
                 neededFunctions.insert(childFunctionDumper.neededFunctions.begin(), childFunctionDumper.neededFunctions.end());
+                set<Function *> &blockedOn = blockedOnByFunction[childF];
+                blockedOn.clear();
+                for(auto neededIt=childFunctionDumper.neededFunctions.begin(); neededIt != childFunctionDumper.neededFunctions.end(); neededIt++) {
+                    if(returnTypeByFunction.find(*neededIt) == returnTypeByFunction.end()) {
+                        blockedOn.insert(*neededIt);
+                    }
+                }
                 continue;
             }
             if(childFunctionDumper.usesVmem) {
@@ -179,12 +259,13 @@ std::string KernelDumper::toCl(int uniqueClmemCount, std::vector<int> &clmemInde
 
 struct GlobalVars {
     local int *scratch;
-    global char *clmem0;
-    unsigned long clmem_vmem_offset0;
-};
+    global char *vmemSegments[)" << vmemSegmentCount << R"(];
+)" << (usesDynamicShared ? "    local char *dynamicShared;\n" : "") << R"(};
 
+// vmemloc is (segment << )" << COCL_VMEM_SEGMENT_SHIFT << R"() + offset, and vmemSegments[i] is the buffer for segment i + 1
 inline global float *getGlobalPointer(__vmem__ unsigned long vmemloc, const struct GlobalVars* const globalVars) {
-    return (global float *)(globalVars->clmem0 + vmemloc - globalVars->clmem_vmem_offset0);
+    return (global float *)(globalVars->vmemSegments[(vmemloc >> )" << COCL_VMEM_SEGMENT_SHIFT << R"() - 1] +
+        (vmemloc & )" << (1ull << COCL_VMEM_SEGMENT_SHIFT) - 1 << R"(UL));
 }
 
 )";
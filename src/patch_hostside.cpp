@@ -17,6 +17,7 @@
 #include "cocl/patch_hostside.h"
 
 #include "cocl/cocl_logging.h"
+#include "cocl/cocl_devicell.h"
 
 #include "cocl/mutations.h"
 #include "argparsecpp/argparsecpp.h"
@@ -26,6 +27,7 @@
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/Type.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_os_ostream.h"
@@ -46,6 +48,9 @@ namespace cocl {
 static llvm::LLVMContext context;
 static std::string devicellcode_stringname;
 static string devicellfilename;
+static string devicellformat;
+static std::string devicecl_stringname;
+static string deviceclfilename;
 
 static GlobalNames globalNames;
 static TypeDumper typeDumper(&globalNames);
@@ -518,15 +523,32 @@ void PatchHostside::patchCudaLaunch(
     Instruction *llSourcecodeValue = addStringInstrExistingGlobal(M, devicellcode_stringname);
     llSourcecodeValue->insertBefore(inst->getInst());
 
-    Function *configureKernel = cast<Function>(F->getParent()->getOrInsertFunction(
-        "configureKernel",
-        Type::getVoidTy(context),
-        PointerType::get(IntegerType::get(context, 8), 0),
-        PointerType::get(IntegerType::get(context, 8), 0),
-        // PointerType::get(IntegerType::get(context, 8), 0),
-        NULL));
-    Value *args[] = {kernelNameValue, llSourcecodeValue};
-    CallInst *callConfigureKernel = CallInst::Create(configureKernel, ArrayRef<Value *>(&args[0], &args[2]));
+    CallInst *callConfigureKernel = 0;
+    if(::deviceclfilename != "") {
+        // opencl was generated at build time, so pass that through too
+        Instruction *clSourcecodeValue = addStringInstrExistingGlobal(M, devicecl_stringname);
+        clSourcecodeValue->insertBefore(inst->getInst());
+
+        Function *configureKernel = cast<Function>(F->getParent()->getOrInsertFunction(
+            "configureKernelWithCl",
+            Type::getVoidTy(context),
+            PointerType::get(IntegerType::get(context, 8), 0),
+            PointerType::get(IntegerType::get(context, 8), 0),
+            PointerType::get(IntegerType::get(context, 8), 0),
+            NULL));
+        Value *args[] = {kernelNameValue, llSourcecodeValue, clSourcecodeValue};
+        callConfigureKernel = CallInst::Create(configureKernel, ArrayRef<Value *>(&args[0], &args[3]));
+    } else {
+        Function *configureKernel = cast<Function>(F->getParent()->getOrInsertFunction(
+            "configureKernel",
+            Type::getVoidTy(context),
+            PointerType::get(IntegerType::get(context, 8), 0),
+            PointerType::get(IntegerType::get(context, 8), 0),
+            // PointerType::get(IntegerType::get(context, 8), 0),
+            NULL));
+        Value *args[] = {kernelNameValue, llSourcecodeValue};
+        callConfigureKernel = CallInst::Create(configureKernel, ArrayRef<Value *>(&args[0], &args[2]));
+    }
     callConfigureKernel->insertBefore(inst->getInst());
     Instruction *lastInst = callConfigureKernel;
 
@@ -626,14 +648,35 @@ void PatchHostside::patchModule(Module *M, const Module *MDevice) {
 
     // MDevice is only for information, so we can see the declaration of kernels on the device-side
 
-    ifstream f_inll(::devicellfilename);
-    string devicell_sourcecode(
-        (std::istreambuf_iterator<char>(f_inll)),
-        (std::istreambuf_iterator<char>()));
+    string devicell_sourcecode;
+    if(::devicellformat == "bitcode") {
+        string bitcode;
+        raw_string_ostream bitcodeStream(bitcode);
+        WriteBitcodeToFile(MDevice, bitcodeStream);
+        bitcodeStream.flush();
+        devicell_sourcecode = encodeDeviceBitcode(bitcode, true);
+    } else {
+        ifstream f_inll(::devicellfilename);
+        devicell_sourcecode = string(
+            (std::istreambuf_iterator<char>(f_inll)),
+            (std::istreambuf_iterator<char>()));
+    }
 
     ::devicellcode_stringname = "__devicell_sourcecode" + ::devicellfilename;
     addGlobalVariable(M, devicellcode_stringname, devicell_sourcecode);
 
+    if(::deviceclfilename != "") {
+        ifstream f_incl(::deviceclfilename);
+        if(!f_incl) {
+            throw runtime_error("couldnt open " + ::deviceclfilename);
+        }
+        string devicecl_sourcecode(
+            (std::istreambuf_iterator<char>(f_incl)),
+            (std::istreambuf_iterator<char>()));
+        ::devicecl_stringname = "__devicecl_sourcecode" + ::devicellfilename;
+        addGlobalVariable(M, devicecl_stringname, devicecl_sourcecode);
+    }
+
     for(auto it = M->begin(); it != M->end(); it++) {
         Function *F = &*it;
         PatchHostside::patchFunction(M, MDevice, F);
@@ -653,9 +696,15 @@ int main(int argc, char *argv[]) {
     parser.add_string_argument("--hostrawfile", &rawhostfilename)->required()->help("input file");
     parser.add_string_argument("--devicellfile", &::devicellfilename)->required()->help("input file");
     parser.add_string_argument("--hostpatchedfile", &patchedhostfilename)->required()->help("output file");
+    parser.add_string_argument("--devicellformat", &::devicellformat)->defaultValue("text")->help("how to embed the device code: text or bitcode");
+    parser.add_string_argument("--deviceclfile", &::deviceclfilename)->help("opencl generated by ir-to-opencl --all-kernels, to embed (optional)");
     if(!parser.parse_args(argc, argv)) {
         return -1;
     }
+    if(::devicellformat != "text" && ::devicellformat != "bitcode") {
+        cout << "--devicellformat should be text or bitcode" << endl;
+        return -1;
+    }
 
     std::unique_ptr<llvm::Module> module = parseIRFile(rawhostfilename, smDiagnostic, context);
     if(!module) {
@@ -144,3 +144,8 @@ float ReadIR::readFloatConstant(Value *value) {
     // cout << "res " << res << endl;
     // return valueasdoubletofloat;
 }
+
+bool ReadIR::isDynamicSharedMemory(const llvm::Value *value) {
+    const GlobalVariable *var = dyn_cast<GlobalVariable>(value);
+    return var != 0 && var->getType()->getAddressSpace() == 3 && var->isDeclaration();
+}
@@ -0,0 +1,470 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// microbenchmarks of the host-side costs of the runtime: launching kernels, from one thread, and
+// from several at once, passing args, looking up memory, copying, and building kernels
+// kernels are all trivial, so that the numbers are dominated by the runtime, not by the device,
+// apart from the vmem_gather ones, which measure device loads through pointers read from device memory
+// Runs fine on cpu OpenCL implementations, eg pocl
+//
+// usage: cocl_bench [output.json]
+// results are written as JSON, to stdout, or to output.json if given
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+using namespace std;
+
+struct Params {
+    float scale;
+    float offset;
+    int n;
+    int pad;
+};
+
+__global__ void baseKernel(float *out) {
+    if(threadIdx.x == 1000) {
+        out[0] = 1.0f;
+    }
+}
+
+__global__ void int32Args(float *out, int a0, int a1, int a2, int a3, int a4, int a5, int a6, int a7) {
+    if(a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 == -1) {
+        out[0] = 1.0f;
+    }
+}
+
+__global__ void int64Args(float *out, long long a0, long long a1, long long a2, long long a3,
+        long long a4, long long a5, long long a6, long long a7) {
+    if(a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 == -1) {
+        out[0] = 1.0f;
+    }
+}
+
+__global__ void floatArgs(float *out, float a0, float a1, float a2, float a3, float a4, float a5, float a6, float a7) {
+    if(a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 == -1.0f) {
+        out[0] = 1.0f;
+    }
+}
+
+__global__ void pointerArgs(float *out, float *a0, float *a1, float *a2, float *a3, float *a4, float *a5, float *a6, float *a7) {
+    if(threadIdx.x == 1000) {
+        a0[0] = a1[0] + a2[0] + a3[0] + a4[0] + a5[0] + a6[0] + a7[0];
+    }
+}
+
+__global__ void structArg(float *out, Params p0) {
+    if(p0.n == -1) {
+        out[0] = p0.scale + p0.offset;
+    }
+}
+
+__global__ void structArgs(float *out, Params p0, Params p1, Params p2, Params p3) {
+    if(p0.n + p1.n + p2.n + p3.n == -1) {
+        out[0] = p0.scale + p1.scale + p2.scale + p3.scale;
+    }
+}
+
+__global__ void gatherDirect(float *out, float *data, int numRows, int rowLength) {
+    int tid = blockIdx.x * blockDim.x + threadIdx.x;
+    float sum = 0.0f;
+    for(int r = 0; r < numRows; r++) {
+        sum += data[r * rowLength + tid];
+    }
+    out[tid] = sum;
+}
+
+// rows is in device memory, so each rows[r] is a vmem pointer, which the kernel maps back to a buffer
+__global__ void gatherPointers(float *out, float **rows, int numRows) {
+    int tid = blockIdx.x * blockDim.x + threadIdx.x;
+    float sum = 0.0f;
+    for(int r = 0; r < numRows; r++) {
+        sum += rows[r][tid];
+    }
+    out[tid] = sum;
+}
+
+// each instantiation is a different kernel, so its first launch misses the kernel cache
+template<int N>
+__global__ void cacheKernel(float *out) {
+    if(threadIdx.x == 1000) {
+        out[0] = N;
+    }
+}
+
+class Results {
+public:
+    void add(string name, double value, string unit) {
+        entries.push_back(Entry { name, value, unit });
+        cerr << name << ": " << value << " " << unit << endl;
+    }
+    string json() {
+        ostringstream ss;
+        ss << "{\n  \"benchmarks\": [";
+        for(size_t i = 0; i < entries.size(); i++) {
+            ss << (i == 0 ? "\n" : ",\n");
+            ss << "    {\"name\": \"" << entries[i].name << "\", \"value\": " << entries[i].value
+                << ", \"unit\": \"" << entries[i].unit << "\"}";
+        }
+        ss << "\n  ]\n}\n";
+        return ss.str();
+    }
+private:
+    struct Entry {
+        string name;
+        double value;
+        string unit;
+    };
+    vector<Entry> entries;
+};
+
+// runs fn its times, repeats that a few times, and returns the median time per call, in ns
+// fn should queue work, and not wait for it. We wait once, at the end of each repeat
+double timeNs(int its, function<void()> fn) {
+    fn();
+    cudaDeviceSynchronize();
+    vector<double> times;
+    for(int repeat = 0; repeat < 5; repeat++) {
+        auto start = chrono::steady_clock::now();
+        for(int it = 0; it < its; it++) {
+            fn();
+        }
+        cudaDeviceSynchronize();
+        auto end = chrono::steady_clock::now();
+        times.push_back(chrono::duration<double, nano>(end - start).count() / its);
+    }
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+void benchLaunch(Results &results, float *out) {
+    double enqueueNs = timeNs(2000, [=]() {
+        baseKernel<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out);
+    });
+    results.add("launch_enqueue", enqueueNs, "ns/launch");
+    double syncNs = timeNs(500, [=]() {
+        baseKernel<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out);
+        cudaDeviceSynchronize();
+    });
+    results.add("launch_sync", syncNs, "ns/launch");
+}
+
+// each thread launches on a stream of its own. Launch state is per-thread, so total throughput
+// should scale close to linearly, until the device itself is the bottleneck
+const int threadLaunches = 1000;
+
+struct LaunchGate {
+    mutex mu;
+    condition_variable cond;
+    int numReady = 0;
+    bool open = false;
+};
+
+void launchThread(LaunchGate *gate, chrono::steady_clock::time_point *start, chrono::steady_clock::time_point *end) {
+    cudaStream_t stream;
+    cudaStreamCreate(&stream);
+    float *out;
+    cudaMalloc((void **)&out, 1024);
+    // warm up, so that the kernel is already built
+    baseKernel<<<dim3(1, 1, 1), dim3(32, 1, 1), 0, stream>>>(out);
+    cudaStreamSynchronize(stream);
+    {
+        unique_lock<mutex> lock(gate->mu);
+        gate->numReady++;
+        gate->cond.notify_all();
+        gate->cond.wait(lock, [gate]() { return gate->open; });
+    }
+    *start = chrono::steady_clock::now();
+    for(int it = 0; it < threadLaunches; it++) {
+        baseKernel<<<dim3(1, 1, 1), dim3(32, 1, 1), 0, stream>>>(out);
+    }
+    cudaStreamSynchronize(stream);
+    *end = chrono::steady_clock::now();
+    cudaFree(out);
+    cudaStreamDestroy(stream);
+}
+
+// returns ns per launch, over all threads together
+double timeThreadLaunchesNs(int numThreads) {
+    LaunchGate gate;
+    vector<chrono::steady_clock::time_point> starts(numThreads);
+    vector<chrono::steady_clock::time_point> ends(numThreads);
+    vector<thread> threads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(thread(launchThread, &gate, &starts[i], &ends[i]));
+    }
+    {
+        unique_lock<mutex> lock(gate.mu);
+        gate.cond.wait(lock, [&gate, numThreads]() { return gate.numReady == numThreads; });
+        gate.open = true;
+        gate.cond.notify_all();
+    }
+    for(int i = 0; i < numThreads; i++) {
+        threads[i].join();
+    }
+    auto start = *min_element(starts.begin(), starts.end());
+    auto end = *max_element(ends.begin(), ends.end());
+    return chrono::duration<double, nano>(end - start).count() / (numThreads * threadLaunches);
+}
+
+void benchThreads(Results &results) {
+    double baseNs = 0;
+    for(int numThreads = 1; numThreads <= 8; numThreads *= 2) {
+        double ns = timeThreadLaunchesNs(numThreads);
+        if(numThreads == 1) {
+            baseNs = ns;
+        }
+        ostringstream name;
+        name << "launch_threads_" << numThreads;
+        results.add(name.str(), ns, "ns/launch");
+        results.add(name.str() + "_speedup", baseNs / ns, "x");
+    }
+}
+
+void benchArgs(Results &results, float *out) {
+    const int its = 2000;
+    double baseNs = timeNs(its, [=]() {
+        baseKernel<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out);
+    });
+    double int32Ns = timeNs(its, [=]() {
+        int32Args<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out, 1, 2, 3, 4, 5, 6, 7, 8);
+    });
+    results.add("arg_int32", (int32Ns - baseNs) / 8, "ns/arg");
+    double int64Ns = timeNs(its, [=]() {
+        int64Args<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out, 1, 2, 3, 4, 5, 6, 7, 8);
+    });
+    results.add("arg_int64", (int64Ns - baseNs) / 8, "ns/arg");
+    double floatNs = timeNs(its, [=]() {
+        floatArgs<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out, 1, 2, 3, 4, 5, 6, 7, 8);
+    });
+    results.add("arg_float", (floatNs - baseNs) / 8, "ns/arg");
+
+    vector<float *> buffers(8);
+    for(int i = 0; i < 8; i++) {
+        cudaMalloc((void **)&buffers[i], 1024);
+    }
+    double pointerNs = timeNs(its, [=]() {
+        pointerArgs<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out, buffers[0], buffers[1], buffers[2], buffers[3],
+            buffers[4], buffers[5], buffers[6], buffers[7]);
+    });
+    results.add("arg_pointer", (pointerNs - baseNs) / 8, "ns/arg");
+    for(int i = 0; i < 8; i++) {
+        cudaFree(buffers[i]);
+    }
+
+    Params params = { 1.0f, 2.0f, 3, 0 };
+    double structNs = timeNs(its, [=]() {
+        structArg<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out, params);
+    });
+    results.add("arg_struct", structNs - baseNs, "ns/arg");
+    double structsNs = timeNs(its, [=]() {
+        structArgs<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out, params, params, params, params);
+    });
+    results.add("launch_4_structs", structsNs, "ns/launch");
+}
+
+void benchFindMemory(Results &results) {
+    int counts[] = {1, 16, 256, 4096};
+    for(int c = 0; c < 4; c++) {
+        int count = counts[c];
+        vector<char *> allocations(count);
+        for(int i = 0; i < count; i++) {
+            cudaMalloc((void **)&allocations[i], 256);
+        }
+        // step through the allocations, so we dont just hit the per-thread last-found cache
+        const int lookups = 100000;
+        vector<char *> pointers(lookups);
+        for(int i = 0; i < lookups; i++) {
+            pointers[i] = allocations[(i * 7919) % count] + (i % 256);
+        }
+        auto start = chrono::steady_clock::now();
+        size_t found = 0;
+        for(int i = 0; i < lookups; i++) {
+            found += cocl::findMemory(pointers[i]) != 0;
+        }
+        auto end = chrono::steady_clock::now();
+        if(found != (size_t)lookups) {
+            throw runtime_error("findMemory didnt find all the allocations");
+        }
+        ostringstream name;
+        name << "find_memory_" << count << "_allocs";
+        results.add(name.str(), chrono::duration<double, nano>(end - start).count() / lookups, "ns/lookup");
+        for(int i = 0; i < count; i++) {
+            cudaFree(allocations[i]);
+        }
+    }
+}
+
+void benchCopies(Results &results) {
+    size_t sizes[] = {4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+    for(int s = 0; s < 4; s++) {
+        size_t bytes = sizes[s];
+        int its = (int)max((size_t)4, (size_t)(64 * 1024 * 1024) / bytes);
+        vector<char> host(bytes, 1);
+        char *device;
+        cudaMalloc((void **)&device, bytes);
+        char *hostData = &host[0];
+
+        ostringstream suffix;
+        suffix << "_" << (bytes / 1024) << "kb";
+        double htodNs = timeNs(its, [=]() {
+            cudaMemcpy(device, hostData, bytes, cudaMemcpyHostToDevice);
+        });
+        results.add("memcpy_htod" + suffix.str(), bytes / htodNs, "GB/s");
+        double dtohNs = timeNs(its, [=]() {
+            cudaMemcpy(hostData, device, bytes, cudaMemcpyDeviceToHost);
+        });
+        results.add("memcpy_dtoh" + suffix.str(), bytes / dtohNs, "GB/s");
+        double memsetNs = timeNs(its, [=]() {
+            cudaMemsetAsync(device, 0, bytes, 0);
+        });
+        results.add("memset" + suffix.str(), bytes / memsetNs, "GB/s");
+        cudaFree(device);
+    }
+}
+
+void benchVmem(Results &results) {
+    // the same sum, over numRows rows, read directly, then through a float **, with the rows in one
+    // allocation, then with each row in an allocation of its own
+    const int numRows = 64;
+    const int rowLength = 64 * 1024;
+    const int its = 20;
+    const double loads = (double)numRows * rowLength;
+    float *sums;
+    cudaMalloc((void **)&sums, rowLength * sizeof(float));
+    float *data;
+    cudaMalloc((void **)&data, numRows * rowLength * sizeof(float));
+    cudaMemset(data, 0, numRows * rowLength * sizeof(float));
+    float **rows;
+    cudaMalloc((void **)&rows, numRows * sizeof(float *));
+    dim3 grid(rowLength / 256, 1, 1);
+    dim3 block(256, 1, 1);
+
+    double directNs = timeNs(its, [=]() {
+        gatherDirect<<<grid, block>>>(sums, data, numRows, rowLength);
+    });
+    results.add("vmem_gather_direct", directNs / loads, "ns/load");
+
+    vector<float *> hostRows(numRows);
+    for(int r = 0; r < numRows; r++) {
+        hostRows[r] = data + r * rowLength;
+    }
+    cudaMemcpy(rows, &hostRows[0], numRows * sizeof(float *), cudaMemcpyHostToDevice);
+    double oneBufferNs = timeNs(its, [=]() {
+        gatherPointers<<<grid, block>>>(sums, rows, numRows);
+    });
+    results.add("vmem_gather_1_buffer", oneBufferNs / loads, "ns/load");
+
+    for(int r = 0; r < numRows; r++) {
+        cudaMalloc((void **)&hostRows[r], rowLength * sizeof(float));
+        cudaMemset(hostRows[r], 0, rowLength * sizeof(float));
+    }
+    cudaMemcpy(rows, &hostRows[0], numRows * sizeof(float *), cudaMemcpyHostToDevice);
+    double manyBuffersNs = timeNs(its, [=]() {
+        gatherPointers<<<grid, block>>>(sums, rows, numRows);
+    });
+    ostringstream suffix;
+    suffix << "_" << numRows << "_buffers";
+    results.add("vmem_gather" + suffix.str(), manyBuffersNs / loads, "ns/load");
+
+    // host-side cost of passing in every vmem segment
+    double launchNs = timeNs(2000, [=]() {
+        gatherPointers<<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(sums, rows, 0);
+    });
+    results.add("launch_vmem" + suffix.str(), launchNs, "ns/launch");
+
+    for(int r = 0; r < numRows; r++) {
+        cudaFree(hostRows[r]);
+    }
+    cudaFree(rows);
+    cudaFree(data);
+    cudaFree(sums);
+}
+
+template<int N>
+double timeFirstLaunchMs(float *out) {
+    auto start = chrono::steady_clock::now();
+    cacheKernel<N><<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out);
+    cudaDeviceSynchronize();
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+void benchKernelCache(Results &results, float *out) {
+    // misses include generating the OpenCL, and building it. main turns off the on-disk program
+    // cache, else a second run would load the binaries, and time that instead
+    vector<double> missMs;
+    missMs.push_back(timeFirstLaunchMs<0>(out));
+    missMs.push_back(timeFirstLaunchMs<1>(out));
+    missMs.push_back(timeFirstLaunchMs<2>(out));
+    missMs.push_back(timeFirstLaunchMs<3>(out));
+    missMs.push_back(timeFirstLaunchMs<4>(out));
+    sort(missMs.begin(), missMs.end());
+    results.add("kernel_cache_miss", missMs[missMs.size() / 2], "ms/launch");
+    double hitNs = timeNs(500, [=]() {
+        cacheKernel<0><<<dim3(1, 1, 1), dim3(32, 1, 1)>>>(out);
+        cudaDeviceSynchronize();
+    });
+    results.add("kernel_cache_hit", hitNs / 1000000.0, "ms/launch");
+}
+
+int main(int argc, char *argv[]) {
+    // read when the first kernel is built
+    setenv("COCL_KERNEL_CACHE", "0", 1);
+
+    float *out;
+    cudaMalloc((void **)&out, 1024);
+
+    Results results;
+    try {
+        benchLaunch(results, out);
+        benchThreads(results);
+        benchArgs(results, out);
+        // before benchFindMemory, so that its thousands of allocations are all freed again, and
+        // dont affect the vmem segment table
+        benchVmem(results);
+        benchFindMemory(results);
+        benchCopies(results);
+        benchKernelCache(results, out);
+    } catch(const exception &e) {
+        // no JSON, so that run-cocl-bench, and CI, fail, rather than record partial results
+        cerr << "cocl_bench failed: " << e.what() << endl;
+        return 1;
+    }
+
+    cudaFree(out);
+
+    if(argc > 1) {
+        ofstream f(argv[1]);
+        f << results.json();
+        cerr << "wrote " << argv[1] << endl;
+    } else {
+        cout << results.json();
+    }
+    return 0;
+}
@@ -0,0 +1,218 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// throughput of the IR to OpenCL translation, over a set of device .ll files, eg the ones in test/
+// and test/tf. Every kernel in each file is converted, the same way `ir-to-opencl --all-kernels`
+// does it, and the time is split into phases:
+// - parse: parsing the textual IR, once per file
+// - load: reading the parsed module back from bitcode, once per kernel, as the runtime does
+// - generate: FunctionDumper::runGeneration, over all the functions each kernel needs
+// - emit: the rest of KernelDumper::toCl, ie writing out the OpenCL
+// Needs no OpenCL device
+//
+// usage: ir_to_opencl_bench [--out results.json] [--history history.jsonl] file1.ll [file2.ll ...]
+// results are written as JSON, to stdout, or to results.json if given. With --history, the
+// results are also appended, as a single line, with a timestamp, so they can be tracked over time
+
+#include "cocl/ir-to-opencl.h"
+#include "cocl/kernel_dumper.h"
+
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+
+#include <sys/resource.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+class Totals {
+public:
+    int files = 0;
+    int kernels = 0;
+    int failedKernels = 0;
+    size_t clBytes = 0;
+    double parseSeconds = 0;
+    double loadSeconds = 0;
+    double generateSeconds = 0;
+    double emitSeconds = 0;
+};
+
+double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// peak resident set size of this process so far, in MB
+double peakRssMb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024.0 / 1024.0;  // bytes
+#else
+    return usage.ru_maxrss / 1024.0;  // kilobytes
+#endif
+}
+
+void benchFile(Totals &totals, string filepath) {
+    ifstream f(filepath.c_str());
+    if(!f) {
+        throw runtime_error("couldnt open " + filepath);
+    }
+    ostringstream contents;
+    contents << f.rdbuf();
+    string llString = contents.str();
+
+    string bitcode;
+    vector<pair<string, int> > kernels;
+    {
+        auto parseStart = chrono::steady_clock::now();
+        llvm::LLVMContext context;
+        llvm::SMDiagnostic smDiagnostic;
+        unique_ptr<llvm::MemoryBuffer> llMemoryBuffer = llvm::MemoryBuffer::getMemBuffer(llString);
+        unique_ptr<llvm::Module> M = llvm::parseIR(llMemoryBuffer->getMemBufferRef(), smDiagnostic, context);
+        if(!M) {
+            smDiagnostic.print("ir_to_opencl_bench", llvm::errs());
+            throw runtime_error("failed to parse " + filepath);
+        }
+        totals.parseSeconds += secondsSince(parseStart);
+
+        llvm::raw_string_ostream bitcodeStream(bitcode);
+        llvm::WriteBitcodeToFile(M.get(), bitcodeStream);
+        bitcodeStream.flush();
+        vector<string> kernelNames = cocl::getKernelNames(M.get());
+        for(auto it=kernelNames.begin(); it != kernelNames.end(); it++) {
+            kernels.push_back(make_pair(*it, cocl::countKernelClmemArgs(M->getFunction(*it))));
+        }
+    }
+    totals.files++;
+
+    for(auto it=kernels.begin(); it != kernels.end(); it++) {
+        string kernelName = it->first;
+        int numClmemArgs = it->second;
+        // same buffer layout as convertAllKernelsToClTable: each pointer arg in its own buffer
+        vector<int> clmemIndexByClmemArgIndex;
+        for(int i = 0; i < numClmemArgs; i++) {
+            clmemIndexByClmemArgIndex.push_back(i + 1);
+        }
+
+        auto loadStart = chrono::steady_clock::now();
+        llvm::LLVMContext context;
+        llvm::Expected<unique_ptr<llvm::Module> > M = llvm::parseBitcodeFile(
+            llvm::MemoryBufferRef(bitcode, filepath), context);
+        if(!M) {
+            llvm::logAllUnhandledErrors(M.takeError(), llvm::errs(), "ir_to_opencl_bench: ");
+            throw runtime_error("failed to read back bitcode for " + filepath);
+        }
+        totals.loadSeconds += secondsSince(loadStart);
+
+        auto convertStart = chrono::steady_clock::now();
+        cocl::KernelDumper kernelDumper(M->get(), kernelName, cocl::getShortKernelName(kernelName), false);
+        kernelDumper.addIRToCl();
+        try {
+            string cl = kernelDumper.toCl(numClmemArgs + 1, clmemIndexByClmemArgIndex);
+            double convertSeconds = secondsSince(convertStart);
+            totals.generateSeconds += kernelDumper.generateSeconds;
+            totals.emitSeconds += convertSeconds - kernelDumper.generateSeconds;
+            totals.clBytes += cl.size();
+            totals.kernels++;
+        } catch(const runtime_error &e) {
+            // some of the corpus uses things we dont support yet. Count them, and carry on, so
+            // one bad kernel doesnt hide changes in the rest
+            cerr << "failed to convert " << kernelName << " in " << filepath << ": " << e.what() << endl;
+            totals.failedKernels++;
+        }
+    }
+    cerr << filepath << ": " << kernels.size() << " kernels" << endl;
+}
+
+string resultsJson(const Totals &totals, double totalSeconds, bool oneLine) {
+    const char *nl = oneLine ? " " : "\n  ";
+    double convertSeconds = totals.generateSeconds + totals.emitSeconds;
+    ostringstream ss;
+    ss << "{";
+    if(oneLine) {
+        ss << " \"timestamp\": " << time(0) << ",";
+    }
+    ss << nl << "\"files\": " << totals.files << ",";
+    ss << nl << "\"kernels\": " << totals.kernels << ",";
+    ss << nl << "\"failed_kernels\": " << totals.failedKernels << ",";
+    ss << nl << "\"kernels_per_sec\": " << (totalSeconds > 0 ? totals.kernels / totalSeconds : 0) << ",";
+    ss << nl << "\"convert_kernels_per_sec\": " << (convertSeconds > 0 ? totals.kernels / convertSeconds : 0) << ",";
+    ss << nl << "\"parse_ms\": " << totals.parseSeconds * 1000 << ",";
+    ss << nl << "\"load_ms\": " << totals.loadSeconds * 1000 << ",";
+    ss << nl << "\"generate_ms\": " << totals.generateSeconds * 1000 << ",";
+    ss << nl << "\"emit_ms\": " << totals.emitSeconds * 1000 << ",";
+    ss << nl << "\"total_ms\": " << totalSeconds * 1000 << ",";
+    ss << nl << "\"cl_bytes\": " << totals.clBytes << ",";
+    ss << nl << "\"peak_rss_mb\": " << peakRssMb();
+    ss << (oneLine ? " }" : "\n}");
+    return ss.str();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    string outPath;
+    string historyPath;
+    vector<string> filepaths;
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if((arg == "--out" || arg == "--history") && i + 1 < argc) {
+            (arg == "--out" ? outPath : historyPath) = argv[++i];
+        } else {
+            filepaths.push_back(arg);
+        }
+    }
+    if(filepaths.size() == 0) {
+        cerr << "usage: " << argv[0] << " [--out results.json] [--history history.jsonl] file1.ll [file2.ll ...]" << endl;
+        return 1;
+    }
+
+    Totals totals;
+    auto start = chrono::steady_clock::now();
+    for(auto it=filepaths.begin(); it != filepaths.end(); it++) {
+        benchFile(totals, *it);
+    }
+    double totalSeconds = secondsSince(start);
+
+    string json = resultsJson(totals, totalSeconds, false);
+    if(outPath != "") {
+        ofstream f(outPath.c_str());
+        f << json << "\n";
+        cerr << "wrote " << outPath << endl;
+    } else {
+        cout << json << endl;
+    }
+    if(historyPath != "") {
+        ofstream f(historyPath.c_str(), ios_base::app);
+        f << resultsJson(totals, totalSeconds, true) << "\n";
+        cerr << "appended to " << historyPath << endl;
+    }
+    return 0;
+}
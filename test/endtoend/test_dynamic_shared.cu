@@ -0,0 +1,86 @@
+// tests extern __shared__ memory, sized at launch
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+// sums each block's values, via a tree reduction in dynamic shared memory
+__global__ void blockSums(float *out, float *in) {
+    extern __shared__ float partials[];
+    int tid = threadIdx.x;
+    partials[tid] = in[blockIdx.x * blockDim.x + tid];
+    __syncthreads();
+    for(int stride = blockDim.x >> 1; stride > 0; stride >>= 1) {
+        if(tid < stride) {
+            partials[tid] += partials[tid + stride];
+        }
+        __syncthreads();
+    }
+    if(tid == 0) {
+        out[blockIdx.x] = partials[0];
+    }
+}
+
+void testBlockSums(int blockSize) {
+    const int numBlocks = 16;
+    const int N = numBlocks * blockSize;
+    vector<float> hostIn(N);
+    for(int i = 0; i < N; i++) {
+        hostIn[i] = (float)(i % 7);
+    }
+    float *in;
+    float *out;
+    cudaMalloc((void **)&in, N * sizeof(float));
+    cudaMalloc((void **)&out, numBlocks * sizeof(float));
+    cudaMemcpy(in, &hostIn[0], N * sizeof(float), cudaMemcpyHostToDevice);
+
+    blockSums<<<dim3(numBlocks, 1, 1), dim3(blockSize, 1, 1), blockSize * sizeof(float)>>>(out, in);
+
+    vector<float> hostOut(numBlocks);
+    cudaMemcpy(&hostOut[0], out, numBlocks * sizeof(float), cudaMemcpyDeviceToHost);
+    for(int b = 0; b < numBlocks; b++) {
+        float expected = 0;
+        for(int i = 0; i < blockSize; i++) {
+            expected += hostIn[b * blockSize + i];
+        }
+        if(hostOut[b] != expected) {
+            ostringstream ss;
+            ss << "blockSize " << blockSize << " block " << b << ": got " << hostOut[b] << ", expected " << expected;
+            throw runtime_error(ss.str());
+        }
+    }
+    cout << "blockSize " << blockSize << " ok" << endl;
+    cudaFree(in);
+    cudaFree(out);
+}
+
+int main(int argc, char *argv[]) {
+    // the same kernel, with different amounts of shared memory
+    testBlockSums(32);
+    testBlockSums(128);
+
+    // asking for more than the device has should fail
+    cudaDeviceProp prop;
+    cudaGetDeviceProperties(&prop, 0);
+    float *buffer;
+    cudaMalloc((void **)&buffer, 128 * sizeof(float));
+    bool threw = false;
+    try {
+        blockSums<<<dim3(1, 1, 1), dim3(32, 1, 1), prop.sharedMemPerBlock + 1>>>(buffer, buffer);
+    } catch(runtime_error &e) {
+        cout << "got expected error: " << e.what() << endl;
+        threw = true;
+    }
+    cudaFree(buffer);
+    if(!threw) {
+        throw runtime_error("launch with too much shared memory should have failed");
+    }
+    cout << "finished" << endl;
+    return 0;
+}
@@ -1,10 +1,12 @@
 // double indirection, ie float **, in kernel parameter
 
-// this test cuts all gpu buffers from one single gpu buffer
+// test1 to test3 cut all gpu buffers from one single gpu buffer. test4 uses a separate allocation
+// for each buffer
 
 #include <iostream>
 #include <memory>
 #include <cassert>
+#include <vector>
 
 using namespace std;
 
@@ -218,9 +220,80 @@ void test3_unbounded() {
     std::cout << "finished test3_unbounded" << std::endl;
 }
 
+__global__ void run_pointer_table(float **buffers, int numBuffers, int N) {
+    int j = threadIdx.x;
+    for(int i = 0; i < numBuffers; i++) {
+        buffers[i][j] = buffers[i][j] * 2.0f + i;
+    }
+}
+
+void test4_multiple_allocations() {
+    const int N = 32;
+    const int numBuffers = 5;
+
+    // some other allocation, which we free, so that the buffers arent all in consecutive segments
+    float *spare;
+    cudaMalloc((void **)&spare, 1024);
+
+    float *buffers[numBuffers];
+    float hostFloats[N];
+    for(int i = 0; i < numBuffers; i++) {
+        cudaMalloc((void **)&buffers[i], N * sizeof(float));
+        for(int j = 0; j < N; j++) {
+            hostFloats[j] = (float)(i * 100 + j);
+        }
+        cudaMemcpy(buffers[i], hostFloats, N * sizeof(float), cudaMemcpyHostToDevice);
+        if(i == 2) {
+            cudaFree(spare);
+        }
+    }
+    float **gpuBuffers;
+    cudaMalloc((void **)&gpuBuffers, numBuffers * sizeof(float *));
+    cudaMemcpy(gpuBuffers, buffers, numBuffers * sizeof(float *), cudaMemcpyHostToDevice);
+
+    // twice, so we check both the first launch, and the cached kernel
+    for(int it = 0; it < 2; it++) {
+        run_pointer_table<<<dim3(1,1,1), dim3(N,1,1)>>>(gpuBuffers, numBuffers, N);
+    }
+
+    for(int i = 0; i < numBuffers; i++) {
+        cudaMemcpy(hostFloats, buffers[i], N * sizeof(float), cudaMemcpyDeviceToHost);
+        for(int j = 0; j < N; j++) {
+            float expected = ((i * 100 + j) * 2.0f + i) * 2.0f + i;
+            if(hostFloats[j] != expected) {
+                std::cout << "mismatch for i=" << i << " j=" << j << " expected=" << expected << " actual=" << hostFloats[j] << std::endl;
+                assert(false);
+            }
+        }
+    }
+
+    cudaFree(gpuBuffers);
+    for(int i = 0; i < numBuffers; i++) {
+        cudaFree(buffers[i]);
+    }
+    std::cout << "finished test4_multiple_allocations" << std::endl;
+}
+
+void test5_after_many_allocations() {
+    // more allocations than the segment table could pass to a kernel, all freed again. Freed
+    // segments at the end of the table are dropped, so float ** kernels should still run
+    const int numAllocations = 4096;
+    vector<float *> allocations(numAllocations);
+    for(int i = 0; i < numAllocations; i++) {
+        cudaMalloc((void **)&allocations[i], 256);
+    }
+    for(int i = 0; i < numAllocations; i++) {
+        cudaFree(allocations[i]);
+    }
+    test4_multiple_allocations();
+    std::cout << "finished test5_after_many_allocations" << std::endl;
+}
+
 int main(int argc, char *argv[]) {
     test1();
     test2_bounded();
+    test4_multiple_allocations();
+    test5_after_many_allocations();
     // test3_unbounded();
     return 0;
 }
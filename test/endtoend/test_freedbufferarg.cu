@@ -0,0 +1,50 @@
+// tests launching a kernel again, after freeing the buffer it last ran on, and allocating a new one,
+// which the driver may well give the same cl_mem handle
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+
+using namespace std;
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+__global__ void setValues(float *data, float value, int N) {
+    int tid = blockIdx.x * blockDim.x + threadIdx.x;
+    if(tid < N) {
+        data[tid] = value + tid;
+    }
+}
+
+void check(float *values, int N, float value) {
+    for(int i = 0; i < N; i++) {
+        if(values[i] != value + i) {
+            ostringstream ss;
+            ss << "values[" << i << "] is " << values[i] << ", expected " << (value + i);
+            throw runtime_error(ss.str());
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // without the memory pool, cudaFree really releases the cl_mem
+    setenv("COCL_MEMORY_POOL", "0", 1);
+
+    const int N = 1024;
+    float *hostValues = new float[N];
+    for(int it = 0; it < 4; it++) {
+        float *gpuValues;
+        cudaMalloc((void **)&gpuValues, N * sizeof(float));
+        // same kernel, same args, apart from the buffer
+        setValues<<<dim3(N / 32, 1, 1), dim3(32, 1, 1)>>>(gpuValues, 123.0f, N);
+        cudaMemcpy(hostValues, gpuValues, N * sizeof(float), cudaMemcpyDeviceToHost);
+        check(hostValues, N, 123.0f);
+        cout << "iteration " << it << " ok" << endl;
+        cudaFree(gpuValues);
+    }
+    delete[] hostValues;
+    cout << "finished" << endl;
+    return 0;
+}
@@ -44,8 +44,45 @@ void testfloatstar() {
     cuStreamDestroy(stream);
 }
 
+// launches with the pointer args in the same buffer, and in different buffers, need different
+// kernels, and each should only be built once
+void testaliasing() {
+    int N = 1024;
+    int cachedBefore = cocl::getNumCachedKernels();
+    int callsBefore = cocl::getNumKernelCalls();
+
+    CUstream stream;
+    cuStreamCreate(&stream, 0);
+
+    CUdeviceptr deviceFloats1;
+    CUdeviceptr deviceFloats2;
+    cuMemAlloc(&deviceFloats1, N * sizeof(float));
+    cuMemAlloc(&deviceFloats2, N * sizeof(float));
+
+    getValue<<<dim3(1,1,1), dim3(32,1,1), 0, stream>>>(((float *)deviceFloats1), ((float *)deviceFloats2));
+    getValue<<<dim3(1,1,1), dim3(32,1,1), 0, stream>>>(((float *)deviceFloats1), ((float *)deviceFloats1));
+    getValue<<<dim3(1,1,1), dim3(32,1,1), 0, stream>>>(((float *)deviceFloats1), ((float *)deviceFloats2));
+    getValue<<<dim3(1,1,1), dim3(32,1,1), 0, stream>>>(((float *)deviceFloats1), ((float *)deviceFloats1));
+    cuStreamSynchronize(stream);
+
+    cout << "num kernels cached " << cocl::getNumCachedKernels() << endl;
+    cout << "num kernel calls " << cocl::getNumKernelCalls() << endl;
+
+    assert(cocl::getNumCachedKernels() == cachedBefore + 2);
+    assert(cocl::getNumKernelCalls() == callsBefore + 4);
+
+    float hostFloat = 0;
+    cuMemcpyDtoH(&hostFloat, deviceFloats1, sizeof(float));
+    assert(hostFloat == 2.0f);
+
+    cuMemFree(deviceFloats1);
+    cuMemFree(deviceFloats2);
+    cuStreamDestroy(stream);
+}
+
 int main(int argc, char *argv[]) {
     testfloatstar();
+    testaliasing();
     return 0;
 }
 
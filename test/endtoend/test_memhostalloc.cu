@@ -40,6 +40,14 @@ int main(int argc, char *argv[]) {
     cout << "hostFloats[2] " << hostFloats[2] << endl;
     assert(hostFloats[2] == 12);
 
+    // kernels can use the host memory directly, via its device pointer
+    float *mappedFloats;
+    cudaHostGetDevicePointer((void **)&mappedFloats, hostFloats, 0);
+    incrValue<<<dim3(32, 1, 1), dim3(32, 1, 1), 0, stream>>>(mappedFloats, 2, 10.0f);
+    cuStreamSynchronize(stream);
+    cout << "hostFloats[2] " << hostFloats[2] << endl;
+    assert(hostFloats[2] == 22);
+
     cuMemFreeHost(hostFloats);
     cuMemFree(deviceFloats);
     cuStreamDestroy(stream);
@@ -0,0 +1,116 @@
+// tests cuMemcpyHtoDAsync and cuMemcpyDtoHAsync are non-blocking, by double-buffering a
+// copy-in/compute/copy-out pipeline across two streams, and comparing against doing the same work
+// one chunk at a time, synchronizing after each
+// results should be identical. The double-buffered run should be faster, if the device can overlap
+// copies with compute (eg cpu opencl devices can)
+
+#include <iostream>
+#include <chrono>
+#include <stdexcept>
+
+using namespace std;
+
+#include <cuda.h>
+
+__global__ void squareMany(float *data, int N, int its) {
+    int tid = blockIdx.x * blockDim.x + threadIdx.x;
+    if(tid < N) {
+        float value = data[tid];
+        for(int it = 0; it < its; it++) {
+            value = value * 0.999f + 0.001f;
+        }
+        data[tid] = value;
+    }
+}
+
+const int numChunks = 16;
+const int chunkSize = 1024 * 256;
+const int its = 200;
+
+float expectedValue(float value) {
+    for(int it = 0; it < its; it++) {
+        value = value * 0.999f + 0.001f;
+    }
+    return value;
+}
+
+// run all the chunks through streams[i % numStreams], using deviceBuffers[i % numStreams]
+// returns time in milliseconds
+double runPipeline(float *hostIn, float *hostOut, CUstream *streams, CUdeviceptr *deviceBuffers, int numStreams) {
+    auto start = chrono::steady_clock::now();
+    for(int chunk = 0; chunk < numChunks; chunk++) {
+        int s = chunk % numStreams;
+        // the device buffer mustnt be overwritten until the previous chunk has been copied out
+        // of it. Thats on the same stream, so the stream does this for us
+        cuMemcpyHtoDAsync(deviceBuffers[s], hostIn + chunk * chunkSize, chunkSize * sizeof(float), streams[s]);
+        squareMany<<<dim3(chunkSize / 256, 1, 1), dim3(256, 1, 1), 0, streams[s]>>>(
+            (float *)deviceBuffers[s], chunkSize, its);
+        cuMemcpyDtoHAsync(hostOut + chunk * chunkSize, deviceBuffers[s], chunkSize * sizeof(float), streams[s]);
+        if(numStreams == 1) {
+            cuStreamSynchronize(streams[s]);
+        }
+    }
+    for(int s = 0; s < numStreams; s++) {
+        cuStreamSynchronize(streams[s]);
+    }
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+void checkResults(float *hostIn, float *hostOut) {
+    for(int i = 0; i < numChunks * chunkSize; i += 997) {
+        float expected = expectedValue(hostIn[i]);
+        float diff = hostOut[i] - expected;
+        if(diff > 1e-4f || diff < -1e-4f) {
+            cout << "mismatch at " << i << ": " << hostOut[i] << " expected " << expected << endl;
+            throw runtime_error("mismatch");
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const int N = numChunks * chunkSize;
+
+    CUstream streams[2];
+    CUdeviceptr deviceBuffers[2];
+    for(int s = 0; s < 2; s++) {
+        cuStreamCreate(&streams[s], 0);
+        cuMemAlloc(&deviceBuffers[s], chunkSize * sizeof(float));
+    }
+
+    float *hostIn;
+    float *hostOut;
+    cuMemHostAlloc((void **)&hostIn, N * sizeof(float), CU_MEMHOSTALLOC_PORTABLE);
+    cuMemHostAlloc((void **)&hostOut, N * sizeof(float), CU_MEMHOSTALLOC_PORTABLE);
+    for(int i = 0; i < N; i++) {
+        hostIn[i] = (i % 1000) / 1000.0f;
+    }
+
+    // warm up, so kernel compilation isnt included in the timings
+    runPipeline(hostIn, hostOut, streams, deviceBuffers, 1);
+
+    for(int i = 0; i < N; i++) {
+        hostOut[i] = -1;
+    }
+    double serialMs = runPipeline(hostIn, hostOut, streams, deviceBuffers, 1);
+    checkResults(hostIn, hostOut);
+
+    for(int i = 0; i < N; i++) {
+        hostOut[i] = -1;
+    }
+    double overlappedMs = runPipeline(hostIn, hostOut, streams, deviceBuffers, 2);
+    checkResults(hostIn, hostOut);
+
+    cout << "serial: " << serialMs << "ms" << endl;
+    cout << "double-buffered: " << overlappedMs << "ms" << endl;
+    cout << "speedup: " << (serialMs / overlappedMs) << endl;
+
+    for(int s = 0; s < 2; s++) {
+        cuMemFree(deviceBuffers[s]);
+        cuStreamDestroy(streams[s]);
+    }
+    cuMemFreeHost(hostIn);
+    cuMemFreeHost(hostOut);
+    cout << "finished" << endl;
+    return 0;
+}
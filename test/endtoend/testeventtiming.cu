@@ -0,0 +1,62 @@
+// tests cudaEventElapsedTime
+
+#include <iostream>
+#include <cstdlib>
+#include <cassert>
+
+using namespace std;
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+__global__ void longKernel(float *data, int N, float value) {
+    for(int i = 0; i < N; i++) {
+        data[i] += value;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // timing needs profiling queues, which are created along with the context
+    setenv("COCL_PROFILING", "1", 1);
+
+    const int N = 102400;
+    CUstream stream;
+    cuStreamCreate(&stream, 0);
+
+    CUdeviceptr deviceFloats;
+    cuMemAlloc(&deviceFloats, N * sizeof(float));
+
+    cudaEvent_t start;
+    cudaEvent_t stop;
+    cudaEvent_t untimed;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+    cudaEventCreateWithFlags(&untimed, cudaEventDisableTiming);
+
+    // start on the default stream, stop on another one
+    longKernel<<<dim3(N / 32, 1, 1), dim3(32, 1, 1)>>>((float *)deviceFloats, N, 3.0f);
+    cudaEventRecord(start);
+    cudaEventSynchronize(start);
+    longKernel<<<dim3(N / 32, 1, 1), dim3(32, 1, 1), 0, stream>>>((float *)deviceFloats, N, 3.0f);
+    cudaEventRecord(stop, stream);
+    cudaEventRecord(untimed, stream);
+    cudaEventSynchronize(stop);
+    cudaEventSynchronize(untimed);
+
+    float ms = -1;
+    size_t res = cudaEventElapsedTime(&ms, start, stop);
+    cout << "elapsed " << ms << "ms" << endl;
+    assert(res == cudaSuccess);
+    assert(ms > 0);
+
+    res = cudaEventElapsedTime(&ms, start, untimed);
+    assert(res != cudaSuccess);
+
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    cudaEventDestroy(untimed);
+    cuMemFree(deviceFloats);
+    cuStreamDestroy(stream);
+    cout << "finished" << endl;
+    return 0;
+}
@@ -0,0 +1,151 @@
+// tests capturing kernels and copies into a cuda graph, and launching it
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+struct Scale {
+    float scale;
+    float offset;
+};
+
+__global__ void addOne(float *data, int N) {
+    int tid = blockIdx.x * blockDim.x + threadIdx.x;
+    if(tid < N) {
+        data[tid] += 1.0f;
+    }
+}
+
+__global__ void scaleInto(float *out, float *in, Scale s, int N) {
+    int tid = blockIdx.x * blockDim.x + threadIdx.x;
+    if(tid < N) {
+        out[tid] = in[tid] * s.scale + s.offset;
+    }
+}
+
+void check(float *values, int N, float expected) {
+    for(int i = 0; i < N; i++) {
+        if(values[i] != expected) {
+            ostringstream ss;
+            ss << "values[" << i << "] is " << values[i] << ", expected " << expected;
+            throw runtime_error(ss.str());
+        }
+    }
+}
+
+void test1() {
+    // kernels, with pointer, int and struct args, and copies, replayed several times
+    const int N = 1024;
+    cudaStream_t stream;
+    cudaStreamCreate(&stream);
+
+    float *a;
+    float *b;
+    cudaMalloc((void **)&a, N * sizeof(float));
+    cudaMalloc((void **)&b, N * sizeof(float));
+    float *hostIn = new float[N];
+    float *hostOut = new float[N];
+    for(int i = 0; i < N; i++) {
+        hostIn[i] = 0.0f;
+        hostOut[i] = -1.0f;
+    }
+
+    cudaStreamBeginCapture(stream, cudaStreamCaptureModeGlobal);
+    cudaStreamCaptureStatus status;
+    cudaStreamIsCapturing(stream, &status);
+    if(status != cudaStreamCaptureStatusActive) {
+        throw runtime_error("stream should be capturing");
+    }
+    cudaMemcpyAsync(a, hostIn, N * sizeof(float), cudaMemcpyHostToDevice, stream);
+    addOne<<<dim3(N / 32, 1, 1), dim3(32, 1, 1), 0, stream>>>(a, N);
+    addOne<<<dim3(N / 32, 1, 1), dim3(32, 1, 1), 0, stream>>>(a, N);
+    Scale s = { 2.0f, 3.0f };
+    scaleInto<<<dim3(N / 32, 1, 1), dim3(32, 1, 1), 0, stream>>>(b, a, s, N);
+    s.scale = 100.0f;  // by-value args are captured as they were at the launch
+    cudaMemcpyAsync(hostOut, b, N * sizeof(float), cudaMemcpyDeviceToHost, stream);
+    cudaGraph_t graph;
+    if(cudaStreamEndCapture(stream, &graph) != cudaSuccess) {
+        throw runtime_error("cudaStreamEndCapture failed");
+    }
+
+    // nothing should have run whilst capturing
+    cudaStreamSynchronize(stream);
+    check(hostOut, N, -1.0f);
+
+    cudaGraphExec_t graphExec;
+    cudaGraphInstantiate(&graphExec, graph, 0, 0, 0);
+    cudaGraphDestroy(graph);
+
+    for(int it = 0; it < 3; it++) {
+        // host memory is read when the graph runs, not when it was captured
+        for(int i = 0; i < N; i++) {
+            hostIn[i] = (float)it;
+        }
+        cudaGraphLaunch(graphExec, stream);
+        cudaStreamSynchronize(stream);
+        cout << "launch " << it << " hostOut[0]=" << hostOut[0] << endl;
+        check(hostOut, N, (it + 2.0f) * 2.0f + 3.0f);
+    }
+
+    // on another stream, the launch still sees the earlier launches
+    cudaStream_t stream2;
+    cudaStreamCreate(&stream2);
+    cudaGraphLaunch(graphExec, stream2);
+    cudaStreamSynchronize(stream2);
+    check(hostOut, N, (2.0f + 2.0f) * 2.0f + 3.0f);
+
+    // normal launches of the same kernels still work, and dont disturb the graph's args
+    addOne<<<dim3(N / 32, 1, 1), dim3(32, 1, 1), 0, stream>>>(b, N);
+    cudaMemcpy(hostOut, b, N * sizeof(float), cudaMemcpyDeviceToHost);
+    check(hostOut, N, (2.0f + 2.0f) * 2.0f + 3.0f + 1.0f);
+    cudaGraphLaunch(graphExec, stream);
+    cudaStreamSynchronize(stream);
+    check(hostOut, N, (2.0f + 2.0f) * 2.0f + 3.0f);
+
+    cudaGraphExecDestroy(graphExec);
+    cudaStreamDestroy(stream2);
+    cudaStreamDestroy(stream);
+    cudaFree(a);
+    cudaFree(b);
+    delete[] hostIn;
+    delete[] hostOut;
+}
+
+void test2() {
+    // synchronizing a capturing stream invalidates the capture
+    cudaStream_t stream;
+    cudaStreamCreate(&stream);
+    float *a;
+    cudaMalloc((void **)&a, 128 * sizeof(float));
+
+    cudaStreamBeginCapture(stream, cudaStreamCaptureModeGlobal);
+    addOne<<<dim3(4, 1, 1), dim3(32, 1, 1), 0, stream>>>(a, 128);
+    if(cudaStreamSynchronize(stream) != cudaErrorStreamCaptureUnsupported) {
+        throw runtime_error("cudaStreamSynchronize should fail whilst capturing");
+    }
+    cudaGraph_t graph;
+    if(cudaStreamEndCapture(stream, &graph) != cudaErrorStreamCaptureInvalidated || graph != 0) {
+        throw runtime_error("capture should have been invalidated");
+    }
+    if(cudaStreamEndCapture(stream, &graph) != cudaErrorStreamCaptureUnmatched) {
+        throw runtime_error("stream should no longer be capturing");
+    }
+
+    cudaFree(a);
+    cudaStreamDestroy(stream);
+}
+
+int main(int argc, char *argv[]) {
+    cout << "test1" << endl;
+    test1();
+    cout << "test2" << endl;
+    test2();
+    cout << "finished" << endl;
+    return 0;
+}
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 
 using namespace std;
 
@@ -92,11 +93,44 @@ void test2() {
     cuStreamDestroy(stream);
 }
 
+void test3() {
+    // cuStreamQuery shouldnt block, so we should be able to poll it until the kernel finishes
+    const int N = 102400;
+
+    CUstream stream;
+    cuStreamCreate(&stream, 0);
+
+    CUdeviceptr deviceFloats;
+    cuMemAlloc(&deviceFloats, N * sizeof(float));
+    cuMemsetD32(deviceFloats, 0, N);
+    cuCtxSynchronize();
+
+    longKernel<<<dim3(102400 / 32, 1, 1), dim3(32, 1, 1), 0, stream>>>((float *)deviceFloats, N, 3.0f);
+    int numPolls = 0;
+    while(cuStreamQuery(stream) == cudaErrorNotReady) {
+        numPolls++;
+    }
+    cout << "polled " << numPolls << " times" << endl;
+    // once it reports finished, it should stay finished
+    if(cuStreamQuery(stream) != CUDA_SUCCESS) {
+        throw runtime_error("stream not finished, after reporting finished");
+    }
+
+    float hostFloats[10];
+    cuMemcpyDtoH(hostFloats, deviceFloats, 10 * sizeof(float));
+    dump(hostFloats, 10);
+
+    cuMemFree(deviceFloats);
+    cuStreamDestroy(stream);
+}
+
 int main(int argc, char *argv[]) {
     cout << "test1" << endl;
     test1();
     cout << "test2" << endl;
     test2();
+    cout << "test3" << endl;
+    test3();
 
     return 0;
 }
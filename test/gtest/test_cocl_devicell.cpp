@@ -0,0 +1,49 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/cocl_devicell.h"
+
+#include <iostream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+using namespace std;
+using namespace cocl;
+
+namespace {
+
+TEST(test_cocl_devicell, test_text_passes_through) {
+    string text = "; ModuleID = 'foo.cu'\ndefine void @foo() {\n  ret void\n}\n";
+    EXPECT_FALSE(isEncodedDeviceBitcode(text.c_str()));
+    EXPECT_EQ(text, decodeDeviceCode(text.c_str()));
+}
+
+TEST(test_cocl_devicell, test_bitcode_roundtrip) {
+    // bitcode contains zeros, and repeats a lot, so should compress
+    string bitcode = string("BC\xc0\xde", 4);
+    for(int i = 0; i < 1000; i++) {
+        bitcode += string("\0\1\2\3abc", 7);
+    }
+    for(int compress = 0; compress <= 1; compress++) {
+        string encoded = encodeDeviceBitcode(bitcode, compress != 0);
+        EXPECT_TRUE(isEncodedDeviceBitcode(encoded.c_str()));
+        EXPECT_EQ(bitcode, decodeDeviceCode(encoded.c_str()));
+        if(compress) {
+            cout << "bitcode bytes " << bitcode.size() << " encoded bytes " << encoded.size() << endl;
+        }
+    }
+}
+
+} // namespace
@@ -0,0 +1,227 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/cocl_memory.h"
+
+#include "cocl/cocl_context.h"
+#include "cocl/cocl_streams.h"
+#include "cocl/cocl_defs.h"
+#include "EasyCL/EasyCL.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "gtest/gtest.h"
+
+using namespace std;
+using namespace cocl;
+
+namespace {
+
+TEST(test_cocl_memory, test_find_memory) {
+    vector<Memory *> memories;
+    for(int i = 0; i < 20; i++) {
+        memories.push_back(Memory::newDeviceAlloc(100 + i * 37));
+    }
+    for(int i = 0; i < memories.size(); i++) {
+        Memory *memory = memories[i];
+        const char *start = (const char *)memory->fakePos;
+        EXPECT_EQ(memory, findMemory(start));
+        EXPECT_EQ(memory, findMemory(start + memory->bytes / 2));
+        EXPECT_EQ(memory, findMemory(start + memory->bytes - 1));
+        EXPECT_EQ(memory, findMemoryByClmem(memory->clmem));
+        // each allocation has a vmem segment of its own, so there is always a gap after it
+        EXPECT_EQ((Memory *)0, findMemory(start + memory->bytes));
+    }
+    EXPECT_EQ((Memory *)0, findMemory((const char *)0));
+
+    // hit the per-thread cache, then free, and check we dont get the freed memory back
+    Memory *victim = memories[5];
+    const char *victimPos = (const char *)victim->fakePos;
+    cl_mem victimClmem = victim->clmem;
+    EXPECT_EQ(victim, findMemory(victimPos));
+    delete victim;
+    memories.erase(memories.begin() + 5);
+    EXPECT_EQ((Memory *)0, findMemory(victimPos));
+    EXPECT_EQ((Memory *)0, findMemoryByClmem(victimClmem));
+    EXPECT_EQ(memories[5], findMemory((const char *)memories[5]->fakePos));
+
+    for(int i = 0; i < memories.size(); i++) {
+        delete memories[i];
+    }
+}
+
+TEST(test_cocl_memory, test_vmem_segments) {
+    Context *context = getThreadVars()->getContext();
+    Memory *memory1 = Memory::newDeviceAlloc(1000);
+    Memory *memory2 = Memory::newDeviceAlloc(1000);
+    EXPECT_EQ(memory1->vmemSegment << COCL_VMEM_SEGMENT_SHIFT, memory1->fakePos);
+    EXPECT_NE(memory1->vmemSegment, memory2->vmemSegment);
+    EXPECT_EQ(memory1, context->vmemSegments[memory1->vmemSegment - 1]);
+    EXPECT_EQ(memory2, context->vmemSegments[memory2->vmemSegment - 1]);
+
+    // freed segments are reused, so the segment table only grows to the most allocations at once
+    size_t segment1 = memory1->vmemSegment;
+    size_t numSegments = context->vmemSegments.size();
+    delete memory1;
+    EXPECT_EQ((Memory *)0, context->vmemSegments[segment1 - 1]);
+    Memory *memory3 = Memory::newDeviceAlloc(2000);
+    EXPECT_EQ(segment1, memory3->vmemSegment);
+    EXPECT_EQ(numSegments, context->vmemSegments.size());
+    EXPECT_EQ(memory3, findMemory((const char *)memory3->fakePos + 1999));
+
+    delete memory2;
+    delete memory3;
+}
+
+TEST(test_cocl_memory, test_vmem_segments_shrink) {
+    Context *context = getThreadVars()->getContext();
+    size_t numSegmentsBefore = context->vmemSegments.size();
+    vector<Memory *> memories;
+    for(int i = 0; i < 300; i++) {
+        memories.push_back(Memory::newDeviceAlloc(1000));
+    }
+    EXPECT_TRUE(context->vmemSegments.size() >= 300);
+
+    // keep two, near the start, and free the rest. The table shrinks back to the last segment in use
+    Memory *keep1 = memories[3];
+    Memory *keep2 = memories[10];
+    for(int i = 0; i < (int)memories.size(); i++) {
+        if(memories[i] != keep1 && memories[i] != keep2) {
+            delete memories[i];
+        }
+    }
+    EXPECT_EQ(std::max(numSegmentsBefore, keep2->vmemSegment), context->vmemSegments.size());
+    EXPECT_EQ(keep2, context->vmemSegments[keep2->vmemSegment - 1]);
+
+    // the lowest free segments are used first, so the table doesnt grow again
+    Memory *memory = Memory::newDeviceAlloc(1000);
+    EXPECT_TRUE(memory->vmemSegment < keep2->vmemSegment);
+    EXPECT_EQ(std::max(numSegmentsBefore, keep2->vmemSegment), context->vmemSegments.size());
+
+    delete memory;
+    delete keep2;
+    EXPECT_EQ(std::max(numSegmentsBefore, keep1->vmemSegment), context->vmemSegments.size());
+    delete keep1;
+    EXPECT_EQ(numSegmentsBefore, context->vmemSegments.size());
+}
+
+TEST(test_cocl_memory, test_memory_pool_reuse) {
+    trimMemoryPool(0);
+    MemoryPoolStats before = getMemoryPoolStats();
+
+    Memory *memory1 = Memory::newDeviceAlloc(1000);
+    EXPECT_EQ(1024u, memory1->allocatedBytes);
+    cl_mem clmem1 = memory1->clmem;
+    delete memory1;
+    EXPECT_EQ(before.bytesCached + 1024, getMemoryPoolStats().bytesCached);
+
+    // same size class, so should get the same buffer back, without calling the driver
+    Memory *memory2 = Memory::newDeviceAlloc(700);
+    EXPECT_EQ(clmem1, memory2->clmem);
+    MemoryPoolStats after = getMemoryPoolStats();
+    EXPECT_EQ(before.numHits + 1, after.numHits);
+    EXPECT_EQ(before.numDriverAllocs + 1, after.numDriverAllocs);
+    EXPECT_EQ(before.bytesRequested + 700, after.bytesRequested);
+    EXPECT_EQ(before.bytesAllocated + 1024, after.bytesAllocated);
+
+    delete memory2;
+    trimMemoryPool(0);
+    EXPECT_EQ(0u, getMemoryPoolStats().bytesCached);
+    EXPECT_EQ(0u, getMemoryPoolStats().numCachedBlocks);
+}
+
+TEST(test_cocl_memory, test_host_alloc) {
+    float *hostFloats;
+    cuMemHostAlloc((void **)&hostFloats, 1000 * sizeof(float));
+    HostAllocation *hostAllocation = findHostAllocation(hostFloats);
+    EXPECT_EQ((char *)hostFloats, hostAllocation->hostPos);
+    EXPECT_EQ(hostAllocation, findHostAllocation(hostFloats + 999));
+    EXPECT_EQ((HostAllocation *)0, findHostAllocation(hostFloats + 1000));
+    float pageable[10];
+    EXPECT_EQ((HostAllocation *)0, findHostAllocation(pageable));
+
+    // the device pointer should address the same buffer, at the same offset
+    CUdeviceptr devicePointer;
+    cuMemHostGetDevicePointer(&devicePointer, hostFloats + 10, 0);
+    Memory *memory = findMemory((const char *)devicePointer);
+    EXPECT_EQ(hostAllocation->deviceMemory, memory);
+    EXPECT_EQ(10 * sizeof(float), memory->getOffset((const char *)devicePointer));
+
+    // copies from and to the host pointer are device-side copies, via the host allocation's buffer
+    for(int i = 0; i < 1000; i++) {
+        hostFloats[i] = i;
+    }
+    float *gpuFloats;
+    cudaMalloc((void **)&gpuFloats, 1000 * sizeof(float));
+    cudaMemcpy(gpuFloats, hostFloats, 1000 * sizeof(float), cudaMemcpyHostToDevice);
+    float check[1000];
+    cudaMemcpy(check, gpuFloats, 1000 * sizeof(float), cudaMemcpyDeviceToHost);
+    for(int i = 0; i < 1000; i++) {
+        EXPECT_EQ((float)i, check[i]);
+    }
+
+    // copies through the device pointer should land in the host memory, once synchronized
+    cudaMemcpy((void *)devicePointer, gpuFloats + 500, 10 * sizeof(float), cudaMemcpyDeviceToDevice);
+    cudaStreamSynchronize(0);
+    for(int i = 0; i < 10; i++) {
+        EXPECT_EQ((float)(500 + i), hostFloats[10 + i]);
+    }
+
+    // and the host can still write to it afterwards, for the next copy
+    hostFloats[999] = -3.0f;
+    cudaMemcpy(gpuFloats, hostFloats + 999, sizeof(float), cudaMemcpyHostToDevice);
+    cudaMemcpy(hostFloats, gpuFloats, sizeof(float), cudaMemcpyDeviceToHost);
+    EXPECT_EQ(-3.0f, hostFloats[0]);
+    cudaFree(gpuFloats);
+
+    // the device pointer belongs to the host allocation
+    EXPECT_THROW(cudaFree((void *)devicePointer), runtime_error);
+    EXPECT_EQ(hostAllocation->deviceMemory, findMemory((const char *)devicePointer));
+
+    cuMemFreeHost(hostFloats);
+    EXPECT_EQ((HostAllocation *)0, findHostAllocation(hostFloats));
+    EXPECT_EQ((Memory *)0, findMemory((const char *)devicePointer));
+}
+
+TEST(test_cocl_memory, test_memset_async_unaligned) {
+    const int N = 1000;
+    char *gpuMemory;
+    cudaMalloc((void **)&gpuMemory, N);
+    vector<unsigned char> hostMemory(N, 0);
+    cudaMemcpy(gpuMemory, &hostMemory[0], N, cudaMemcpyHostToDevice);
+
+    // offsets and lengths chosen so that some fills are entirely inside one 16-byte word,
+    // and some have unaligned bytes at both ends
+    int offsets[] = {0, 3, 17, 100, 301};
+    int counts[] = {1, 5, 13, 400, 699};
+    for(int i = 0; i < 5; i++) {
+        cudaMemsetAsync(gpuMemory + offsets[i], i + 1, counts[i], 0);
+        for(int j = offsets[i]; j < offsets[i] + counts[i]; j++) {
+            hostMemory[j] = i + 1;
+        }
+    }
+    cudaStreamSynchronize(0);
+
+    vector<unsigned char> result(N, 99);
+    cudaMemcpy(&result[0], gpuMemory, N, cudaMemcpyDeviceToHost);
+    for(int j = 0; j < N; j++) {
+        EXPECT_EQ((int)hostMemory[j], (int)result[j]);
+    }
+    cudaFree(gpuMemory);
+}
+
+} // namespace
@@ -130,11 +130,11 @@ TEST(test_function_dumper, basic1) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl: [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void someKernel(global char* clmem0, unsigned long clmem_vmem_offset0, global char* clmem1, unsigned long clmem_vmem_offset1, uint d1_offset, uint d2_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void someKernel(global char* clmem0, global char* clmem1, uint d1_offset, uint d2_offset, local int *scratch) {
     global float* d2 = (global float*)(clmem1 + d2_offset);
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v4;
@@ -173,11 +173,11 @@ TEST(test_function_dumper, basic1Ints) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl: [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void someKernelInts(global char* clmem0, unsigned long clmem_vmem_offset0, global char* clmem1, unsigned long clmem_vmem_offset1, uint d1_offset, uint d2_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void someKernelInts(global char* clmem0, global char* clmem1, uint d1_offset, uint d2_offset, local int *scratch) {
     global int* d2 = (global int*)(clmem1 + d2_offset);
     global int* d1 = (global int*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     int v4;
@@ -216,11 +216,11 @@ TEST(test_function_dumper, redundantclmems) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl: [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void someKernel(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, uint d2_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void someKernel(global char* clmem0, uint d1_offset, uint d2_offset, local int *scratch) {
     global float* d2 = (global float*)(clmem0 + d2_offset);
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v4;
@@ -258,10 +258,10 @@ TEST(test_function_dumper, usesShared1) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl: [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void usesShared(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void usesShared(global char* clmem0, uint d1_offset, local int *scratch) {
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v7[1];
@@ -295,10 +295,10 @@ TEST(test_function_dumper, usesShared2) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void usesShared2(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void usesShared2(global char* clmem0, uint d1_offset, local int *scratch) {
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v11[1];
@@ -360,10 +360,10 @@ TEST(test_function_dumper, usesPointerFunction) {
     os.str("");
     functionDumper2->toCl(os);
     cout << "cl, F2: [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel global float* returnsPointer_g(global char* clmem0, unsigned long clmem_vmem_offset0, uint in_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel global float* returnsPointer_g(global char* clmem0, uint in_offset, local int *scratch) {
     global float* in = (global float*)(clmem0 + in_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
 
@@ -384,10 +384,10 @@ v1:;
     os.str("");
     functionDumper->toCl(os);
     cout << "cl, F: [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void usesPointerFunction(global char* clmem0, unsigned long clmem_vmem_offset0, uint in_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void usesPointerFunction(global char* clmem0, uint in_offset, local int *scratch) {
     global float* in = (global float*)(clmem0 + in_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     global float* v2;
@@ -416,10 +416,10 @@ TEST(test_function_dumper, returnsFloatConstant) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel float returnsFloatConstant(global char* clmem0, unsigned long clmem_vmem_offset0, uint in_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel float returnsFloatConstant(global char* clmem0, uint in_offset, local int *scratch) {
     global float* in = (global float*)(clmem0 + in_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
 
@@ -446,10 +446,10 @@ TEST(test_function_dumper, testBranches_nophi) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void testBranches_nophi(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void testBranches_nophi(global char* clmem0, uint d1_offset, local int *scratch) {
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v3;
@@ -486,10 +486,10 @@ TEST(test_function_dumper, testBranches_onephi) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void testBranches_onephi(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void testBranches_onephi(global char* clmem0, uint d1_offset, local int *scratch) {
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v3;
@@ -529,10 +529,10 @@ TEST(test_function_dumper, testBranches_phifromfuture) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void testBranches_phifromfuture(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void testBranches_phifromfuture(global char* clmem0, uint d1_offset, local int *scratch) {
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v12;
@@ -577,10 +577,10 @@ TEST(test_function_dumper, testBranches_phifromfloat) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void testBranches_phifromfloat(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void testBranches_phifromfloat(global char* clmem0, uint d1_offset, local int *scratch) {
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v13;
@@ -623,10 +623,10 @@ TEST(test_function_dumper, multigpu_Z8getValuePf) {
     os.str("");
     functionDumper->toCl(os);
     cout << "cl [" << os.str() << "]" << endl;
-    EXPECT_EQ(R"(kernel void multigpu_Z8getValuePf(global char* clmem0, unsigned long clmem_vmem_offset0, uint outdata_offset, local int *scratch) {
+    EXPECT_EQ(R"(kernel void multigpu_Z8getValuePf(global char* clmem0, uint outdata_offset, local int *scratch) {
     global float* outdata = (global float*)(clmem0 + outdata_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v10;
@@ -663,4 +663,52 @@ v2:;
 )", os.str());
 }
 
+TEST(test_function_dumper, testBranches_exitbeforeloop) {
+    // blocks are dumped in layout order, as soon as what they use has been generated, so the exit
+    // block, which uses nothing from the loop, comes before it, even though it follows it in the cfg
+    GlobalWrapper G;
+    vector<int> c;
+    c.push_back(0);
+    LocalWrapper wrapper(G, "testBranches_exitbeforeloop", 1, c);
+    FunctionDumper *functionDumper = &wrapper.functionDumper;
+
+    bool res = wrapper.runGeneration();
+    EXPECT_TRUE(res);
+
+    ostringstream os;
+    functionDumper->toCl(os);
+    string cl = os.str();
+    cout << "cl [" << cl << "]" << endl;
+    size_t entryPos = cl.find("v1:;");
+    size_t exitPos = cl.find("v2:;");
+    size_t loopPos = cl.find("v3:;");
+    ASSERT_NE(string::npos, entryPos);
+    ASSERT_NE(string::npos, exitPos);
+    ASSERT_NE(string::npos, loopPos);
+    EXPECT_LT(entryPos, exitPos);
+    EXPECT_LT(exitPos, loopPos);
+    EXPECT_EQ(string::npos, cl.find("v2:;", exitPos + 1));
+    EXPECT_EQ(string::npos, cl.find("v3:;", loopPos + 1));
+}
+
+TEST(test_function_dumper, testBranches_deadloop) {
+    // the dead loop can never be generated, but never runs either, so we just keep its labels
+    GlobalWrapper G;
+    vector<int> c;
+    c.push_back(0);
+    LocalWrapper wrapper(G, "testBranches_deadloop", 1, c);
+    FunctionDumper *functionDumper = &wrapper.functionDumper;
+
+    bool res = wrapper.runGeneration();
+    EXPECT_TRUE(res);
+
+    ostringstream os;
+    functionDumper->toCl(os);
+    string cl = os.str();
+    cout << "cl [" << cl << "]" << endl;
+    EXPECT_NE(string::npos, cl.find("v1:;\n"));
+    EXPECT_NE(string::npos, cl.find("3.0f"));
+    EXPECT_NE(string::npos, cl.find("v2:;\nv3:;\n"));
+}
+
 } // namespace
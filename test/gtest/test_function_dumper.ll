@@ -143,3 +143,34 @@ define void @multigpu_Z8getValuePf(float* nocapture %outdata) {
   %exitcond.2 = icmp eq i32 %17, 1024
   br i1 %exitcond.2, label %1, label %2
 }
+
+; the exit block is laid out before the loop, as clang does for for.cond.cleanup
+define void @testBranches_exitbeforeloop(float *%d1) {
+entry:
+    br label %loop
+
+exit:
+    store float 1.0, float *%d1
+    ret void
+
+loop:
+    %i = phi i32 [0, %entry], [%inext, %loop]
+    %inext = add i32 %i, 1
+    %cmp = icmp slt i32 %inext, 10
+    br i1 %cmp, label %loop, label %exit
+}
+
+; a loop with no way in, whose phi can only be assigned from inside it
+define void @testBranches_deadloop(float *%d1) {
+entry:
+    store float 3.0, float *%d1
+    ret void
+
+deadhead:
+    %j = phi i32 [%jnext, %deadlatch]
+    br label %deadlatch
+
+deadlatch:
+    %jnext = add i32 %j, 1
+    br label %deadhead
+}
@@ -0,0 +1,118 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/ir-to-opencl.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using namespace std;
+using namespace cocl;
+
+namespace {
+
+string ll = R"(
+define void @twoPointers(float *%in, float *%out) {
+    %1 = load float, float *%in
+    store float %1, float *%out
+    ret void
+}
+
+define void @pointerAndInt(float *%out, i32 %value) {
+    %1 = sitofp i32 %value to float
+    store float %1, float *%out
+    ret void
+}
+
+!nvvm.annotations = !{!0, !1}
+
+!0 = !{void (float*, float*)* @twoPointers, !"kernel", i32 1}
+!1 = !{void (float*, i32)* @pointerAndInt, !"kernel", i32 1}
+)";
+
+TEST(test_ir_to_opencl, test_precompiled_table) {
+    string table = convertAllKernelsToClTable(ll);
+
+    vector<int> distinct = {1, 2};
+    ModuleClRes precompiled;
+    ASSERT_TRUE(findPrecompiledCl(table.c_str(), "twoPointers", 3, distinct, false, 1, &precompiled));
+    ModuleClRes generated = convertLlStringToCl(3, distinct, ll, "twoPointers", getShortKernelName("twoPointers"), false);
+    EXPECT_EQ(generated.clSourcecode, precompiled.clSourcecode);
+    EXPECT_EQ(generated.usesVmem, precompiled.usesVmem);
+    EXPECT_EQ(generated.usesScratch, precompiled.usesScratch);
+
+    vector<int> single = {1};
+    ASSERT_TRUE(findPrecompiledCl(table.c_str(), "pointerAndInt", 2, single, false, 1, &precompiled));
+    generated = convertLlStringToCl(2, single, ll, "pointerAndInt", getShortKernelName("pointerAndInt"), false);
+    EXPECT_EQ(generated.clSourcecode, precompiled.clSourcecode);
+
+    // anything else should fall back to generating at runtime
+    vector<int> aliased = {1, 1};
+    EXPECT_FALSE(findPrecompiledCl(table.c_str(), "twoPointers", 2, aliased, false, 1, &precompiled));
+    EXPECT_FALSE(findPrecompiledCl(table.c_str(), "twoPointers", 3, distinct, true, 1, &precompiled));
+    EXPECT_FALSE(findPrecompiledCl(table.c_str(), "notAKernel", 3, distinct, false, 1, &precompiled));
+    EXPECT_FALSE(findPrecompiledCl(0, "twoPointers", 3, distinct, false, 1, &precompiled));
+    // the table is only for one vmem segment
+    EXPECT_FALSE(findPrecompiledCl(table.c_str(), "twoPointers", 3, distinct, false, 2, &precompiled));
+}
+
+TEST(test_ir_to_opencl, test_precompiled_table_threads) {
+    string serial = convertAllKernelsToClTable(ll, 1);
+    EXPECT_EQ(serial, convertAllKernelsToClTable(ll, 2));
+    EXPECT_EQ(serial, convertAllKernelsToClTable(ll, 0));
+}
+
+TEST(test_ir_to_opencl, test_device_module_cache) {
+    vector<int> distinct = {1, 2};
+    string expected = convertLlStringToCl(3, distinct, ll, "twoPointers", getShortKernelName("twoPointers"), false).clSourcecode;
+
+    // modules are keyed on the pointer, so each copy is a module of its own
+    vector<string> modules(maxCachedDeviceModules + 1, ll);
+    DeviceModuleCacheStats before = getDeviceModuleCacheStats();
+    ModuleClRes res = convertDeviceCodeToCl(3, distinct, modules[0].c_str(), "twoPointers", getShortKernelName("twoPointers"), false);
+    EXPECT_EQ(expected, res.clSourcecode);
+    DeviceModuleCacheStats after = getDeviceModuleCacheStats();
+    EXPECT_EQ(before.hits, after.hits);
+    EXPECT_EQ(before.misses + 1, after.misses);
+
+    vector<int> single = {1};
+    res = convertDeviceCodeToCl(2, single, modules[0].c_str(), "pointerAndInt", getShortKernelName("pointerAndInt"), false);
+    EXPECT_EQ(convertLlStringToCl(2, single, ll, "pointerAndInt", getShortKernelName("pointerAndInt"), false).clSourcecode, res.clSourcecode);
+    after = getDeviceModuleCacheStats();
+    EXPECT_EQ(before.hits + 1, after.hits);
+    EXPECT_EQ(before.misses + 1, after.misses);
+
+    // pushes modules[0] out
+    for(int i = 1; i <= maxCachedDeviceModules; i++) {
+        convertDeviceCodeToCl(3, distinct, modules[i].c_str(), "twoPointers", getShortKernelName("twoPointers"), false);
+    }
+    after = getDeviceModuleCacheStats();
+    EXPECT_EQ(before.hits + 1, after.hits);
+    EXPECT_EQ(before.misses + 1 + maxCachedDeviceModules, after.misses);
+
+    res = convertDeviceCodeToCl(3, distinct, modules[0].c_str(), "twoPointers", getShortKernelName("twoPointers"), false);
+    EXPECT_EQ(expected, res.clSourcecode);
+    after = getDeviceModuleCacheStats();
+    EXPECT_EQ(before.misses + 2 + maxCachedDeviceModules, after.misses);
+    // whereas the most recently used is still there
+    convertDeviceCodeToCl(3, distinct, modules[maxCachedDeviceModules].c_str(), "twoPointers", getShortKernelName("twoPointers"), false);
+    after = getDeviceModuleCacheStats();
+    EXPECT_EQ(before.hits + 2, after.hits);
+    EXPECT_EQ(before.misses + 2 + maxCachedDeviceModules, after.misses);
+}
+
+} // namespace
@@ -89,25 +89,26 @@ TEST(test_kernel_dumper, basic) {
 
 struct GlobalVars {
     local int *scratch;
-    global char *clmem0;
-    unsigned long clmem_vmem_offset0;
+    global char *vmemSegments[1];
 };
 
+// vmemloc is (segment << 32) + offset, and vmemSegments[i] is the buffer for segment i + 1
 inline global float *getGlobalPointer(__vmem__ unsigned long vmemloc, const struct GlobalVars* const globalVars) {
-    return (global float *)(globalVars->clmem0 + vmemloc - globalVars->clmem_vmem_offset0);
+    return (global float *)(globalVars->vmemSegments[(vmemloc >> 32) - 1] +
+        (vmemloc & 4294967295UL));
 }
 
 
 float someFunc_gg(global float* d1, global float* v11, const struct GlobalVars *const pGlobalVars);
 float someFunc_gp(global float* d1, float* v11, const struct GlobalVars *const pGlobalVars);
 float someFunc_pg(float* d1, global float* v11, const struct GlobalVars *const pGlobalVars);
-kernel void someKernel(global char* clmem0, unsigned long clmem_vmem_offset0, global char* clmem1, unsigned long clmem_vmem_offset1, uint d1_offset, uint d2_offset, local int *scratch);
+kernel void someKernel(global char* clmem0, global char* clmem1, uint d1_offset, uint d2_offset, local int *scratch);
 
-kernel void someKernel(global char* clmem0, unsigned long clmem_vmem_offset0, global char* clmem1, unsigned long clmem_vmem_offset1, uint d1_offset, uint d2_offset, local int *scratch) {
+kernel void someKernel(global char* clmem0, global char* clmem1, uint d1_offset, uint d2_offset, local int *scratch) {
     global float* d2 = (global float*)(clmem1 + d2_offset);
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v4;
@@ -175,25 +176,26 @@ TEST(test_kernel_dumper, redundant_clmems1) {
 
 struct GlobalVars {
     local int *scratch;
-    global char *clmem0;
-    unsigned long clmem_vmem_offset0;
+    global char *vmemSegments[1];
 };
 
+// vmemloc is (segment << 32) + offset, and vmemSegments[i] is the buffer for segment i + 1
 inline global float *getGlobalPointer(__vmem__ unsigned long vmemloc, const struct GlobalVars* const globalVars) {
-    return (global float *)(globalVars->clmem0 + vmemloc - globalVars->clmem_vmem_offset0);
+    return (global float *)(globalVars->vmemSegments[(vmemloc >> 32) - 1] +
+        (vmemloc & 4294967295UL));
 }
 
 
 float someFunc_gg(global float* d1, global float* v11, const struct GlobalVars *const pGlobalVars);
 float someFunc_gp(global float* d1, float* v11, const struct GlobalVars *const pGlobalVars);
 float someFunc_pg(float* d1, global float* v11, const struct GlobalVars *const pGlobalVars);
-kernel void someKernel(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, uint d2_offset, local int *scratch);
+kernel void someKernel(global char* clmem0, uint d1_offset, uint d2_offset, local int *scratch);
 
-kernel void someKernel(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, uint d2_offset, local int *scratch) {
+kernel void someKernel(global char* clmem0, uint d1_offset, uint d2_offset, local int *scratch) {
     global float* d2 = (global float*)(clmem0 + d2_offset);
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v4;
@@ -259,21 +261,22 @@ TEST(test_kernel_dumper, testBranches_phifromfuture) {
 
 struct GlobalVars {
     local int *scratch;
-    global char *clmem0;
-    unsigned long clmem_vmem_offset0;
+    global char *vmemSegments[1];
 };
 
+// vmemloc is (segment << 32) + offset, and vmemSegments[i] is the buffer for segment i + 1
 inline global float *getGlobalPointer(__vmem__ unsigned long vmemloc, const struct GlobalVars* const globalVars) {
-    return (global float *)(globalVars->clmem0 + vmemloc - globalVars->clmem_vmem_offset0);
+    return (global float *)(globalVars->vmemSegments[(vmemloc >> 32) - 1] +
+        (vmemloc & 4294967295UL));
 }
 
 
-kernel void testBranches_phifromfuture(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, local int *scratch);
+kernel void testBranches_phifromfuture(global char* clmem0, uint d1_offset, local int *scratch);
 
-kernel void testBranches_phifromfuture(global char* clmem0, unsigned long clmem_vmem_offset0, uint d1_offset, local int *scratch) {
+kernel void testBranches_phifromfuture(global char* clmem0, uint d1_offset, local int *scratch) {
     global float* d1 = (global float*)(clmem0 + d1_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v12;
@@ -319,18 +322,19 @@ TEST(test_kernel_dumper, usesPointerFunction) {
 
 struct GlobalVars {
     local int *scratch;
-    global char *clmem0;
-    unsigned long clmem_vmem_offset0;
+    global char *vmemSegments[1];
 };
 
+// vmemloc is (segment << 32) + offset, and vmemSegments[i] is the buffer for segment i + 1
 inline global float *getGlobalPointer(__vmem__ unsigned long vmemloc, const struct GlobalVars* const globalVars) {
-    return (global float *)(globalVars->clmem0 + vmemloc - globalVars->clmem_vmem_offset0);
+    return (global float *)(globalVars->vmemSegments[(vmemloc >> 32) - 1] +
+        (vmemloc & 4294967295UL));
 }
 
 
 float* returnsPointer(float* in, const struct GlobalVars *const pGlobalVars);
 global float* returnsPointer_g(global float* in, const struct GlobalVars *const pGlobalVars);
-kernel void usesPointerFunction(global char* clmem0, unsigned long clmem_vmem_offset0, uint in_offset, local int *scratch);
+kernel void usesPointerFunction(global char* clmem0, uint in_offset, local int *scratch);
 
 global float* returnsPointer_g(global float* in, const struct GlobalVars *const pGlobalVars) {
 
@@ -342,10 +346,10 @@ float* returnsPointer(float* in, const struct GlobalVars *const pGlobalVars) {
 v1:;
     return in;
 }
-kernel void usesPointerFunction(global char* clmem0, unsigned long clmem_vmem_offset0, uint in_offset, local int *scratch) {
+kernel void usesPointerFunction(global char* clmem0, uint in_offset, local int *scratch) {
     global float* in = (global float*)(clmem0 + in_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     float v3[1];
@@ -380,22 +384,23 @@ TEST(test_kernel_dumper, usesFunctionReturningVoid) {
 
 struct GlobalVars {
     local int *scratch;
-    global char *clmem0;
-    unsigned long clmem_vmem_offset0;
+    global char *vmemSegments[1];
 };
 
+// vmemloc is (segment << 32) + offset, and vmemSegments[i] is the buffer for segment i + 1
 inline global float *getGlobalPointer(__vmem__ unsigned long vmemloc, const struct GlobalVars* const globalVars) {
-    return (global float *)(globalVars->clmem0 + vmemloc - globalVars->clmem_vmem_offset0);
+    return (global float *)(globalVars->vmemSegments[(vmemloc >> 32) - 1] +
+        (vmemloc & 4294967295UL));
 }
 
 
-kernel void usesFunctionReturningVoid(global char* clmem0, unsigned long clmem_vmem_offset0, uint in_offset, local int *scratch);
+kernel void usesFunctionReturningVoid(global char* clmem0, uint in_offset, local int *scratch);
 void returnsVoid_g(global float* in, const struct GlobalVars *const pGlobalVars);
 
-kernel void usesFunctionReturningVoid(global char* clmem0, unsigned long clmem_vmem_offset0, uint in_offset, local int *scratch) {
+kernel void usesFunctionReturningVoid(global char* clmem0, uint in_offset, local int *scratch) {
     global float* in = (global float*)(clmem0 + in_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
 
@@ -431,24 +436,25 @@ TEST(test_kernel_dumper, test_randomintarray) {
 
 struct GlobalVars {
     local int *scratch;
-    global char *clmem0;
-    unsigned long clmem_vmem_offset0;
+    global char *vmemSegments[1];
 };
 
+// vmemloc is (segment << 32) + offset, and vmemSegments[i] is the buffer for segment i + 1
 inline global float *getGlobalPointer(__vmem__ unsigned long vmemloc, const struct GlobalVars* const globalVars) {
-    return (global float *)(globalVars->clmem0 + vmemloc - globalVars->clmem_vmem_offset0);
+    return (global float *)(globalVars->vmemSegments[(vmemloc >> 32) - 1] +
+        (vmemloc & 4294967295UL));
 }
 
 struct class_tensorflow__random__Array {
     int f0[4];
 };
 
-kernel void test_randomintarray(global char* clmem0, unsigned long clmem_vmem_offset0, uint data_offset, local int *scratch);
+kernel void test_randomintarray(global char* clmem0, uint data_offset, local int *scratch);
 
-kernel void test_randomintarray(global char* clmem0, unsigned long clmem_vmem_offset0, uint data_offset, local int *scratch) {
+kernel void test_randomintarray(global char* clmem0, uint data_offset, local int *scratch) {
     global int* data = (global int*)(clmem0 + data_offset);
 
-    const struct GlobalVars globalVars = { scratch, clmem0, clmem_vmem_offset0 };
+    const struct GlobalVars globalVars = { scratch, { clmem0 } };
     const struct GlobalVars* const pGlobalVars = &globalVars;
 
     int v9;
@@ -468,6 +474,35 @@ v1:;
     EXPECT_FALSE(cl.find(" = returnsVoid") != string::npos);
 }
 
+TEST(test_kernel_dumper, vmem_segments) {
+    GlobalWrapper G("someKernel");
+    KernelDumper *kernelDumper = G.kernelDumper.get();
+    kernelDumper->vmemSegmentCount = 4;
+
+    // two clmems, so the other two segments are null
+    string cl = runKernelDumper(kernelDumper, 2);
+    EXPECT_TRUE(cl.find("    global char *vmemSegments[4];\n") != string::npos);
+    EXPECT_TRUE(cl.find("    const struct GlobalVars globalVars = { scratch, { clmem0, clmem1, 0, 0 } };\n") != string::npos);
+}
+
+TEST(test_kernel_dumper, dynamic_shared) {
+    GlobalWrapper G("usesDynamicShared");
+    KernelDumper *kernelDumper = G.kernelDumper.get();
+
+    // the extern __shared__ array is only used by a function the kernel calls
+    string cl = runKernelDumper(kernelDumper, 1);
+    cout << "kernel cl: [" << cl << "]" << endl;
+    EXPECT_TRUE(kernelDumper->usesDynamicShared);
+    EXPECT_TRUE(cl.find("    local char *dynamicShared;\n};\n") != string::npos);
+    EXPECT_TRUE(cl.find("kernel void usesDynamicShared(global char* clmem0, uint d1_offset, local int *scratch, local char *dynamicShared) {\n") != string::npos);
+    EXPECT_TRUE(cl.find("    const struct GlobalVars globalVars = { scratch, { clmem0 }, dynamicShared };\n") != string::npos);
+    EXPECT_TRUE(cl.find("    local float *dynamicshared = (local float *)pGlobalVars->dynamicShared;\n") != string::npos);
+
+    GlobalWrapper G2("someKernel");
+    runKernelDumper(G2.kernelDumper.get(), 2);
+    EXPECT_FALSE(G2.kernelDumper->usesDynamicShared);
+}
+
 // TEST(test_kernel_dumper, test_long_conflicting_names) {
 //     GlobalWrapper G("mysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamec");
 //     KernelDumper *kernelDumper = G.kernelDumper.get();
@@ -54,6 +54,20 @@ define void @usesFunctionReturningVoid(float *%in) {
     ret void
 }
 
+@dynamicshared = external addrspace(3) global [0 x float], align 4
+
+define void @storesToDynamicShared(float %value) {
+    %1 = getelementptr inbounds [0 x float], [0 x float]* addrspacecast ([0 x float] addrspace(3)* @dynamicshared to [0 x float]*), i64 0, i64 5
+    store float %value, float* %1
+    ret void
+}
+
+define void @usesDynamicShared(float *%d1) {
+    %1 = load float, float *%d1
+    call void @storesToDynamicShared(float %1)
+    ret void
+}
+
 define void @mysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamemysuperlongfunctionnamea(float *%d) {
     ret void
 }
@@ -0,0 +1,162 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/cocl_program_cache.h"
+
+#include "cocl/cocl_context.h"
+#include "EasyCL/EasyCL.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+using namespace std;
+using namespace cocl;
+using namespace easycl;
+
+namespace {
+
+string sourceA = "kernel void test_program_cache(global float *data) { data[0] = 123.0f; }\n";
+string sourceB = "kernel void test_program_cache(global float *data) { data[0] = 456.0f; }\n";
+
+cl_program buildProgram(EasyCL *cl, const string &source) {
+    const char *sourcePtr = source.c_str();
+    size_t sourceSize = source.size();
+    cl_int err;
+    cl_program program = clCreateProgramWithSource(*cl->context, 1, &sourcePtr, &sourceSize, &err);
+    EasyCL::checkError(err);
+    EasyCL::checkError(clBuildProgram(program, 1, &cl->device, "", 0, 0));
+    return program;
+}
+
+vector<string> listCacheFiles(const string &dir) {
+    vector<string> paths;
+    DIR *d = opendir(dir.c_str());
+    if(d == 0) {
+        return paths;
+    }
+    while(struct dirent *entry = readdir(d)) {
+        string name = entry->d_name;
+        if(name != "." && name != "..") {
+            paths.push_back(dir + "/" + name);
+        }
+    }
+    closedir(d);
+    return paths;
+}
+
+// returns the value the program writes, or -1 if program is 0
+float runProgram(EasyCL *cl, cl_program program) {
+    if(program == 0) {
+        return -1;
+    }
+    cl_int err;
+    cl_kernel kernel = clCreateKernel(program, "test_program_cache", &err);
+    EasyCL::checkError(err);
+    cl_mem buffer = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE, sizeof(float), 0, &err);
+    EasyCL::checkError(err);
+    EasyCL::checkError(clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer));
+    size_t global = 1;
+    EasyCL::checkError(clEnqueueNDRangeKernel(*cl->queue, kernel, 1, 0, &global, 0, 0, 0, 0));
+    float value = 0;
+    EasyCL::checkError(clEnqueueReadBuffer(*cl->queue, buffer, CL_TRUE, 0, sizeof(float), &value, 0, 0, 0));
+    clReleaseMemObject(buffer);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    return value;
+}
+
+TEST(test_program_cache, test_hit_miss_corrupt_evict) {
+    EasyCL *cl = getThreadVars()->getContext()->getCl();
+    char dirTemplate[] = "/tmp/cocl_program_cache_XXXXXX";
+    ASSERT_TRUE(mkdtemp(dirTemplate) != 0);
+    string dir = dirTemplate;
+    configureProgramCache(dir, (uint64_t)512 * 1024 * 1024);
+
+    // miss
+    ProgramCacheStats before = getProgramCacheStats();
+    EXPECT_TRUE(loadCachedProgram(cl, sourceA, "") == 0);
+    ProgramCacheStats stats = getProgramCacheStats();
+    EXPECT_EQ(before.misses + 1, stats.misses);
+    EXPECT_EQ(before.hits, stats.hits);
+
+    cl_program program = buildProgram(cl, sourceA);
+    storeCachedProgram(cl, program, sourceA, "");
+    clReleaseProgram(program);
+    stats = getProgramCacheStats();
+    EXPECT_EQ(before.writes + 1, stats.writes);
+    vector<string> files = listCacheFiles(dir);
+    ASSERT_EQ(1u, files.size());
+
+    // hit
+    EXPECT_EQ(123.0f, runProgram(cl, loadCachedProgram(cl, sourceA, "")));
+    stats = getProgramCacheStats();
+    EXPECT_EQ(before.hits + 1, stats.hits);
+    // different build options, or source, miss
+    EXPECT_TRUE(loadCachedProgram(cl, sourceA, "-cl-fast-relaxed-math") == 0);
+    EXPECT_TRUE(loadCachedProgram(cl, sourceB, "") == 0);
+    stats = getProgramCacheStats();
+    EXPECT_EQ(before.hits + 1, stats.hits);
+    EXPECT_EQ(before.misses + 3, stats.misses);
+
+    // corrupt entries are removed, and count as misses
+    FILE *f = fopen(files[0].c_str(), "r+b");
+    ASSERT_TRUE(f != 0);
+    fputs("not a program binary", f);
+    fclose(f);
+    EXPECT_TRUE(loadCachedProgram(cl, sourceA, "") == 0);
+    stats = getProgramCacheStats();
+    EXPECT_EQ(before.loadFailures + 1, stats.loadFailures);
+    EXPECT_EQ(before.misses + 4, stats.misses);
+    EXPECT_EQ(0u, listCacheFiles(dir).size());
+
+    // room for one binary. Storing a second evicts the least recently used
+    program = buildProgram(cl, sourceA);
+    storeCachedProgram(cl, program, sourceA, "");
+    clReleaseProgram(program);
+    files = listCacheFiles(dir);
+    ASSERT_EQ(1u, files.size());
+    struct stat fileStat;
+    ASSERT_EQ(0, stat(files[0].c_str(), &fileStat));
+    // mtimes are only to the second, so make sure A looks older
+    struct timeval past[2] = {{1, 0}, {1, 0}};
+    ASSERT_EQ(0, utimes(files[0].c_str(), past));
+    configureProgramCache(dir, fileStat.st_size + fileStat.st_size / 2);
+    program = buildProgram(cl, sourceB);
+    storeCachedProgram(cl, program, sourceB, "");
+    clReleaseProgram(program);
+    stats = getProgramCacheStats();
+    EXPECT_EQ(before.evictions + 1, stats.evictions);
+    EXPECT_EQ(1u, listCacheFiles(dir).size());
+    EXPECT_TRUE(loadCachedProgram(cl, sourceA, "") == 0);
+    EXPECT_EQ(456.0f, runProgram(cl, loadCachedProgram(cl, sourceB, "")));
+
+    configureProgramCache("", 0);
+    files = listCacheFiles(dir);
+    for(auto it=files.begin(); it != files.end(); it++) {
+        unlink(it->c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+} // namespace
@@ -0,0 +1,110 @@
+// Copyright Hugh Perkins 2017
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cocl/cocl_streams.h"
+
+#include "cocl/cocl_context.h"
+#include "EasyCL/EasyCL.h"
+
+#include <iostream>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using namespace std;
+using namespace cocl;
+using namespace easycl;
+
+namespace {
+
+TEST(test_staging_ring, test_wraparound) {
+    ThreadVars *v = getThreadVars();
+    EasyCL *cl = v->getContext()->getCl();
+    cl_command_queue queue = v->currentContext->default_stream.get()->clqueue->queue;
+    StagingRing ring(cl, 1024);
+
+    vector<char> data(300);
+    for(int i = 0; i < (int)data.size(); i++) {
+        data[i] = (char)i;
+    }
+    size_t offset0 = 0;
+    size_t offset1 = 0;
+    size_t offset2 = 0;
+    ASSERT_TRUE(ring.upload(queue, &data[0], data.size(), &offset0));
+    ASSERT_TRUE(ring.upload(queue, &data[0], data.size(), &offset1));
+    EXPECT_EQ(0u, offset0);
+    EXPECT_EQ(384u, offset1);  // rounded up to 128 bytes
+
+    // no room at the end, and the start is still in use, so this should fail, rather than wait
+    EXPECT_FALSE(ring.upload(queue, &data[0], data.size(), &offset2));
+
+    cl_event event;
+    EasyCL::checkError(clEnqueueMarkerWithWaitList(queue, 0, 0, &event));
+    ring.retire(offset0, event);
+    EasyCL::checkError(clFinish(queue));
+    ASSERT_TRUE(ring.upload(queue, &data[0], data.size(), &offset2));
+    EXPECT_EQ(0u, offset2);
+
+    vector<char> readBack(data.size());
+    EasyCL::checkError(clEnqueueReadBuffer(queue, ring.clmem, CL_TRUE, offset2, data.size(), &readBack[0], 0, 0, 0));
+    EXPECT_EQ(data, readBack);
+
+    EasyCL::checkError(clEnqueueMarkerWithWaitList(queue, 0, 0, &event));
+    ring.retire(offset1, event);
+    EasyCL::checkError(clEnqueueMarkerWithWaitList(queue, 0, 0, &event));
+    ring.retire(offset2, event);
+    EasyCL::checkError(clFinish(queue));
+}
+
+TEST(test_staging_ring, test_unaligned_size) {
+    // the region is rounded up to the alignment, but only the caller's bytes are read
+    ThreadVars *v = getThreadVars();
+    EasyCL *cl = v->getContext()->getCl();
+    cl_command_queue queue = v->currentContext->default_stream.get()->clqueue->queue;
+    StagingRing ring(cl, 1024);
+
+    vector<char> zeros(1024, 0);
+    EasyCL::checkError(clEnqueueWriteBuffer(queue, ring.clmem, CL_TRUE, 0, zeros.size(), &zeros[0], 0, 0, 0));
+
+    // the source is followed by bytes which arent part of it, and mustnt reach the device
+    const size_t N = 100;
+    vector<char> source(256, (char)0x7f);
+    for(size_t i = 0; i < N; i++) {
+        source[i] = (char)(i + 1);
+    }
+    size_t offset0 = 0;
+    size_t offset1 = 0;
+    ASSERT_TRUE(ring.upload(queue, &source[0], N, &offset0));
+    ASSERT_TRUE(ring.upload(queue, &source[0], N, &offset1));
+    EXPECT_EQ(0u, offset0);
+    EXPECT_EQ(128u, offset1);
+
+    vector<char> readBack(256);
+    EasyCL::checkError(clEnqueueReadBuffer(queue, ring.clmem, CL_TRUE, 0, readBack.size(), &readBack[0], 0, 0, 0));
+    for(size_t region = 0; region < 2; region++) {
+        for(size_t i = 0; i < 128; i++) {
+            char expected = i < N ? (char)(i + 1) : (char)0;
+            EXPECT_EQ(expected, readBack[region * 128 + i]) << "region " << region << " byte " << i;
+        }
+    }
+
+    cl_event event;
+    EasyCL::checkError(clEnqueueMarkerWithWaitList(queue, 0, 0, &event));
+    ring.retire(offset0, event);
+    EasyCL::checkError(clEnqueueMarkerWithWaitList(queue, 0, 0, &event));
+    ring.retire(offset1, event);
+    EasyCL::checkError(clFinish(queue));
+}
+
+} // namespace